@@ -20,6 +20,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <sys/types.h>
 #include "system4.h"
 #include "system4/file.h"
 
@@ -31,6 +32,9 @@
 void set_input_encoding(const char *enc);
 void set_output_encoding(const char *enc);
 void set_encodings(const char *input_enc, const char *output_enc);
+const char *get_input_encoding(void);
+const char *get_output_encoding(void);
+void conv_thread_fini(void);
 
 char *conv_output(const char *str);
 char *conv_output_len(const char *str, size_t len);
@@ -56,6 +60,16 @@ void conv_cmdline_utf8(int *pargc, char ***pargv);
 
 struct stat;
 
+/* compress.c */
+void zlib_set_level(int level);
+int zlib_get_level(void);
+void zlib_set_jobs(int nr_jobs);
+uint8_t *zlib_compress(const uint8_t *src, size_t size, size_t *size_out);
+
+/* hash.c */
+uint64_t hash64(const void *data, size_t size);
+void sha256(const void *data, size_t size, uint8_t digest[32]);
+
 /* util.c */
 char *escape_string(const char *str);
 char *escape_string_noconv(const char *str);
@@ -64,6 +78,7 @@ void checked_fwrite(void *ptr, size_t size, FILE *stream);
 void checked_fread(void *ptr, size_t size, FILE *stream);
 UDIR *checked_opendir(const char *path);
 void checked_stat(const char *path, ustat *s);
+bool copy_fd_range(int in_fd, off_t off, size_t size, int out_fd);
 void mkdir_for_file(const char *filename);
 void chdir_to_file(const char *filename);
 struct string *replace_extension(const char *file, const char *ext);
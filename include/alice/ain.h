@@ -42,6 +42,8 @@ enum {
 
 #define DASM_FUNC_STACK_SIZE 16
 
+struct jump_target;
+
 struct dasm_state {
 	struct ain *ain;
 	uint32_t flags;
@@ -50,6 +52,11 @@ struct dasm_state {
 	int func;
 	int func_stack[DASM_FUNC_STACK_SIZE];
 	const struct instruction *instr;
+	// jump targets, sorted by address
+	struct jump_target *jump_targets;
+	size_t nr_jump_targets;
+	// index of the first jump target at or after the last printed address
+	size_t jump_cursor;
 };
 
 typedef struct {
@@ -72,7 +79,7 @@ void dasm_reset(struct dasm_state *dasm);
 dasm_save_t dasm_save(struct dasm_state *dasm);
 void dasm_restore(struct dasm_state *dasm, dasm_save_t save);
 int32_t dasm_arg(struct dasm_state *dasm, unsigned int n);
-bool dasm_is_jump_target(struct dasm_state *dasm);
+bool dasm_is_jump_target(struct dasm_state *dasm, size_t addr);
 bool dasm_print_macro(struct dasm_state *dasm);
 void dasm_print_identifier(struct dasm_state *dasm, const char *str);
 void dasm_print_local_variable(struct dasm_state *dasm, struct ain_function *func, int varno);
@@ -80,6 +87,9 @@ void dasm_print_string(struct dasm_state *dasm, const char *str);
 void ain_disassemble(struct port *port, struct ain *ain, unsigned int flags);
 bool _ain_disassemble_function(struct port *port, struct ain *ain, int fno, unsigned int flags);
 bool ain_disassemble_function(struct port *port, struct ain *ain, char *name, unsigned int flags);
+// must be called before freeing (or modifying the CODE section of) an ain
+// that was passed to ain_disassemble_function
+void ain_disassemble_invalidate(struct ain *ain);
 
 // dump.c
 void ain_dump_function(struct port *port, struct ain *ain, struct ain_function *f);
@@ -95,7 +105,7 @@ void ain_dump_enum(struct port *port, struct ain *ain, int i);
 void ain_guess_filenames(struct ain *ain);
 
 // json_dump.c
-void ain_dump_json(FILE *out, struct ain *ain);
+void ain_dump_json(struct port *port, struct ain *ain);
 
 // json_read.c
 void ain_read_json(const char *filename, struct ain *ain);
@@ -18,13 +18,22 @@
 #define ALICE_AR_H_
 
 #include <stddef.h>
+#include <stdio.h>
+#include <time.h>
 #include "kvec.h"
 #include "system4/cg.h"
 
+struct archive;
+struct archive_data;
+struct ar_filter;
+struct tar_writer;
+struct ar_dedup;
+
 enum {
 	AR_RAW = 1,
 	AR_FORCE = 2,
 	AR_IMAGES_ONLY = 4,
+	AR_INCREMENTAL = 8,
 };
 
 #define AR_IMGENC(flags) ((flags & 0xFF000000UL) >> 24)
@@ -125,6 +134,7 @@ struct ar_manifest {
 enum ar_file_spec_type {
 	AR_FILE_SPEC_DISK,
 	AR_FILE_SPEC_MEM,
+	AR_FILE_SPEC_ARCHIVE,
 };
 
 struct ar_file_spec {
@@ -133,24 +143,224 @@ struct ar_file_spec {
 		// AR_FILE_SPEC_DISK
 		struct {
 			struct string *path;
+			// size and modification time, if known (0 otherwise)
+			uint64_t size;
+			time_t mtime;
 		} disk;
 		// AR_FILE_SPEC_MEM
 		struct {
 			void *data;
 			size_t size;
 		} mem;
+		// AR_FILE_SPEC_ARCHIVE: an entry of an open archive, loaded
+		// (i.e. mapped, for mmapped archives) only while it is written
+		struct {
+			struct archive_data *data;
+		} archive;
 	};
 	struct string *name;
 };
 
+// Options for writing .afa archives. A NULL options pointer selects the
+// defaults below.
+struct ar_pack_options {
+	int afa_version;
+	// number of threads converting and reading input files (0 = one per CPU)
+	int nr_jobs;
+	// upper bound on the memory used to buffer input data
+	size_t buffer_size;
+	// directory in which converted files are cached between runs (or NULL)
+	const char *cache_dir;
+	// upper bound on the size of the cache
+	uint64_t cache_size;
+	// store identical files once
+	bool dedup;
+	// alignment of entries in the DATA section (a power of two; at least 8),
+	// applied only to entries of at least `align_threshold` bytes; smaller
+	// entries are aligned to 8 bytes
+	uint32_t align;
+	uint64_t align_threshold;
+	// file listing entry names in the order in which their data should be
+	// laid out (or NULL to lay out entries in index order)
+	const char *order_file;
+};
+
+#define AR_PACK_DEFAULT_BUFFER_SIZE (64 * 1024 * 1024)
+#define AR_PACK_DEFAULT_CACHE_SIZE (1024ULL * 1024 * 1024)
+#define AR_PACK_OPTIONS_DEFAULT { \
+	.afa_version = 2, \
+	.nr_jobs = 0, \
+	.buffer_size = AR_PACK_DEFAULT_BUFFER_SIZE, \
+	.cache_dir = NULL, \
+	.cache_size = AR_PACK_DEFAULT_CACHE_SIZE, \
+	.dedup = false, \
+	.align = 8, \
+	.align_threshold = 0, \
+	.order_file = NULL, \
+}
+
+struct ar_index_entry;
+
 enum ar_filetype ar_parse_filetype(struct string *str);
-void write_afa(struct string *filename, struct ar_file_spec **files, size_t nr_files, int version);
+
+// write_afa.c
+#define AFA_HEADER_SIZE 44
+uint32_t afa_id_of_filename(const char *name);
+uint8_t *afa_build_index(struct ar_index_entry *entries, size_t nr_entries, int version,
+		uint32_t base, unsigned long *size_out, unsigned long *uncompressed_size_out);
+void afa_write_header(FILE *f, int version, size_t nr_entries, uint32_t data_start,
+		uint8_t *file_table, unsigned long file_table_len, unsigned long uncompressed_size,
+		uint64_t data_size);
+void write_afa(struct string *filename, struct ar_file_spec **files, size_t nr_files,
+		const struct ar_pack_options *opt);
+
+// update.c
+enum {
+	// rewrite the whole archive without unused data afterwards
+	AR_UPDATE_COMPACT = 1,
+	// assume that files of the same size which are older than the archive
+	// are unchanged, rather than comparing them with the archive's copy
+	AR_UPDATE_TRUST_MTIME = 2,
+};
+// Add or replace entries of an existing .afa archive in place. Returns false
+// if the file isn't an .afa (v1/v2) archive.
+bool update_afa(struct string *filename, struct ar_file_spec **files, size_t nr_files,
+		unsigned flags);
+// Rewrite an .afa archive without the data of replaced entries.
+bool compact_afa(struct string *filename);
 
 // extract.c
+// An extractor schedules the entries of one or more archives on a shared pool
+// of `nr_jobs` worker threads (0 = one per CPU). Archives must remain open
+// until the extractor is freed. If `path` is given, the archive file may be
+// accessed directly (e.g. to copy raw entries without loading them).
+struct ar_extractor;
+struct ar_extractor *ar_extractor_new(uint32_t flags, int nr_jobs);
+void ar_extractor_set_filter(struct ar_extractor *x, struct ar_filter *filter);
+// Write all entries to a tar stream instead of the file system. If `quiet` is
+// set, no NOTICE is printed per entry (e.g. when the tar is written to stdout).
+void ar_extractor_set_tar(struct ar_extractor *x, struct tar_writer *tar, bool quiet);
+// Link outputs with identical contents instead of writing them again.
+void ar_extractor_set_dedup(struct ar_extractor *x, struct ar_dedup *dedup);
+void ar_extractor_add(struct ar_extractor *x, struct archive *ar, const char *path,
+		const char *output_file);
+void ar_extractor_free(struct ar_extractor *x);
 void ar_extract_all(struct archive *ar, const char *output_file, uint32_t flags);
 void ar_extract_file(struct archive *ar, char *file_name, char *output_file, uint32_t flags);
 void ar_extract_index(struct archive *ar, int file_index, char *output_file, uint32_t flags);
 
+// dedup.c
+struct ar_dedup_stats {
+	// outputs linked to an existing output, and bytes not written as a result
+	unsigned long nr_linked;
+	uint64_t bytes_saved;
+	// keys which had to be produced by the caller
+	unsigned long nr_missed;
+	// outputs removed from the store by ar_dedup_trim
+	unsigned long nr_evicted;
+	uint64_t bytes_evicted;
+};
+
+struct ar_dedup *ar_dedup_new(const char *store);
+void ar_dedup_free(struct ar_dedup *d);
+void ar_dedup_get_stats(struct ar_dedup *d, struct ar_dedup_stats *stats);
+void ar_dedup_trim(struct ar_dedup *d, uint64_t max_size);
+char *ar_dedup_key(const void *data, size_t size, const char *format);
+bool ar_dedup_link(const char *src, const char *dst);
+bool ar_dedup_claim(struct ar_dedup *d, const char *key, const char *output_file);
+void ar_dedup_done(struct ar_dedup *d, const char *key, const char *output_file, bool ok);
+
+// filter.c
+struct ar_filter;
+struct ar_filter *ar_filter_new(void);
+void ar_filter_free(struct ar_filter *f);
+bool ar_filter_empty(struct ar_filter *f);
+void ar_filter_add_glob(struct ar_filter *f, const char *pattern);
+void ar_filter_add_regex(struct ar_filter *f, const char *pattern);
+void ar_filter_add_name(struct ar_filter *f, const char *name);
+void ar_filter_read_list(struct ar_filter *f, const char *path);
+bool ar_filter_match(struct ar_filter *f, const char *name);
+void ar_filter_warn_unmatched(struct ar_filter *f);
+
+// index.c
+struct ar_index_entry {
+	struct string *name;
+	uint32_t id;
+	uint32_t unknown0;
+	uint32_t unknown1;
+	uint32_t off; // absolute offset of the data in the archive file
+	uint32_t size;
+};
+
+struct ar_index {
+	int version;
+	uint32_t data_start;
+	size_t nr_entries;
+	struct ar_index_entry *entries;
+	void *name_table;
+	// set by ar_index_map
+	uint8_t *map;
+	size_t map_size;
+	FILE *file;
+};
+
+#define AR_SNIFF_SIZE 16
+
+struct ar_index *ar_index_read(const char *path);
+struct ar_index_entry *ar_index_get(struct ar_index *index, const char *name);
+bool ar_index_map(struct ar_index *index, const char *path);
+const uint8_t *ar_index_view(struct ar_index *index, struct ar_index_entry *e);
+size_t ar_index_peek(struct ar_index *index, struct ar_index_entry *e, void *buf, size_t size);
+const char *ar_sniff_type(const uint8_t *head, size_t size);
+void ar_index_free(struct ar_index *index);
+
+// scan.c
+enum ar_scan_type {
+	// regular file passing the extension filter; size and mtime are set
+	AR_SCAN_FILE,
+	// regular file with a different extension
+	AR_SCAN_FILTERED,
+	// neither a regular file nor a directory
+	AR_SCAN_SPECIAL,
+};
+
+struct ar_scan_entry {
+	enum ar_scan_type type;
+	struct string *path;
+	// path relative to the scanned directory
+	struct string *name;
+	uint64_t size;
+	time_t mtime;
+};
+
+kv_decl(ar_scan_list, struct ar_scan_entry);
+void ar_scan_dir(struct string *dir, const char *ext, int nr_jobs, ar_scan_list *out);
+void ar_scan_list_free(ar_scan_list *list);
+
+// sidecar.c
+struct ar_sidecar_entry {
+	char *name;
+	uint64_t off;
+	uint64_t size;
+	uint64_t hash;
+	char *format;
+	char *path;
+};
+
+struct ar_sidecar {
+	void *priv;
+};
+
+struct ar_sidecar *ar_sidecar_new(void);
+struct ar_sidecar *ar_sidecar_read(const char *path);
+bool ar_sidecar_write(struct ar_sidecar *sc, const char *path);
+void ar_sidecar_free(struct ar_sidecar *sc);
+size_t ar_sidecar_size(struct ar_sidecar *sc);
+struct ar_sidecar_entry *ar_sidecar_entry(struct ar_sidecar *sc, size_t i);
+struct ar_sidecar_entry *ar_sidecar_get(struct ar_sidecar *sc, const char *name);
+void ar_sidecar_add(struct ar_sidecar *sc, const char *name, uint64_t off, uint64_t size,
+		uint64_t hash, const char *format, const char *path);
+
 // open.c
 struct archive *open_archive(const char *path, enum archive_type *type, int *error);
 struct archive *open_ald_archive(const char *path, int *error, char *(*conv)(const char*));
@@ -160,14 +370,17 @@ kv_decl(ar_file_list, struct ar_file_spec*);
 kv_decl(ar_string_list, struct string*);
 kv_decl(ar_row_list, ar_string_list*);
 void ar_set_path_separator(char c);
-void ar_pack_manifest(struct ar_manifest *ar, int afa_version);
+void ar_pack_manifest(struct ar_manifest *ar, const struct ar_pack_options *opt);
+// The archive must remain open until the file specs are freed.
 void ar_to_file_list(struct archive *ar, ar_file_list *files);
 void ar_dir_to_file_list(struct string *dir, ar_file_list *files, enum ar_filetype fmt);
 void ar_file_spec_free(struct ar_file_spec *spec);
 void ar_file_list_free(ar_file_list *list);
 void ar_file_list_sort(ar_file_list *list);
 
-void ar_pack(const char *manifest, int afa_version);
+void ar_pack(const char *manifest, const struct ar_pack_options *opt);
+void ar_update(const char *manifest, const struct ar_pack_options *opt, unsigned flags);
+void ar_repack(const char *input, const char *output, const struct ar_pack_options *opt);
 
 struct ar_manifest *ar_make_manifest(struct string *magic, ar_string_list *options,
 		struct string *output_path, ar_row_list *rows);
@@ -28,6 +28,7 @@ struct ex_tree;
 struct port;
 
 struct ex *ex_parse_file(const char *path);
+struct ex *ex_parse_mem(const uint8_t *data, size_t size, const char *path);
 void ex_write(FILE *out, struct ex *ex);
 uint8_t *ex_write_mem(struct ex *ex, size_t *size_out);
 void ex_write_file(const char *path, struct ex *ex);
@@ -0,0 +1,78 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+
+#ifndef ALICE_OUTPUT_WRITER_H_
+#define ALICE_OUTPUT_WRITER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Shared writer for tools that create many output files. Directories that
+ * were already created are remembered, and file data is written
+ * asynchronously: through io_uring where available, otherwise on a thread
+ * pool. All functions may be called from multiple threads.
+ */
+struct output_writer;
+
+struct output_writer *output_writer_new(int nr_jobs);
+
+/*
+ * Wait for all queued writes, print a throughput summary (if anything was
+ * written) and free the writer.
+ */
+void output_writer_free(struct output_writer *w);
+
+/*
+ * Wait for all queued writes to complete.
+ */
+void output_writer_flush(struct output_writer *w);
+
+/*
+ * Create the parent directory of `path`, unless it's known to exist.
+ */
+void output_writer_mkdir_for_file(struct output_writer *w, const char *path);
+
+/*
+ * Open `path` for writing. Returns -1 if the file exists and `overwrite` is
+ * false.
+ */
+int output_writer_open(struct output_writer *w, const char *path, bool overwrite);
+
+/*
+ * Queue a write of `size` bytes to `path`. `data` must remain valid until
+ * `release(arg)` is called (or until the writer is flushed, if `release` is
+ * NULL). Returns false without queueing anything if the file exists and
+ * `overwrite` is false.
+ */
+bool output_writer_write(struct output_writer *w, const char *path, const void *data, size_t size,
+		bool overwrite, void (*release)(void*), void *arg);
+
+/*
+ * Write `size` bytes to `path` immediately. Returns false if the file exists
+ * and `overwrite` is false.
+ */
+bool output_writer_write_sync(struct output_writer *w, const char *path, const void *data,
+		size_t size, bool overwrite);
+
+/*
+ * Count a file written by other means in the throughput summary.
+ */
+void output_writer_account(struct output_writer *w, uint64_t size);
+
+#endif /* ALICE_OUTPUT_WRITER_H_ */
@@ -23,22 +23,36 @@
 #include "system4/buffer.h"
 
 /*
- * A port can be backed by either an in-memory buffer or a file handle.
+ * A port can be backed by an in-memory buffer, a file handle, a
+ * gzip-compressed file or a memory-mapped file.
  */
 enum port_type {
 	PORT_TYPE_BUFFER,
 	PORT_TYPE_FILE,
+	PORT_TYPE_GZIP,
+	PORT_TYPE_MMAP,
 };
 
 struct port {
 	enum port_type type;
-	union {
-		struct {
-			FILE *file;
-			bool need_close;
-		};
-		struct buffer buffer;
-	};
+	/*
+	 * Output buffer. For buffer ports this holds everything written to the
+	 * port. File and gzip ports flush it when full, and for mmap ports it
+	 * is the mapped output file.
+	 */
+	uint8_t *buf;
+	size_t len;
+	size_t cap;
+	// set if writing to the underlying file failed
+	bool error;
+	// errno value of the first error
+	int err;
+	FILE *file;
+	bool need_close;
+	// PORT_TYPE_GZIP: deflate stream
+	void *zstream;
+	// PORT_TYPE_MMAP: output file descriptor
+	int fd;
 };
 
 /*
@@ -58,6 +72,25 @@ void port_file_init(struct port *port, FILE *f);
  */
 bool port_file_open(struct port *port, const char *path);
 
+/*
+ * Initialize a port which writes gzip-compressed data to an open file.
+ * The caller is responsible for closing the file afterwards.
+ */
+void port_gzip_init(struct port *port, FILE *f);
+
+/*
+ * Initialize a port which writes gzip-compressed data to a path name.
+ * Returns true if the file was opened; otherwise returns false.
+ */
+bool port_gzip_open(struct port *port, const char *path);
+
+/*
+ * Initialize a port which writes to a memory-mapped file. If the file can't be
+ * mapped (e.g. it's a pipe, or on Windows), a file port is used instead.
+ * Returns true if the file was opened; otherwise returns false.
+ */
+bool port_mmap_open(struct port *port, const char *path);
+
 /*
  * Get the data from a buffer port.
  * This clears the buffer. The caller is responsible for freeing the returned
@@ -65,12 +98,21 @@ bool port_file_open(struct port *port, const char *path);
  */
 uint8_t *port_buffer_get(struct port *port, size_t *size_out);
 
+/*
+ * Write any buffered data to the underlying file.
+ * This must be called before writing to a file port's FILE directly.
+ * Returns false if writing failed (see `port->err`).
+ */
+bool port_flush(struct port *port);
+
 /*
  * Close a port.
  * This frees any data remaining in a buffer port, and closes the file handle
  * associated with a file port (if it was opened with `port_file_open`).
+ * Returns false if writing to the port failed at any point, with the errno
+ * value in `port->err`.
  */
-void port_close(struct port *port);
+bool port_close(struct port *port);
 
 /*
  * Write formatted data to a port.
@@ -82,6 +124,26 @@ void port_printf(struct port *port, const char *fmt, ...);
  */
 void port_putc(struct port *port, char c);
 
+/*
+ * Write a string to a port.
+ */
+void port_put_string(struct port *port, const char *str);
+
+/*
+ * Write an integer to a port (as with "%d").
+ */
+void port_put_int(struct port *port, int64_t v);
+
+/*
+ * Write an integer to a port in hexadecimal (as with "0x%x").
+ */
+void port_put_hex(struct port *port, uint64_t v);
+
+/*
+ * Write a floating point number to a port (as with "%f").
+ */
+void port_put_float(struct port *port, double v);
+
 /*
  * Write a series of bytes to a port.
  */
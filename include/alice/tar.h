@@ -0,0 +1,44 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+
+#ifndef ALICE_TAR_H_
+#define ALICE_TAR_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Sequential writer for ustar archives. Names longer than the ustar limit
+ * are written with GNU long name records.
+ */
+struct tar_writer;
+
+struct tar_writer *tar_open(const char *path);
+void tar_close(struct tar_writer *tar);
+int tar_fd(struct tar_writer *tar);
+
+/*
+ * Write the header for a regular file. Exactly `size` bytes of data must be
+ * written with the functions below before the next header.
+ */
+void tar_write_header(struct tar_writer *tar, const char *name, uint64_t size);
+void tar_write_data(struct tar_writer *tar, const void *data, size_t size);
+void tar_write_stream(struct tar_writer *tar, FILE *f, uint64_t size);
+void tar_write_range(struct tar_writer *tar, int fd, uint64_t off, uint64_t size);
+
+#endif /* ALICE_TAR_H_ */
@@ -0,0 +1,78 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+
+#ifndef ALICE_THREAD_POOL_H
+#define ALICE_THREAD_POOL_H
+
+#include <stdbool.h>
+
+/*
+ * A job to be run on a thread pool. Callers embed this structure as the first
+ * member of their own job structure and recover it in the `run` callback.
+ */
+struct thread_job {
+	void (*run)(struct thread_job *job);
+	// private
+	struct thread_job *next;
+	bool done;
+};
+
+struct thread_pool;
+
+/*
+ * Get the number of online processors.
+ */
+int thread_pool_nr_cpus(void);
+
+/*
+ * Create a thread pool with `nr_threads` worker threads. If `nr_threads` is
+ * less than 1, one thread per online processor is created. A pool with a
+ * single thread runs jobs synchronously in the submitting thread.
+ */
+struct thread_pool *thread_pool_new(int nr_threads);
+
+/*
+ * Get the number of worker threads in a pool.
+ */
+int thread_pool_size(struct thread_pool *pool);
+
+/*
+ * Submit a job to the pool. The job must remain valid until it has completed.
+ */
+void thread_pool_submit(struct thread_pool *pool, struct thread_job *job, void (*run)(struct thread_job*));
+
+/*
+ * Check whether a submitted job has completed (without blocking).
+ */
+bool thread_pool_job_done(struct thread_pool *pool, struct thread_job *job);
+
+/*
+ * Block until a submitted job has completed.
+ */
+void thread_pool_wait_job(struct thread_pool *pool, struct thread_job *job);
+
+/*
+ * Block until all submitted jobs have completed.
+ */
+void thread_pool_wait(struct thread_pool *pool);
+
+/*
+ * Wait for all submitted jobs to complete and destroy the pool.
+ */
+void thread_pool_free(struct thread_pool *pool);
+
+#endif /* ALICE_THREAD_POOL_H */
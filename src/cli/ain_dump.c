@@ -25,6 +25,7 @@
 #include <iconv.h>
 #include "system4.h"
 #include "system4/ain.h"
+#include "system4/file.h"
 #include "system4/instructions.h"
 #include "system4/string.h"
 #include "alice.h"
@@ -109,7 +110,8 @@ static void ain_dump_hll(struct port *port, struct ain *ain)
 			ALICE_ERROR("fopen: %s", strerror(errno));
 		}
 		ain_dump_library(&file_port, ain, i);
-		port_close(&file_port);
+		if (!port_close(&file_port))
+			ALICE_ERROR("Failed to write '%s': %s", file_name, strerror(file_port.err));
 		free(file_name);
 		free(name);
 	}
@@ -132,7 +134,8 @@ static void ain_dump_hll_stubs(struct port *port, struct ain *ain)
 			ALICE_ERROR("fopen: %s", strerror(errno));
 		}
 		ain_dump_library_stub(&file_port, &ain->libraries[i]);
-		port_close(&file_port);
+		if (!port_close(&file_port))
+			ALICE_ERROR("Failed to write '%s': %s", file_name, strerror(file_port.err));
 		free(file_name);
 		free(name);
 	}
@@ -252,7 +255,7 @@ static void ain_dump_map(struct port *port, struct ain *ain)
 	print_section(port, "ENUM", &ain->ENUM);
 }
 
-static void dump_decrypted(FILE *f, const char *path)
+static void dump_decrypted(struct port *port, const char *path)
 {
 	int err;
 	long len;
@@ -262,11 +265,31 @@ static void dump_decrypted(FILE *f, const char *path)
 		ERROR("Failed to open ain file: %s\n", ain_strerror(err));
 	}
 
-	fwrite(ain, len, 1, f);
-	fflush(f);
+	if (!port_write_bytes(port, ain, len))
+		ERROR("Failed to write to file: %s", strerror(errno));
 	free(ain);
 }
 
+/*
+ * Disassemble each function named in `path` (one name per line).
+ */
+static void ain_disassemble_function_list(struct port *port, struct ain *ain, const char *path, unsigned int flags)
+{
+	FILE *f = file_open_utf8(path, "rb");
+	if (!f)
+		ALICE_ERROR("Failed to open '%s': %s", path, strerror(errno));
+
+	char line[1024];
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!line[0])
+			continue;
+		if (!ain_disassemble_function(port, ain, line, flags))
+			WARNING("No function named '%s'", line);
+	}
+	fclose(f);
+}
+
 enum {
 	LOPT_AIN_VERSION = 256,
 	LOPT_CODE,
@@ -276,6 +299,7 @@ enum {
 	LOPT_OUTPUT,
 	LOPT_FUNCTIONS,
 	LOPT_FUNCTION,
+	LOPT_FUNCTION_LIST,
 	LOPT_GLOBALS,
 	LOPT_STRUCTURES,
 	LOPT_MESSAGES,
@@ -354,6 +378,10 @@ int command_ain_dump(int argc, char *argv[])
 			dump_args[dump_ptr] = optarg;
 			dump_targets[dump_ptr++] = LOPT_FUNCTION;
 			break;
+		case LOPT_FUNCTION_LIST:
+			dump_args[dump_ptr] = optarg;
+			dump_targets[dump_ptr++] = LOPT_FUNCTION_LIST;
+			break;
 		case 'g':
 		case LOPT_GLOBALS:
 			dump_targets[dump_ptr++] = LOPT_GLOBALS;
@@ -434,12 +462,13 @@ int command_ain_dump(int argc, char *argv[])
 		USAGE_ERROR(&cmd_ain_dump, "Wrong number of arguments.\n");
 	}
 
-	FILE *output = alice_open_output_file(output_file);
 	struct port port;
-	port_file_init(&port, output);
+	alice_open_output_port(&port, output_file);
 
 	if (decrypt) {
-		dump_decrypted(output, argv[0]);
+		dump_decrypted(&port, argv[0]);
+		if (!port_close(&port))
+			ALICE_ERROR("Failed to write output: %s", strerror(port.err));
 		return 0;
 	}
 
@@ -451,7 +480,7 @@ int command_ain_dump(int argc, char *argv[])
 	ain_init_member_functions(ain, conv_utf8);
 
 	// chdir to output file directory so that subsequent opens are relative
-	if (output != stdout) {
+	if (output_file) {
 		char *tmp = strdup(output_file);
 		char *dir = dirname(tmp);
 		chdir(dir);
@@ -461,11 +490,12 @@ int command_ain_dump(int argc, char *argv[])
 	for (int i = 0; i < dump_ptr; i++) {
 		switch (dump_targets[i]) {
 		case LOPT_CODE:           ain_disassemble(&port, ain, flags); break;
-		case LOPT_JSON:           ain_dump_json(output, ain); break;
+		case LOPT_JSON:           ain_dump_json(&port, ain); break;
 		case LOPT_TEXT:           ain_dump_text(&port, ain); break;
 		case LOPT_AIN_VERSION:    ain_dump_version(&port, ain); break;
 		case LOPT_FUNCTIONS:      ain_dump_functions(&port, ain); break;
 		case LOPT_FUNCTION:       ain_disassemble_function(&port, ain, dump_args[i], flags); break;
+		case LOPT_FUNCTION_LIST:  ain_disassemble_function_list(&port, ain, dump_args[i], flags); break;
 		case LOPT_GLOBALS:        ain_dump_globals(&port, ain); break;
 		case LOPT_STRUCTURES:     ain_dump_structures(&port, ain); break;
 		case LOPT_MESSAGES:       ain_dump_messages(&port, ain); break;
@@ -488,7 +518,9 @@ int command_ain_dump(int argc, char *argv[])
 		}
 	}
 
-	port_close(&port);
+	if (!port_close(&port))
+		ALICE_ERROR("Failed to write output: %s", strerror(port.err));
+	ain_disassemble_invalidate(ain);
 	ain_free(ain);
 	return 0;
 }
@@ -507,6 +539,7 @@ struct command cmd_ain_dump = {
 		{ "raw-code",           'C', "Dump code section (raw)",                       no_argument,       LOPT_RAW_CODE },
 		{ "functions",          'f', "Dump functions section",                        no_argument,       LOPT_FUNCTIONS },
 		{ "function",           0,   "Dump function code",                            required_argument, LOPT_FUNCTION },
+		{ "function-list",      0,   "Dump code of functions listed in a file",       required_argument, LOPT_FUNCTION_LIST },
 		{ "globals",            'g', "Dump globals section",                          no_argument,       LOPT_GLOBALS },
 		{ "structures",         'S', "Dump structures section",                       no_argument,       LOPT_STRUCTURES },
 		{ "messages",           'm', "Dump messages section",                         no_argument,       LOPT_MESSAGES },
@@ -23,6 +23,7 @@
 #include "system4.h"
 #include "system4/file.h"
 #include "alice.h"
+#include "alice/port.h"
 #include "cli.h"
 
 #ifdef _WIN32
@@ -70,6 +71,8 @@ struct command cmd_ar = {
 		&cmd_ar_extract,
 		&cmd_ar_list,
 		&cmd_ar_pack,
+		&cmd_ar_update,
+		&cmd_ar_repack,
 		NULL
 	}
 };
@@ -180,6 +183,26 @@ FILE *alice_open_output_file(const char *path)
 	return out;
 }
 
+/*
+ * Open an output port for `path` (stdout if NULL). Paths ending in ".gz" are
+ * gzip-compressed; other files are written through a memory mapping.
+ */
+void alice_open_output_port(struct port *port, const char *path)
+{
+	if (!path) {
+		port_file_init(port, alice_open_output_file(NULL));
+		return;
+	}
+	size_t len = strlen(path);
+	bool ok;
+	if (len > 3 && !strcmp(path + len - 3, ".gz"))
+		ok = port_gzip_open(port, path);
+	else
+		ok = port_mmap_open(port, path);
+	if (!ok)
+		ALICE_ERROR("fopen: %s", strerror(errno));
+}
+
 static void print_version(void)
 {
 	puts("alice-tools version " ALICE_TOOLS_VERSION);
@@ -230,6 +253,7 @@ void print_usage(struct command *cmd)
 		printf("    -h,--help                  Print this message and exit\n");
 		printf("    --input-encoding <arg>     Specify the input encoding\n");
 		printf("    --output-encoding <arg>    Specify the output encoding\n");
+		printf("    --compression-level <arg>  Specify the zlib compression level (0-9)\n");
 	} else {
 		// calculate column width
 		size_t width = 0;
@@ -257,6 +281,7 @@ enum {
 	LOPT_VERSION = -3,
 	LOPT_INPUT_ENCODING = -4,
 	LOPT_OUTPUT_ENCODING = -5,
+	LOPT_COMPRESSION_LEVEL = -6,
 };
 
 int alice_getopt(int argc, char *argv[], struct command *cmd)
@@ -288,6 +313,7 @@ int alice_getopt(int argc, char *argv[], struct command *cmd)
 		long_opts[nr_opts++] = (struct option) { "version",         no_argument,       NULL, LOPT_VERSION };
 		long_opts[nr_opts++] = (struct option) { "input-encoding",  required_argument, NULL, LOPT_INPUT_ENCODING };
 		long_opts[nr_opts++] = (struct option) { "output-encoding", required_argument, NULL, LOPT_OUTPUT_ENCODING };
+		long_opts[nr_opts++] = (struct option) { "compression-level", required_argument, NULL, LOPT_COMPRESSION_LEVEL };
 		long_opts[nr_opts] = (struct option) { 0, 0, 0, 0 };
 		short_opts[nr_short_opts++] = 'h';
 		short_opts[nr_short_opts++] = 'v';
@@ -312,6 +338,14 @@ int alice_getopt(int argc, char *argv[], struct command *cmd)
 	case LOPT_OUTPUT_ENCODING:
 		set_output_encoding(optarg);
 		break;
+	case LOPT_COMPRESSION_LEVEL: {
+		char *end;
+		long level = strtol(optarg, &end, 10);
+		if (!*optarg || *end || level < 0 || level > 9)
+			USAGE_ERROR(cmd, "Invalid compression level: \"%s\" (expected 0-9)", optarg);
+		zlib_set_level(level);
+		break;
+	}
 	case '?':
 		USAGE_ERROR(cmd, "Unrecognized command line argument");
 	}
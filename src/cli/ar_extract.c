@@ -38,6 +38,7 @@
 #include "system4/webp.h"
 #include "alice.h"
 #include "alice/ar.h"
+#include "alice/tar.h"
 #include "cli.h"
 
 enum {
@@ -49,13 +50,26 @@ enum {
 	LOPT_IMAGE_FORMAT,
 	LOPT_IMAGES_ONLY,
 	LOPT_RAW,
+	LOPT_JOBS,
+	LOPT_INCREMENTAL,
+	LOPT_MATCH,
+	LOPT_REGEX,
+	LOPT_LIST_FILE,
+	LOPT_TAR,
+	LOPT_DEDUP,
+	LOPT_DEDUP_STORE,
 };
 
 int command_ar_extract(int argc, char *argv[])
 {
 	char *output_file = NULL;
 	char *file_name = NULL;
+	char *tar_file = NULL;
+	bool dedup = false;
+	char *dedup_store = NULL;
 	int file_index = -1;
+	int nr_jobs = 0;
+	struct ar_filter *filter = ar_filter_new();
 
 	uint32_t flags = 0;
 
@@ -96,6 +110,35 @@ int command_ar_extract(int argc, char *argv[])
 		case LOPT_RAW:
 			flags |= AR_RAW;
 			break;
+		case 'j':
+		case LOPT_JOBS:
+			nr_jobs = atoi(optarg);
+			if (nr_jobs < 0)
+				ALICE_ERROR("Invalid number of jobs: %s", optarg);
+			break;
+		case LOPT_INCREMENTAL:
+			flags |= AR_INCREMENTAL;
+			break;
+		case 'm':
+		case LOPT_MATCH:
+			ar_filter_add_glob(filter, optarg);
+			break;
+		case LOPT_REGEX:
+			ar_filter_add_regex(filter, optarg);
+			break;
+		case LOPT_LIST_FILE:
+			ar_filter_read_list(filter, optarg);
+			break;
+		case LOPT_TAR:
+			tar_file = optarg;
+			break;
+		case LOPT_DEDUP:
+			dedup = true;
+			break;
+		case LOPT_DEDUP_STORE:
+			dedup = true;
+			dedup_store = optarg;
+			break;
 		}
 	}
 
@@ -103,36 +146,82 @@ int command_ar_extract(int argc, char *argv[])
 	argv += optind;
 
 	// check argument count
-	if (argc != 1) {
+	if (argc < 1) {
 		USAGE_ERROR(&cmd_ar_extract, "Wrong number of arguments");
 	}
+	if ((file_index >= 0 || file_name) && argc != 1) {
+		USAGE_ERROR(&cmd_ar_extract, "--index and --name require a single archive");
+	}
+	if ((file_index >= 0 || file_name) && !ar_filter_empty(filter)) {
+		USAGE_ERROR(&cmd_ar_extract, "--index and --name can't be combined with filters");
+	}
+	if (tar_file && (output_file || file_index >= 0 || file_name || (flags & AR_INCREMENTAL))) {
+		USAGE_ERROR(&cmd_ar_extract, "--tar can't be combined with --output, --index, --name or --incremental");
+	}
+	if (dedup && (tar_file || file_index >= 0 || file_name)) {
+		USAGE_ERROR(&cmd_ar_extract, "--dedup can't be combined with --tar, --index or --name");
+	}
 
-	// open archive
-	struct archive *ar;
-	enum archive_type type;
-	int error;
-	ar = open_archive(argv[0], &type, &error);
-	if (!ar) {
-		ERROR("Opening archive: %s", archive_strerror(error));
+	// open archives
+	struct archive **ar = xcalloc(argc, sizeof(struct archive*));
+	for (int i = 0; i < argc; i++) {
+		enum archive_type type;
+		int error;
+		ar[i] = open_archive(argv[i], &type, &error);
+		if (!ar[i]) {
+			ERROR("Opening archive: %s", archive_strerror(error));
+		}
 	}
 
 	// run command
 	if (file_index >= 0) {
-		ar_extract_index(ar, file_index, output_file, flags);
+		ar_extract_index(ar[0], file_index, output_file, flags);
 	} else if (file_name) {
-		ar_extract_file(ar, file_name, output_file, flags);
+		ar_extract_file(ar[0], file_name, output_file, flags);
 	} else {
-		ar_extract_all(ar, output_file, flags);
+		// all archives share one scheduler
+		struct ar_extractor *x = ar_extractor_new(flags, nr_jobs);
+		if (!ar_filter_empty(filter))
+			ar_extractor_set_filter(x, filter);
+		struct ar_dedup *d = NULL;
+		if (dedup) {
+			d = ar_dedup_new(dedup_store);
+			ar_extractor_set_dedup(x, d);
+		}
+		struct tar_writer *tar = NULL;
+		if (tar_file) {
+			tar = tar_open(tar_file);
+			ar_extractor_set_tar(x, tar, !strcmp(tar_file, "-"));
+		}
+		for (int i = 0; i < argc; i++) {
+			ar_extractor_add(x, ar[i], argv[i], output_file);
+		}
+		ar_extractor_free(x);
+		if (tar)
+			tar_close(tar);
+		if (d) {
+			struct ar_dedup_stats stats;
+			ar_dedup_get_stats(d, &stats);
+			if (stats.nr_linked)
+				NOTICE("Deduplicated %lu files (%.1f MiB)", stats.nr_linked,
+						stats.bytes_saved / (1024.0 * 1024.0));
+			ar_dedup_free(d);
+		}
+		ar_filter_warn_unmatched(filter);
 	}
+	ar_filter_free(filter);
 
-	archive_free(ar);
+	for (int i = 0; i < argc; i++) {
+		archive_free(ar[i]);
+	}
+	free(ar);
 	return 0;
 }
 
 struct command cmd_ar_extract = {
 	.name = "extract",
-	.usage = "[options...] <input-file>",
-	.description = "Extract an archive file",
+	.usage = "[options...] <input-file>...",
+	.description = "Extract one or more archive files",
 	.parent = &cmd_ar,
 	.fun = command_ar_extract,
 	.options = {
@@ -143,6 +232,14 @@ struct command cmd_ar_extract = {
 		{ "image-format", 0,   "Image output format (png or webp)", required_argument, LOPT_IMAGE_FORMAT },
 		{ "images-only",  0,   "Only extract images",               no_argument,       LOPT_IMAGES_ONLY },
 		{ "raw",          0,   "Don't convert image files",         no_argument,       LOPT_RAW },
+		{ "jobs",         'j', "Number of worker threads",          required_argument, LOPT_JOBS },
+		{ "incremental",  0,   "Only extract changed files",        no_argument,       LOPT_INCREMENTAL },
+		{ "match",        'm', "Extract files matching a glob",     required_argument, LOPT_MATCH },
+		{ "regex",        0,   "Extract files matching a regex",    required_argument, LOPT_REGEX },
+		{ "list-file",    0,   "Extract files listed in a file",    required_argument, LOPT_LIST_FILE },
+		{ "tar",          0,   "Write files to a tar file (- for stdout)", required_argument, LOPT_TAR },
+		{ "dedup",        0,   "Link files with identical contents", no_argument,     LOPT_DEDUP },
+		{ "dedup-store",  0,   "Directory for deduplicated files shared between runs", required_argument, LOPT_DEDUP_STORE },
 		{ 0 }
 	}
 };
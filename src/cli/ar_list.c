@@ -17,25 +17,200 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include "system4.h"
 #include "system4/archive.h"
+#include "system4/string.h"
 #include "alice.h"
 #include "alice/ar.h"
 #include "cli.h"
 
-static void list_all_iter(struct archive_data *data, possibly_unused void *_)
+enum {
+	LOPT_HELP = 256,
+	LOPT_FORMAT,
+	LOPT_LONG,
+};
+
+enum list_format {
+	LIST_PLAIN,
+	LIST_TSV,
+	LIST_JSON,
+};
+
+struct list_entry {
+	int no;
+	const char *name;
+	int64_t off; // -1 if unknown
+	uint32_t size;
+	const char *type;
+};
+
+struct list_state {
+	enum list_format format;
+	bool long_format;
+	unsigned long nr_entries;
+};
+
+static void print_json_string(const char *s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		switch (*s) {
+		case '"':  fputs("\\\"", stdout); break;
+		case '\\': fputs("\\\\", stdout); break;
+		case '\n': fputs("\\n", stdout); break;
+		case '\r': fputs("\\r", stdout); break;
+		case '\t': fputs("\\t", stdout); break;
+		default:
+			if ((unsigned char)*s < 0x20)
+				printf("\\u%04x", *s);
+			else
+				putchar(*s);
+			break;
+		}
+	}
+	putchar('"');
+}
+
+static void list_begin(struct list_state *st)
+{
+	if (st->format == LIST_TSV) {
+		if (st->long_format)
+			puts("no\tname\toffset\tsize\ttype");
+		else
+			puts("no\tname");
+	} else if (st->format == LIST_JSON) {
+		puts("[");
+	}
+}
+
+static void list_end(struct list_state *st)
 {
-	char *name = conv_utf8(data->name);
-	printf("%d: %s\n", data->no, name);
+	if (st->format == LIST_JSON) {
+		if (st->nr_entries)
+			putchar('\n');
+		puts("]");
+	}
+}
+
+static void list_entry(struct list_state *st, struct list_entry *e)
+{
+	char *name = conv_utf8(e->name);
+	switch (st->format) {
+	case LIST_PLAIN:
+		if (!st->long_format) {
+			printf("%d: %s\n", e->no, name);
+		} else if (e->off >= 0) {
+			printf("%d: %s (offset=%" PRId64 ", size=%" PRIu32 ", type=%s)\n",
+					e->no, name, e->off, e->size, e->type);
+		} else {
+			printf("%d: %s (size=%" PRIu32 ", type=%s)\n", e->no, name, e->size, e->type);
+		}
+		break;
+	case LIST_TSV:
+		printf("%d\t%s", e->no, name);
+		if (st->long_format) {
+			if (e->off >= 0)
+				printf("\t%" PRId64, e->off);
+			else
+				fputs("\t-", stdout);
+			printf("\t%" PRIu32 "\t%s", e->size, e->type);
+		}
+		putchar('\n');
+		break;
+	case LIST_JSON:
+		fputs(st->nr_entries ? ",\n" : "", stdout);
+		printf("{\"no\":%d,\"name\":", e->no);
+		print_json_string(name);
+		if (st->long_format) {
+			if (e->off >= 0)
+				printf(",\"offset\":%" PRId64, e->off);
+			else
+				fputs(",\"offset\":null", stdout);
+			printf(",\"size\":%" PRIu32 ",\"type\":\"%s\"", e->size, e->type);
+		}
+		putchar('}');
+		break;
+	}
+	st->nr_entries++;
 	free(name);
 }
 
+/*
+ * List an .afa archive directly from its index. Entry types are sniffed from
+ * the first few bytes of each entry through a mapping of the archive file.
+ */
+static void list_index(struct list_state *st, struct ar_index *index, const char *path)
+{
+	bool mapped = st->long_format && ar_index_map(index, path);
+	for (size_t i = 0; i < index->nr_entries; i++) {
+		struct ar_index_entry *ie = &index->entries[i];
+		struct list_entry e = {
+			// the entry number as libsys4 assigns it (the stored id for
+			// v1 archives), so that it can be passed to ar extract --index
+			.no = ie->id,
+			.name = ie->name->text,
+			.off = ie->off,
+			.size = ie->size,
+			.type = "unknown",
+		};
+		if (mapped) {
+			uint8_t head[AR_SNIFF_SIZE];
+			size_t n = ar_index_peek(index, ie, head, AR_SNIFF_SIZE);
+			e.type = ar_sniff_type(head, n);
+		}
+		list_entry(st, &e);
+	}
+}
+
+static void list_all_iter(struct archive_data *data, void *_st)
+{
+	struct list_state *st = _st;
+	struct list_entry e = {
+		.no = data->no,
+		.name = data->name,
+		.off = -1,
+		.size = data->size,
+		.type = "unknown",
+	};
+
+	// no index available: the entry has to be loaded to sniff its type
+	if (st->long_format) {
+		struct archive_data *copy = archive_copy_descriptor(data);
+		if (archive_load_file(copy)) {
+			e.size = copy->size;
+			e.type = ar_sniff_type(copy->data, copy->size);
+		}
+		archive_free_data(copy);
+	}
+	list_entry(st, &e);
+}
+
 int command_ar_list(int argc, char *argv[])
 {
+	struct list_state st = { .format = LIST_PLAIN };
+
 	while (1) {
-		int c = alice_getopt(argc, argv, &cmd_ar_extract);
+		int c = alice_getopt(argc, argv, &cmd_ar_list);
 		if (c == -1)
 			break;
+
+		switch (c) {
+		case LOPT_FORMAT:
+			if (!strcmp(optarg, "plain"))
+				st.format = LIST_PLAIN;
+			else if (!strcmp(optarg, "tsv"))
+				st.format = LIST_TSV;
+			else if (!strcmp(optarg, "json"))
+				st.format = LIST_JSON;
+			else
+				USAGE_ERROR(&cmd_ar_list, "Unknown format: \"%s\"", optarg);
+			break;
+		case 'l':
+		case LOPT_LONG:
+			st.long_format = true;
+			break;
+		}
 	}
 
 	argc -= optind;
@@ -43,7 +218,20 @@ int command_ar_list(int argc, char *argv[])
 
 	// check argument count
 	if (argc != 1) {
-		USAGE_ERROR(&cmd_ar_extract, "Wrong number of arguments");
+		USAGE_ERROR(&cmd_ar_list, "Wrong number of arguments");
+	}
+
+	static char stdout_buf[1 << 16];
+	setvbuf(stdout, stdout_buf, _IOFBF, sizeof(stdout_buf));
+
+	// fast path: read the index directly
+	struct ar_index *index = ar_index_read(argv[0]);
+	if (index) {
+		list_begin(&st);
+		list_index(&st, index, argv[0]);
+		list_end(&st);
+		ar_index_free(index);
+		return 0;
 	}
 
 	// open archive
@@ -55,7 +243,9 @@ int command_ar_list(int argc, char *argv[])
 		ERROR("Opening archive: %s", archive_strerror(error));
 	}
 
-	archive_for_each(ar, list_all_iter, NULL);
+	list_begin(&st);
+	archive_for_each(ar, list_all_iter, &st);
+	list_end(&st);
 
 	archive_free(ar);
 	return 0;
@@ -68,6 +258,8 @@ struct command cmd_ar_list = {
 	.parent = &cmd_ar,
 	.fun = command_ar_list,
 	.options = {
+		{ "format", 0,   "Output format (plain, tsv or json)",         required_argument, LOPT_FORMAT },
+		{ "long",   'l', "Include offsets, sizes and file types",      no_argument,       LOPT_LONG },
 		{ 0 }
 	}
 };
@@ -22,7 +22,15 @@
 
 enum {
 	LOPT_AFA_VERSION = 256,
-	LOPT_BACKSLASH
+	LOPT_BACKSLASH,
+	LOPT_JOBS,
+	LOPT_BUFFER_SIZE,
+	LOPT_CACHE,
+	LOPT_CACHE_SIZE,
+	LOPT_DEDUP,
+	LOPT_ALIGN,
+	LOPT_ALIGN_THRESHOLD,
+	LOPT_ORDER,
 };
 
 int command_ar_pack(int argc, char *argv[])
@@ -30,7 +38,7 @@ int command_ar_pack(int argc, char *argv[])
 	set_input_encoding("UTF-8");
 	set_output_encoding("CP932");
 
-	int afa_version = 2;
+	struct ar_pack_options opt = AR_PACK_OPTIONS_DEFAULT;
 
 	while (1) {
 		int c = alice_getopt(argc, argv, &cmd_ar_pack);
@@ -39,13 +47,48 @@ int command_ar_pack(int argc, char *argv[])
 
 		switch (c) {
 		case LOPT_AFA_VERSION:
-			afa_version = atoi(optarg);
-			if (afa_version < 1 || afa_version > 2)
-				ALICE_ERROR("Unsupported .afa version: %d", afa_version);
+			opt.afa_version = atoi(optarg);
+			if (opt.afa_version < 1 || opt.afa_version > 2)
+				ALICE_ERROR("Unsupported .afa version: %d", opt.afa_version);
 			break;
 		case LOPT_BACKSLASH:
 			ar_set_path_separator('\\');
 			break;
+		case LOPT_JOBS:
+			opt.nr_jobs = atoi(optarg);
+			if (opt.nr_jobs < 0)
+				ALICE_ERROR("Invalid number of jobs: %s", optarg);
+			zlib_set_jobs(opt.nr_jobs);
+			break;
+		case LOPT_BUFFER_SIZE:
+			if (atoi(optarg) < 1)
+				ALICE_ERROR("Invalid buffer size: %s", optarg);
+			opt.buffer_size = (size_t)atoi(optarg) * 1024 * 1024;
+			break;
+		case LOPT_CACHE:
+			opt.cache_dir = optarg;
+			break;
+		case LOPT_CACHE_SIZE:
+			if (atoi(optarg) < 1)
+				ALICE_ERROR("Invalid cache size: %s", optarg);
+			opt.cache_size = (uint64_t)atoi(optarg) * 1024 * 1024;
+			break;
+		case LOPT_DEDUP:
+			opt.dedup = true;
+			break;
+		case LOPT_ALIGN:
+			opt.align = atoi(optarg);
+			if (opt.align < 8 || (opt.align & (opt.align - 1)))
+				ALICE_ERROR("Invalid alignment (must be a power of two >= 8): %s", optarg);
+			break;
+		case LOPT_ALIGN_THRESHOLD:
+			if (atoi(optarg) < 0)
+				ALICE_ERROR("Invalid alignment threshold: %s", optarg);
+			opt.align_threshold = (uint64_t)atoi(optarg) * 1024;
+			break;
+		case LOPT_ORDER:
+			opt.order_file = optarg;
+			break;
 		}
 	}
 
@@ -56,7 +99,7 @@ int command_ar_pack(int argc, char *argv[])
 		USAGE_ERROR(&cmd_ar_extract, "Wrong number of arguments");
 	}
 
-	ar_pack(argv[0], afa_version);
+	ar_pack(argv[0], &opt);
 	return 0;
 }
 
@@ -69,6 +112,14 @@ struct command cmd_ar_pack = {
 	.options = {
 		{ "afa-version", 0, "Specify the .afa version (1 or 2)", required_argument, LOPT_AFA_VERSION },
 		{ "backslash", 0, "Use backslash as the path separator", no_argument, LOPT_BACKSLASH },
+		{ "jobs", 'j', "Number of worker threads", required_argument, LOPT_JOBS },
+		{ "buffer-size", 0, "Memory used to buffer input files, in MiB (default 64)", required_argument, LOPT_BUFFER_SIZE },
+		{ "cache", 0, "Directory in which converted files are cached between runs", required_argument, LOPT_CACHE },
+		{ "cache-size", 0, "Maximum size of the cache, in MiB (default 1024)", required_argument, LOPT_CACHE_SIZE },
+		{ "dedup", 0, "Store files with identical contents only once", no_argument, LOPT_DEDUP },
+		{ "align", 0, "Align files in the archive to the given boundary (e.g. 4096)", required_argument, LOPT_ALIGN },
+		{ "align-threshold", 0, "Only align files of at least this size, in KiB", required_argument, LOPT_ALIGN_THRESHOLD },
+		{ "order", 0, "Lay out files in the order listed in the given file", required_argument, LOPT_ORDER },
 		{ 0 }
 	}
 };
@@ -0,0 +1,108 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include "system4.h"
+#include "alice.h"
+#include "alice/ar.h"
+#include "cli.h"
+
+enum {
+	LOPT_AFA_VERSION = 256,
+	LOPT_JOBS,
+	LOPT_BUFFER_SIZE,
+	LOPT_DEDUP,
+	LOPT_ALIGN,
+	LOPT_ALIGN_THRESHOLD,
+	LOPT_ORDER,
+};
+
+int command_ar_repack(int argc, char *argv[])
+{
+	set_input_encoding("UTF-8");
+	set_output_encoding("CP932");
+
+	struct ar_pack_options opt = AR_PACK_OPTIONS_DEFAULT;
+
+	while (1) {
+		int c = alice_getopt(argc, argv, &cmd_ar_repack);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case LOPT_AFA_VERSION:
+			opt.afa_version = atoi(optarg);
+			if (opt.afa_version < 1 || opt.afa_version > 2)
+				ALICE_ERROR("Unsupported .afa version: %d", opt.afa_version);
+			break;
+		case LOPT_JOBS:
+			opt.nr_jobs = atoi(optarg);
+			if (opt.nr_jobs < 0)
+				ALICE_ERROR("Invalid number of jobs: %s", optarg);
+			zlib_set_jobs(opt.nr_jobs);
+			break;
+		case LOPT_BUFFER_SIZE:
+			if (atoi(optarg) < 1)
+				ALICE_ERROR("Invalid buffer size: %s", optarg);
+			opt.buffer_size = (size_t)atoi(optarg) * 1024 * 1024;
+			break;
+		case LOPT_DEDUP:
+			opt.dedup = true;
+			break;
+		case LOPT_ALIGN:
+			opt.align = atoi(optarg);
+			if (opt.align < 8 || (opt.align & (opt.align - 1)))
+				ALICE_ERROR("Invalid alignment (must be a power of two >= 8): %s", optarg);
+			break;
+		case LOPT_ALIGN_THRESHOLD:
+			if (atoi(optarg) < 0)
+				ALICE_ERROR("Invalid alignment threshold: %s", optarg);
+			opt.align_threshold = (uint64_t)atoi(optarg) * 1024;
+			break;
+		case LOPT_ORDER:
+			opt.order_file = optarg;
+			break;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2) {
+		USAGE_ERROR(&cmd_ar_repack, "Wrong number of arguments");
+	}
+
+	ar_repack(argv[0], argv[1], &opt);
+	return 0;
+}
+
+struct command cmd_ar_repack = {
+	.name = "repack",
+	.usage = "[options...] <input-file> <output-file>",
+	.description = "Convert an archive file to .afa",
+	.parent = &cmd_ar,
+	.fun = command_ar_repack,
+	.options = {
+		{ "afa-version", 0, "Specify the .afa version (1 or 2)", required_argument, LOPT_AFA_VERSION },
+		{ "jobs", 'j', "Number of worker threads", required_argument, LOPT_JOBS },
+		{ "buffer-size", 0, "Memory used to buffer input files, in MiB (default 64)", required_argument, LOPT_BUFFER_SIZE },
+		{ "dedup", 0, "Store files with identical contents only once", no_argument, LOPT_DEDUP },
+		{ "align", 0, "Align files in the archive to the given boundary (e.g. 4096)", required_argument, LOPT_ALIGN },
+		{ "align-threshold", 0, "Only align files of at least this size, in KiB", required_argument, LOPT_ALIGN_THRESHOLD },
+		{ "order", 0, "Lay out files in the order listed in the given file", required_argument, LOPT_ORDER },
+		{ 0 }
+	}
+};
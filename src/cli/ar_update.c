@@ -0,0 +1,77 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include "system4.h"
+#include "alice.h"
+#include "alice/ar.h"
+#include "cli.h"
+
+enum {
+	LOPT_BACKSLASH = 256,
+	LOPT_COMPACT,
+	LOPT_TRUST_MTIME,
+};
+
+int command_ar_update(int argc, char *argv[])
+{
+	set_input_encoding("UTF-8");
+	set_output_encoding("CP932");
+
+	unsigned flags = 0;
+
+	while (1) {
+		int c = alice_getopt(argc, argv, &cmd_ar_update);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case LOPT_BACKSLASH:
+			ar_set_path_separator('\\');
+			break;
+		case LOPT_COMPACT:
+			flags |= AR_UPDATE_COMPACT;
+			break;
+		case LOPT_TRUST_MTIME:
+			flags |= AR_UPDATE_TRUST_MTIME;
+			break;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) {
+		USAGE_ERROR(&cmd_ar_update, "Wrong number of arguments");
+	}
+
+	ar_update(argv[0], NULL, flags);
+	return 0;
+}
+
+struct command cmd_ar_update = {
+	.name = "update",
+	.usage = "[options...] <manifest-file>",
+	.description = "Add or replace files in an existing archive",
+	.parent = &cmd_ar,
+	.fun = command_ar_update,
+	.options = {
+		{ "backslash", 0, "Use backslash as the path separator", no_argument, LOPT_BACKSLASH },
+		{ "compact", 0, "Reclaim the space of replaced files afterwards", no_argument, LOPT_COMPACT },
+		{ "trust-mtime", 0, "Assume files older than the archive are unchanged", no_argument, LOPT_TRUST_MTIME },
+		{ 0 }
+	}
+};
@@ -21,6 +21,8 @@
 #include <stdio.h>
 #include <getopt.h>
 
+struct port;
+
 #define USAGE_ERROR(cmd, msg, ...) (print_usage(cmd), ALICE_ERROR(msg, ##__VA_ARGS__))
 
 struct alice_option {
@@ -45,6 +47,7 @@ struct command {
 void print_usage(struct command *cmd);
 int alice_getopt(int argc, char *argv[], struct command *cmd);
 FILE *alice_open_output_file(const char *path);
+void alice_open_output_port(struct port *port, const char *path);
 
 extern struct command cmd_acx_dump;
 extern struct command cmd_acx_build;
@@ -54,6 +57,8 @@ extern struct command cmd_ain_edit;
 extern struct command cmd_ar_extract;
 extern struct command cmd_ar_list;
 extern struct command cmd_ar_pack;
+extern struct command cmd_ar_update;
+extern struct command cmd_ar_repack;
 extern struct command cmd_asd_dump;
 extern struct command cmd_asd_build;
 extern struct command cmd_cg_convert;
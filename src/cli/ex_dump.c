@@ -72,9 +72,8 @@ int command_ex_dump(int argc, char *argv[])
 		USAGE_ERROR(&cmd_ex_dump, "Wrong number of arguments.");
 	}
 
-	FILE *out = alice_open_output_file(output_file);
-
 	if (decrypt) {
+		FILE *out = alice_open_output_file(output_file);
 		size_t size;
 		uint8_t *buf = ex_decrypt(argv[0], &size, NULL);
 		if (fwrite(buf, size, 1, out) != 1)
@@ -89,18 +88,17 @@ int command_ex_dump(int argc, char *argv[])
 		ALICE_ERROR("ex_read_file(\"%s\") failed", argv[0]);
 
 	if (split) {
-		const char *dir;
-		if (output_file)
-			dir = dirname(output_file);
-		else
-			dir = ".";
-		ex_dump_split(out, ex, dir);
+		// dirname may modify its argument
+		char *tmp = output_file ? xstrdup(output_file) : NULL;
+		const char *dir = tmp ? dirname(tmp) : ".";
+		ex_dump_split(alice_open_output_file(output_file), ex, dir);
+		free(tmp);
 	} else {
 		struct port port;
-		port_file_init(&port, out);
+		alice_open_output_port(&port, output_file);
 		ex_dump(&port, ex);
-		port_close(&port);
-		fclose(out);
+		if (!port_close(&port))
+			ALICE_ERROR("Failed to write output: %s", strerror(port.err));
 	}
 	ex_free(ex);
 
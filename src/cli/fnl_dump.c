@@ -25,14 +25,28 @@
 #include <png.h>
 #include "little_endian.h"
 #include "system4.h"
+#include "system4/buffer.h"
 #include "system4/file.h"
 #include "system4/fnl.h"
 #include "system4/string.h"
 #include "system4/utfsjis.h"
 #include "alice.h"
+#include "alice/output_writer.h"
 #include "cli.h"
 
-static void write_bitmap(FILE *f, uint32_t width, uint32_t height, uint8_t *pixels)
+static void png_write_buffer(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+	buffer_write_bytes(png_get_io_ptr(png_ptr), data, length);
+}
+
+static void png_flush_buffer(possibly_unused png_structp png_ptr)
+{
+}
+
+/*
+ * Encode a 1-bit glyph bitmap as a PNG image in memory.
+ */
+static void write_bitmap(struct buffer *out, uint32_t width, uint32_t height, uint8_t *pixels)
 {
 	if (width % 8 != 0)
 		ERROR("Invalid glyph width");
@@ -52,7 +66,7 @@ static void write_bitmap(FILE *f, uint32_t width, uint32_t height, uint8_t *pixe
 	if (setjmp(png_jmpbuf(png_ptr)))
 		ERROR("png_init_io failed");
 
-	png_init_io(png_ptr, f);
+	png_set_write_fn(png_ptr, out, png_write_buffer, png_flush_buffer);
 
 	if (setjmp(png_jmpbuf(png_ptr)))
 		ERROR("png_write_header failed");
@@ -114,16 +128,14 @@ int command_fnl_dump(int argc, char *argv[])
 	if (!fnl)
 		ALICE_ERROR("fnl_open failed");
 
+	struct output_writer *w = output_writer_new(0);
+
 	for (size_t font = 0; font < fnl->nr_fonts; font++) {
 		NOTICE("FONT %u", (unsigned)font);
 		for (size_t face = 0; face < fnl->fonts[font].nr_faces; face++) {
 			struct fnl_font_face *font_face = &fnl->fonts[font].faces[face];
 			NOTICE("\tsize %lu (%lu glyphs)", font_face->height, font_face->nr_glyphs);
 
-			// create subdir
-			sprintf(path, "%s/font_%u/%upx", output_dir, (unsigned)font, (unsigned)font_face->height);
-			mkdir_p(path);
-
 			// extract glyphs
 			for (size_t g = 0; g < font_face->nr_glyphs; g++) {
 				struct fnl_glyph *glyph = &font_face->glyphs[g];
@@ -132,22 +144,24 @@ int command_fnl_dump(int argc, char *argv[])
 
 				sprintf(path, "%s/font_%u/%upx/glyph_%u.png", output_dir, (unsigned)font,
 					(unsigned)font_face->height, (unsigned)g);
-				FILE *f = file_open_utf8(path, "wb");
-				if (!f) {
-					ERROR("fopen failed: %s", strerror(errno));
-				}
+				output_writer_mkdir_for_file(w, path);
 
 				unsigned long data_size;
 				uint8_t *data = fnl_glyph_data(fnl, glyph, &data_size);
 
+				struct buffer png;
+				buffer_init(&png, NULL, 0);
 				uint32_t height = font_face->height;
 				uint32_t width = (data_size*8) / height;
-				write_bitmap(f, width, height, data);
+				write_bitmap(&png, width, height, data);
 				free(data);
-				fclose(f);
+
+				// the writer frees the PNG data once it's been written
+				output_writer_write(w, path, png.buf, png.index, true, free, png.buf);
 			}
 		}
 	}
+	output_writer_free(w);
 	fnl_free(fnl);
 	return 0;
 }
@@ -17,7 +17,6 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
-#include <zlib.h>
 
 #include "little_endian.h"
 #include "system4.h"
@@ -67,12 +66,8 @@ void acx_write(FILE *out, struct acx *acx)
 	}
 
 	// compress serialized data
-	unsigned long compressed_size = buf.index * 1.001 + 12;
-	uint8_t *dst = xmalloc(compressed_size);
-	int r = compress2(dst, &compressed_size, buf.buf, buf.index, 1);
-	if (r != Z_OK) {
-		ERROR("compress failed");
-	}
+	size_t compressed_size;
+	uint8_t *dst = zlib_compress(buf.buf, buf.index, &compressed_size);
 
 	// write data header
 	uint8_t header[8];
@@ -15,14 +15,16 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "system4/ain.h"
 #include "system4/instructions.h"
 #include "system4/string.h"
 #include "alice.h"
 #include "alice/ain.h"
 #include "alice/port.h"
-#include "khash.h"
+#include "alice/thread_pool.h"
 #include "kvec.h"
 #include "little_endian.h"
 
@@ -33,125 +35,117 @@ enum jump_target_type {
 };
 
 struct jump_target {
+	ain_addr_t addr;
 	enum jump_target_type type;
 	union {
-		char *label;
 		struct ain_switch_case *switch_case;
 		struct ain_switch *switch_default;
 	};
 };
 
-kv_decl(jump_list, struct jump_target*);
+kv_decl(jump_list, struct jump_target);
 
-KHASH_MAP_INIT_INT(jump_table, jump_list*);
-khash_t(jump_table) *jump_table;
-
-static void jump_table_init(void)
+static void jump_table_fini(struct dasm_state *dasm)
 {
-	jump_table = kh_init(jump_table);
+	free(dasm->jump_targets);
+	dasm->jump_targets = NULL;
+	dasm->nr_jump_targets = 0;
+	dasm->jump_cursor = 0;
 }
 
-static void free_jump_targets(jump_list *list)
+/*
+ * Returns the index of the first jump target at or after `addr`.
+ */
+static size_t jump_table_search(struct dasm_state *dasm, size_t addr)
 {
-	if (!list)
-		return;
-	for (size_t i = 0; i < kv_size(*list); i++) {
-		struct jump_target *t = kv_A(*list, i);
-		if (t->type == JMP_LABEL)
-			free(t->label);
-		free(t);
+	size_t lo = 0, hi = dasm->nr_jump_targets;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (dasm->jump_targets[mid].addr < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	kv_destroy(*list);
-	free(list);
+	return lo;
 }
 
-static void jump_table_fini(void)
-{
-	jump_list *list;
-	kh_foreach_value(jump_table, list, free_jump_targets(list));
-	kh_destroy(jump_table, jump_table);
-}
-
-static jump_list *get_jump_targets(ain_addr_t addr)
+/*
+ * Like jump_table_search, but starting from the cursor. Addresses are usually
+ * visited in increasing order, so this is typically a step or two forward.
+ */
+static size_t jump_table_seek(struct dasm_state *dasm, size_t addr)
 {
-	khiter_t k = kh_get(jump_table, jump_table, addr);
-	if (k == kh_end(jump_table))
-		return NULL;
-	return kh_value(jump_table, k);
+	size_t i = dasm->jump_cursor;
+	if (i > 0 && dasm->jump_targets[i-1].addr >= addr) {
+		i = jump_table_search(dasm, addr);
+	} else {
+		for (int n = 0; i < dasm->nr_jump_targets && dasm->jump_targets[i].addr < addr; i++, n++) {
+			if (n == 8) {
+				i = jump_table_search(dasm, addr);
+				break;
+			}
+		}
+	}
+	dasm->jump_cursor = i;
+	return i;
 }
 
-bool dasm_is_jump_target(struct dasm_state *dasm)
+bool dasm_is_jump_target(struct dasm_state *dasm, size_t addr)
 {
-	khiter_t k = kh_get(jump_table, jump_table, dasm->addr);
-	return k != kh_end(jump_table);
+	size_t i = jump_table_search(dasm, addr);
+	return i < dasm->nr_jump_targets && dasm->jump_targets[i].addr == addr;
 }
 
-static char *get_label(ain_addr_t addr)
+static bool has_label(struct dasm_state *dasm, ain_addr_t addr)
 {
-	jump_list *list = get_jump_targets(addr);
-	for (size_t i = 0; i < kv_size(*list); i++) {
-		struct jump_target *t = kv_A(*list, i);
-		if (t->type == JMP_LABEL)
-			return t->label;
+	for (size_t i = jump_table_search(dasm, addr); i < dasm->nr_jump_targets; i++) {
+		if (dasm->jump_targets[i].addr != addr)
+			break;
+		if (dasm->jump_targets[i].type == JMP_LABEL)
+			return true;
 	}
-	return NULL;
+	return false;
 }
 
-static void add_jump_target(struct jump_target *target, ain_addr_t addr)
+static void add_label(jump_list *targets, ain_addr_t addr)
 {
-	int ret;
-	khiter_t k = kh_put(jump_table, jump_table, addr, &ret);
-	if (!ret) {
-		// add to list
-		jump_list *list = kh_value(jump_table, k);
-		kv_push(struct jump_target*, *list, target);
-	} else if (ret == 1) {
-		// create list
-		jump_list *list = xmalloc(sizeof(jump_list));
-		kv_init(*list);
-		kv_push(struct jump_target*, *list, target);
-		kh_value(jump_table, k) = list;
-	} else {
-		WARNING("Failed to insert target into jump table (%d)", ret);
-	}
+	struct jump_target t = { .addr = addr, .type = JMP_LABEL };
+	kv_push(struct jump_target, *targets, t);
 }
 
-static void add_label(char *name, ain_addr_t addr)
+static void add_switch_case(jump_list *targets, struct ain_switch_case *c)
 {
-	// check for duplicate label
-	jump_list *list = get_jump_targets(addr);
-	if (list) {
-		for (size_t i = 0; i < kv_size(*list); i++) {
-			struct jump_target *t = kv_A(*list, i);
-			if (t->type == JMP_LABEL) {
-				free(name);
-				return;
-			}
-		}
-	}
-
-	struct jump_target *t = xmalloc(sizeof(struct jump_target));
-	t->type = JMP_LABEL;
-	t->label = name;
-	add_jump_target(t, addr);
+	struct jump_target t = { .addr = c->address, .type = JMP_CASE, .switch_case = c };
+	kv_push(struct jump_target, *targets, t);
 }
 
-static void add_switch_case(struct ain_switch_case *c)
+static void add_switch_default(jump_list *targets, struct ain_switch *s)
 {
-	struct jump_target *t = xmalloc(sizeof(struct jump_target));
-	t->type = JMP_CASE;
-	t->switch_case = c;
-	add_jump_target(t, c->address);
+	if (s->default_address == -1)
+		return;
+	struct jump_target t = { .addr = s->default_address, .type = JMP_DEFAULT, .switch_default = s };
+	kv_push(struct jump_target, *targets, t);
 }
 
-static void add_switch_default(struct ain_switch *s)
+/*
+ * Targets at the same address are printed in the order: label, then for each
+ * switch (in order) its default followed by its cases.
+ */
+static int jump_target_cmp(const void *_a, const void *_b)
 {
-	if (s->default_address == -1)
-		return;
-	struct jump_target *t = xmalloc(sizeof(struct jump_target));
-	t->type = JMP_DEFAULT;
-	t->switch_default = s;
-	add_jump_target(t, s->default_address);
+	const struct jump_target *a = _a, *b = _b;
+	if (a->addr != b->addr)
+		return a->addr < b->addr ? -1 : 1;
+	if (a->type == JMP_LABEL || b->type == JMP_LABEL)
+		return (b->type == JMP_LABEL) - (a->type == JMP_LABEL);
+
+	struct ain_switch *a_swi = a->type == JMP_CASE ? a->switch_case->parent : a->switch_default;
+	struct ain_switch *b_swi = b->type == JMP_CASE ? b->switch_case->parent : b->switch_default;
+	if (a_swi != b_swi)
+		return a_swi < b_swi ? -1 : 1;
+	ptrdiff_t a_no = a->type == JMP_CASE ? a->switch_case - a_swi->cases : -1;
+	ptrdiff_t b_no = b->type == JMP_CASE ? b->switch_case - b_swi->cases : -1;
+	return a_no < b_no ? -1 : a_no > b_no;
 }
 
 union float_cast {
@@ -169,14 +163,16 @@ static float arg_to_float(int32_t arg)
 static void print_sjis(struct dasm_state *dasm, const char *s)
 {
 	char *u = conv_output(s);
-	port_printf(dasm->port, "%s", u);
+	port_put_string(dasm->port, u);
 	free(u);
 }
 
 void dasm_print_string(struct dasm_state *dasm, const char *str)
 {
 	char *u = escape_string(str);
-	port_printf(dasm->port, "\"%s\"", u);
+	port_putc(dasm->port, '"');
+	port_put_string(dasm->port, u);
+	port_putc(dasm->port, '"');
 	free(u);
 }
 
@@ -260,26 +256,24 @@ static void print_hll_function_name(struct dasm_state *dasm, struct ain_library
 static void print_argument(struct dasm_state *dasm, int32_t arg, enum instruction_argtype type, possibly_unused const char **comment)
 {
 	if (dasm->flags & DASM_RAW) {
-		port_printf(dasm->port, "0x%x", arg);
+		port_put_hex(dasm->port, (uint32_t)arg);
 		return;
 	}
-	char *label;
 	struct ain *ain = dasm->ain;
 	switch (type) {
 	case T_INT:
 	case T_SWITCH:
-		port_printf(dasm->port, "%d", arg);
+		port_put_int(dasm->port, arg);
 		break;
 	case T_FLOAT:
-		port_printf(dasm->port, "%f", arg_to_float(arg));
+		port_put_float(dasm->port, arg_to_float(arg));
 		break;
 	case T_ADDR:
-		label = get_label(arg);
-		if (!label) {
+		if (!has_label(dasm, arg)) {
 			WARNING("No label generated for address: 0x%x", arg);
-			port_printf(dasm->port, "0x%x", arg);
+			port_put_hex(dasm->port, (uint32_t)arg);
 		} else {
-			port_printf(dasm->port, "%s", label);
+			port_put_hex(dasm->port, (size_t)arg);
 		}
 		break;
 	case T_FUNC:
@@ -303,8 +297,10 @@ static void print_argument(struct dasm_state *dasm, int32_t arg, enum instructio
 	case T_MSG:
 		if (arg < 0 || arg >= ain->nr_messages)
 			DASM_PRINT_ERROR(dasm, "Invalid message number: %d", arg);
-		else
-			port_printf(dasm->port, "0x%x ", arg);
+		else {
+			port_put_hex(dasm->port, (uint32_t)arg);
+			port_putc(dasm->port, ' ');
+		}
 		*comment = ain->messages[arg]->text;
 		break;
 	case T_LOCAL:
@@ -333,7 +329,7 @@ static void print_argument(struct dasm_state *dasm, int32_t arg, enum instructio
 		if (arg < 0 || arg >= NR_SYSCALLS || !syscalls[arg].name)
 			DASM_PRINT_ERROR(dasm, "Invalid/unknown syscall number: %d", arg);
 		else
-			port_printf(dasm->port, "%s", syscalls[arg].name);
+			port_put_string(dasm->port, syscalls[arg].name);
 		break;
 	case T_HLL:
 		if (arg < 0 || arg >= ain->nr_libraries)
@@ -342,11 +338,11 @@ static void print_argument(struct dasm_state *dasm, int32_t arg, enum instructio
 			dasm_print_identifier(dasm, ain->libraries[arg].name);
 		break;
 	case T_HLLFUNC:
-		port_printf(dasm->port, "0x%x", arg);
+		port_put_hex(dasm->port, (uint32_t)arg);
 		break;
 	case T_FILE:
 		if (!ain->nr_filenames) {
-			port_printf(dasm->port, "%d", arg);
+			port_put_int(dasm->port, arg);
 			break;
 		}
 		if (arg < 0 || arg >= ain->nr_filenames)
@@ -374,7 +370,7 @@ static void print_arguments(struct dasm_state *dasm, const struct instruction *i
 	}
 	if (instr->opcode == FUNC) {
 		port_putc(dasm->port, ' ');
-		port_printf(dasm->port, "%d", dasm->func);
+		port_put_int(dasm->port, dasm->func);
 		//ain_dump_function(dasm->out, dasm->ain, &dasm->ain->functions[dasm->func]);
 		return;
 	}
@@ -385,7 +381,7 @@ static void print_arguments(struct dasm_state *dasm, const struct instruction *i
 		print_argument(dasm, LittleEndian_getDW(dasm->ain->code, dasm->addr + 2 + i*4), instr->args[i], &comment);
 	}
 	if (comment) {
-		port_printf(dasm->port, "; ");
+		port_put_string(dasm->port, "; ");
 		dasm_print_string(dasm, comment);
 	}
 }
@@ -426,6 +422,9 @@ void dasm_init(struct dasm_state *dasm, struct port *port, struct ain *ain, uint
 	dasm->flags = flags;
 	dasm->addr = 0;
 	dasm->func = -1;
+	dasm->jump_targets = NULL;
+	dasm->nr_jump_targets = 0;
+	dasm->jump_cursor = 0;
 
 	for (int i = 0; i < DASM_FUNC_STACK_SIZE; i++) {
 		dasm->func_stack[i] = -1;
@@ -503,6 +502,15 @@ static void print_function_info(struct dasm_state *dasm, int fno)
 	free(rtype);
 }
 
+static void push_function(struct dasm_state *dasm, int fno)
+{
+	for (int i = 1; i < DASM_FUNC_STACK_SIZE; i++) {
+		dasm->func_stack[i] = dasm->func_stack[i-1];
+	}
+	dasm->func_stack[0] = dasm->func;
+	dasm->func = fno;
+}
+
 static void dasm_enter_function(struct dasm_state *dasm, int fno)
 {
 	if (fno < 0 || fno >= dasm->ain->nr_functions) {
@@ -514,12 +522,7 @@ static void dasm_enter_function(struct dasm_state *dasm, int fno)
 		}
 	}
 
-	for (int i = 1; i < DASM_FUNC_STACK_SIZE; i++) {
-		dasm->func_stack[i] = dasm->func_stack[i-1];
-	}
-	dasm->func_stack[0] = dasm->func;
-	dasm->func = fno;
-
+	push_function(dasm, fno);
 	print_function_info(dasm, fno);
 }
 
@@ -553,7 +556,7 @@ static void print_instruction(struct dasm_state *dasm)
 	if (!(dasm->flags & DASM_NO_MACROS) && dasm_print_macro(dasm))
 		return;
 
-	port_printf(dasm->port, "%s", dasm->instr->name);
+	port_put_string(dasm->port, dasm->instr->name);
 	print_arguments(dasm, dasm->instr);
 	port_putc(dasm->port, '\n');
 }
@@ -565,7 +568,7 @@ static void print_switch_case(struct dasm_state *dasm, struct ain_switch_case *c
 	switch (c->parent->case_type) {
 	case AIN_SWITCH_INT:
 		port_printf(dasm->port, ".CASE %u:%u ", swi, ci);
-		port_printf(dasm->port, "%d", c->value);
+		port_put_int(dasm->port, c->value);
 		break;
 	case AIN_SWITCH_STRING:
 		port_printf(dasm->port, ".STRCASE %u:%u ", swi, ci);
@@ -579,16 +582,10 @@ static void print_switch_case(struct dasm_state *dasm, struct ain_switch_case *c
 	port_putc(dasm->port, '\n');
 }
 
-static char *genlabel(size_t addr)
-{
-	char name[64];
-	snprintf(name, 64, "0x%zx", addr);
-	return strdup(name);
-}
-
 static void generate_labels(struct dasm_state *dasm)
 {
-	jump_table_init();
+	jump_list targets;
+	kv_init(targets);
 
 	if (!(dasm->flags & DASM_RAW)) {
 		for (dasm->addr = 0; dasm->addr < dasm->ain->code_size;) {
@@ -596,91 +593,429 @@ static void generate_labels(struct dasm_state *dasm)
 			for (int i = 0; i < instr->nr_args; i++) {
 				if (instr->args[i] != T_ADDR)
 					continue;
-				int32_t arg = LittleEndian_getDW(dasm->ain->code, dasm->addr + 2 + i*4);
-				add_label(genlabel(arg), arg);
+				add_label(&targets, LittleEndian_getDW(dasm->ain->code, dasm->addr + 2 + i*4));
 			}
 			dasm->addr += instruction_width(instr->opcode);
 		}
 	}
 	for (int i = 0; i < dasm->ain->nr_switches; i++) {
-		add_switch_default(&dasm->ain->switches[i]);
+		add_switch_default(&targets, &dasm->ain->switches[i]);
 		for (int j = 0; j < dasm->ain->switches[i].nr_cases; j++) {
-			add_switch_case(&dasm->ain->switches[i].cases[j]);
+			add_switch_case(&targets, &dasm->ain->switches[i].cases[j]);
 		}
 	}
+
+	qsort(targets.a, kv_size(targets), sizeof(struct jump_target), jump_target_cmp);
+
+	// remove duplicate labels
+	size_t n = 0;
+	for (size_t i = 0; i < kv_size(targets); i++) {
+		struct jump_target *t = &kv_A(targets, i);
+		if (t->type == JMP_LABEL && n > 0 && kv_A(targets, n-1).type == JMP_LABEL
+				&& kv_A(targets, n-1).addr == t->addr)
+			continue;
+		kv_A(targets, n++) = *t;
+	}
+
+	dasm->jump_targets = targets.a;
+	dasm->nr_jump_targets = n;
+	dasm->jump_cursor = 0;
 }
 
-void ain_disassemble(struct port *port, struct ain *ain, unsigned int flags)
+static void print_jump_targets(struct dasm_state *dasm)
+{
+	for (size_t i = jump_table_seek(dasm, dasm->addr); i < dasm->nr_jump_targets; i++) {
+		struct jump_target *t = &dasm->jump_targets[i];
+		if (t->addr != dasm->addr)
+			break;
+		switch (t->type) {
+		case JMP_LABEL:
+			port_put_hex(dasm->port, dasm->addr);
+			port_put_string(dasm->port, ":\n");
+			break;
+		case JMP_CASE:
+			print_switch_case(dasm, t->switch_case);
+			break;
+		case JMP_DEFAULT:
+			port_printf(dasm->port, ".DEFAULT %zd\n", t->switch_default - dasm->ain->switches);
+			break;
+		}
+	}
+}
+
+/*
+ * Disassemble the instructions in [start, end). Returns false if disassembly
+ * stopped before `end` because of an invalid instruction.
+ */
+static bool disassemble_range(struct dasm_state *dasm, size_t start, size_t end)
 {
+	for (dasm_jump(dasm, start); !dasm_eof(dasm) && dasm->addr < end; dasm_next(dasm)) {
+		print_jump_targets(dasm);
+		print_instruction(dasm);
+	}
+	return dasm->addr >= end || end >= dasm->ain->code_size;
+}
+
+/*
+ * For parallel disassembly, the CODE section is split into chunks at FUNC
+ * instructions. Each chunk is disassembled into its own buffer port, starting
+ * from the function context (current function and function stack) that a
+ * sequential pass would have at that point, and the buffers are written out
+ * in address order. Labels are generated up front and only read by the
+ * workers.
+ */
+#define DASM_MIN_CHUNK_SIZE (64 * 1024)
+
+struct dasm_chunk {
+	struct thread_job job;
 	struct dasm_state dasm;
-	dasm_init(&dasm, port, ain, flags);
+	struct port port;
+	size_t start;
+	size_t end;
+	bool complete;
+};
 
-	generate_labels(&dasm);
+static void disassemble_chunk(struct thread_job *job)
+{
+	struct dasm_chunk *chunk = (struct dasm_chunk*)job;
+	chunk->complete = disassemble_range(&chunk->dasm, chunk->start, chunk->end);
+}
 
-	for (dasm_reset(&dasm); !dasm_eof(&dasm); dasm_next(&dasm)) {
-		jump_list *targets = get_jump_targets(dasm.addr);
-		if (targets) {
-			for (size_t i = 0; i < kv_size(*targets); i++) {
-				struct jump_target *t = kv_A(*targets, i);
-				switch (t->type) {
-				case JMP_LABEL:
-					port_printf(dasm.port, "%s:\n", t->label);
-					break;
-				case JMP_CASE:
-					print_switch_case(&dasm, t->switch_case);
-					break;
-				case JMP_DEFAULT:
-					port_printf(dasm.port, ".DEFAULT %zd\n", t->switch_default - dasm.ain->switches);
-					break;
-				}
+kv_decl(chunk_list, struct dasm_chunk);
+
+static void add_chunk(chunk_list *chunks, struct dasm_state *state, size_t start)
+{
+	struct dasm_chunk chunk = { .dasm = *state, .start = start };
+	if (kv_size(*chunks))
+		kv_A(*chunks, kv_size(*chunks) - 1).end = start;
+	kv_push(struct dasm_chunk, *chunks, chunk);
+}
+
+/*
+ * Returns false if printing an argument of the given type would raise an
+ * error (see print_argument).
+ */
+static bool argument_valid(struct dasm_state *dasm, int32_t arg, enum instruction_argtype type)
+{
+	struct ain *ain = dasm->ain;
+	switch (type) {
+	case T_FUNC:
+		return arg >= 0 && arg < ain->nr_functions;
+	case T_DLG:
+		return arg >= 0 && arg < ain->nr_delegates;
+	case T_STRING:
+		return arg >= 0 && arg < ain->nr_strings;
+	case T_MSG:
+		return arg >= 0 && arg < ain->nr_messages;
+	case T_LOCAL:
+		return dasm->func >= 0 && arg >= 0 && arg < ain->functions[dasm->func].nr_vars;
+	case T_GLOBAL:
+		return arg >= 0 && arg < ain->nr_globals;
+	case T_STRUCT:
+		return arg >= 0 && arg < ain->nr_structures;
+	case T_SYSCALL:
+		return arg >= 0 && arg < NR_SYSCALLS && syscalls[arg].name;
+	case T_HLL:
+		return arg >= 0 && arg < ain->nr_libraries;
+	case T_FILE:
+		return !ain->nr_filenames || (arg >= 0 && arg < ain->nr_filenames);
+	default:
+		return true;
+	}
+}
+
+/*
+ * Split the CODE section into chunks of (at least) `chunk_size` bytes, each
+ * beginning at a FUNC instruction, and record the function context at the
+ * start of each chunk. Returns false if disassembling the CODE section would
+ * raise an error.
+ */
+static bool plan_chunks(struct dasm_state *dasm, size_t chunk_size, chunk_list *chunks)
+{
+	bool valid = true;
+	struct dasm_state state = *dasm;
+	add_chunk(chunks, &state, 0);
+
+	size_t chunk_start = 0;
+	const uint8_t *code = dasm->ain->code;
+	size_t code_size = dasm->ain->code_size;
+	for (size_t addr = 0; addr < code_size;) {
+		uint16_t opcode = LittleEndian_getW(code, addr);
+		// the chunk containing an invalid instruction ends the disassembly
+		if (opcode >= NR_OPCODES) {
+			valid = false;
+			break;
+		}
+		const struct instruction *instr = &instructions[opcode];
+		if (addr + instr->nr_args * 4 >= code_size) {
+			valid = false;
+			break;
+		}
+
+		// arguments are printed as-is in raw mode
+		for (int i = 0; i < instr->nr_args && (opcode == FUNC || !(dasm->flags & DASM_RAW)); i++) {
+			int32_t arg = LittleEndian_getDW(code, addr + 2 + i*4);
+			if (!argument_valid(&state, arg, instr->args[i]))
+				valid = false;
+		}
+
+		if (opcode == FUNC) {
+			if (addr - chunk_start >= chunk_size) {
+				add_chunk(chunks, &state, addr);
+				chunk_start = addr;
 			}
+			int fno = LittleEndian_getDW(code, addr + 2);
+			push_function(&state, fno < 0 || fno >= dasm->ain->nr_functions ? 0 : fno);
+		} else if (opcode == ENDFUNC) {
+			dasm_leave_function(&state);
 		}
-		print_instruction(&dasm);
+		addr += instruction_width(opcode);
 	}
-	//fflush(dasm.out);
-
-	jump_table_fini();
+	kv_A(*chunks, kv_size(*chunks) - 1).end = code_size;
+	return valid;
 }
 
-bool _ain_disassemble_function(struct port *port, struct ain *ain, int fno, unsigned int flags)
+void ain_disassemble(struct port *port, struct ain *ain, unsigned int flags)
 {
 	struct dasm_state dasm;
 	dasm_init(&dasm, port, ain, flags);
 
 	generate_labels(&dasm);
 
-	uint32_t addr = ain->functions[fno].address - 6;
-	for (dasm_jump(&dasm, addr); !dasm_eof(&dasm); dasm_next(&dasm)) {
-		jump_list *targets = get_jump_targets(dasm.addr);
-		if (targets) {
-			for (size_t i = 0; i < kv_size(*targets); i++) {
-				struct jump_target *t = kv_A(*targets, i);
-				switch (t->type) {
-				case JMP_LABEL:
-					port_printf(dasm.port, "%s:\n", t->label);
-					break;
-				case JMP_CASE:
-					print_switch_case(&dasm, t->switch_case);
-					break;
-				case JMP_DEFAULT:
-					port_printf(dasm.port, ".DEFAULT %zd\n", t->switch_default - dasm.ain->switches);
+	chunk_list chunks;
+	kv_init(chunks);
+	struct thread_pool *pool = thread_pool_new(0);
+	int nr_threads = thread_pool_size(pool);
+	size_t chunk_size = max(DASM_MIN_CHUNK_SIZE, ain->code_size / (nr_threads * 8));
+	// errors are fatal unless DASM_WARN_ON_ERROR is set; in that case we
+	// disassemble sequentially so that the output up to the (first) error is
+	// written before exiting
+	if (nr_threads == 1 || ain->code_size < 2 * DASM_MIN_CHUNK_SIZE
+			|| (!plan_chunks(&dasm, chunk_size, &chunks) && !(flags & DASM_WARN_ON_ERROR))) {
+		disassemble_range(&dasm, 0, ain->code_size);
+		goto out;
+	}
+
+	// keep a bounded number of chunks in flight, so that memory use doesn't
+	// grow with the size of the output
+	size_t window = nr_threads * 4;
+	size_t next = 0;
+	for (size_t i = 0; i < kv_size(chunks); i++) {
+		for (; next < kv_size(chunks) && next < i + window; next++) {
+			struct dasm_chunk *c = &kv_A(chunks, next);
+			port_buffer_init(&c->port);
+			c->dasm.port = &c->port;
+			thread_pool_submit(pool, &c->job, disassemble_chunk);
+		}
+
+		struct dasm_chunk *c = &kv_A(chunks, i);
+		thread_pool_wait_job(pool, &c->job);
+		size_t size;
+		uint8_t *data = port_buffer_get(&c->port, &size);
+		port_write_bytes(port, data, size);
+		free(data);
+		port_close(&c->port);
+		if (!c->complete) {
+			// a sequential pass would stop here as well
+			for (i++; i < next; i++) {
+				thread_pool_wait_job(pool, &kv_A(chunks, i).job);
+				port_close(&kv_A(chunks, i).port);
+			}
+			break;
+		}
+	}
+out:
+	thread_pool_free(pool);
+	kv_destroy(chunks);
+	jump_table_fini(&dasm);
+}
+
+/*
+ * Disassembling a single function needs the jump targets for the whole CODE
+ * section (a jump may target another function, and switch cases are global),
+ * as well as the extent of the function. Both are computed once per ain file
+ * and cached, so that disassembling a function costs O(function size).
+ */
+struct function_range {
+	uint32_t start;
+	uint32_t end;
+};
+
+struct dasm_index {
+	struct ain *ain;
+	uint8_t *code;
+	size_t code_size;
+	// indexed by function number; start == end if the function wasn't found
+	struct function_range *functions;
+	// jump targets without labels (DASM_RAW) and with labels
+	struct jump_target *jump_targets[2];
+	size_t nr_jump_targets[2];
+	// one reference is held by index_cache, and one by each disassembly in
+	// progress; protected by index_mutex
+	int refs;
+};
+
+kv_decl(index_list, struct dasm_index*);
+static index_list index_cache = {0};
+static pthread_mutex_t index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+kv_decl(fno_list, int);
+
+static void close_function(struct dasm_index *index, fno_list *open, size_t i, uint32_t end)
+{
+	index->functions[kv_A(*open, i)].end = end;
+	kv_A(*open, i) = kv_A(*open, kv_size(*open) - 1);
+	open->n--;
+}
+
+/*
+ * Find the extent of each function. A function begins at its FUNC instruction
+ * and ends after its ENDFUNC, or at the next FUNC (other than a lambda) if it
+ * has no ENDFUNC.
+ */
+static void index_functions(struct dasm_index *index)
+{
+	struct ain *ain = index->ain;
+	index->functions = xcalloc(ain->nr_functions, sizeof(struct function_range));
+
+	fno_list open;
+	kv_init(open);
+	uint32_t addr = 0;
+	while (addr < ain->code_size) {
+		uint16_t opcode = LittleEndian_getW(ain->code, addr);
+		if (opcode >= NR_OPCODES || addr + instructions[opcode].nr_args * 4 >= ain->code_size)
+			break;
+		uint32_t next = addr + instruction_width(opcode);
+		int fno = opcode == FUNC || opcode == ENDFUNC ? LittleEndian_getDW(ain->code, addr + 2) : -1;
+		if (fno < 0 || fno >= ain->nr_functions) {
+			addr = next;
+			continue;
+		}
+
+		if (opcode == FUNC) {
+			if (!strstr(ain->functions[fno].name, "<lambda")) {
+				for (size_t i = 0; i < kv_size(open);) {
+					if (kv_A(open, i) != fno)
+						close_function(index, &open, i, addr);
+					else
+						i++;
+				}
+			}
+			if (ain->functions[fno].address == addr + 6) {
+				index->functions[fno].start = addr;
+				kv_push(int, open, fno);
+			}
+		} else {
+			for (size_t i = 0; i < kv_size(open); i++) {
+				if (kv_A(open, i) == fno) {
+					close_function(index, &open, i, next);
 					break;
 				}
 			}
 		}
-		// XXX: functions don't always end with ENDFUNC
-		if (dasm.instr->opcode == FUNC) {
-			int n = dasm_arg(&dasm, 0);
-			if (n != fno && !strstr(ain->functions[n].name, "<lambda"))
-				break;
-		}
-		print_instruction(&dasm);
-		//fflush(dasm.out);
-		if (dasm.instr->opcode == ENDFUNC && dasm_arg(&dasm, 0) == fno)
+		addr = next;
+	}
+	for (size_t i = 0; i < kv_size(open); i++) {
+		index->functions[kv_A(open, i)].end = ain->code_size;
+	}
+	kv_destroy(open);
+}
+
+// NOTE: must be called with index_mutex held
+static void index_put(struct dasm_index *index)
+{
+	if (--index->refs > 0)
+		return;
+	free(index->functions);
+	free(index->jump_targets[0]);
+	free(index->jump_targets[1]);
+	free(index);
+}
+
+// NOTE: must be called with index_mutex held
+static void drop_index(struct ain *ain)
+{
+	for (size_t i = 0; i < kv_size(index_cache); i++) {
+		struct dasm_index *index = kv_A(index_cache, i);
+		if (index->ain != ain)
+			continue;
+		kv_A(index_cache, i) = kv_A(index_cache, kv_size(index_cache) - 1);
+		index_cache.n--;
+		index_put(index);
+		return;
+	}
+}
+
+/*
+ * Get the index for dasm->ain, creating it if necessary. The caller must
+ * release the returned reference with index_put.
+ *
+ * NOTE: must be called with index_mutex held
+ */
+static struct dasm_index *get_index(struct dasm_state *dasm)
+{
+	struct ain *ain = dasm->ain;
+	struct dasm_index *index = NULL;
+	for (size_t i = 0; i < kv_size(index_cache); i++) {
+		struct dasm_index *p = kv_A(index_cache, i);
+		if (p->ain == ain && p->code == ain->code && p->code_size == ain->code_size) {
+			index = p;
 			break;
+		}
+	}
+	if (!index) {
+		// the CODE section was replaced since the index was created; a
+		// disassembly still using the old index keeps it alive
+		drop_index(ain);
+		index = xcalloc(1, sizeof(struct dasm_index));
+		index->ain = ain;
+		index->code = ain->code;
+		index->code_size = ain->code_size;
+		index->refs = 1;
+		index_functions(index);
+		kv_push(struct dasm_index*, index_cache, index);
 	}
-	//fflush(dasm.out);
-	jump_table_fini();
+	index->refs++;
+
+	int labels = !(dasm->flags & DASM_RAW);
+	if (!index->jump_targets[labels]) {
+		generate_labels(dasm);
+		index->jump_targets[labels] = dasm->jump_targets;
+		index->nr_jump_targets[labels] = dasm->nr_jump_targets;
+	}
+	dasm->jump_targets = index->jump_targets[labels];
+	dasm->nr_jump_targets = index->nr_jump_targets[labels];
+	return index;
+}
+
+void ain_disassemble_invalidate(struct ain *ain)
+{
+	pthread_mutex_lock(&index_mutex);
+	drop_index(ain);
+	pthread_mutex_unlock(&index_mutex);
+}
+
+bool _ain_disassemble_function(struct port *port, struct ain *ain, int fno, unsigned int flags)
+{
+	if (fno < 0 || fno >= ain->nr_functions)
+		return false;
+
+	struct dasm_state dasm;
+	dasm_init(&dasm, port, ain, flags);
+
+	pthread_mutex_lock(&index_mutex);
+	struct dasm_index *index = get_index(&dasm);
+	struct function_range range = index->functions[fno];
+	pthread_mutex_unlock(&index_mutex);
+
+	// the reference keeps the jump targets alive if the index is dropped
+	// (by another thread) before we are finished
+	if (range.start < range.end)
+		disassemble_range(&dasm, range.start, range.end);
+
+	pthread_mutex_lock(&index_mutex);
+	index_put(index);
+	pthread_mutex_unlock(&index_mutex);
 	return true;
 }
 
@@ -20,6 +20,7 @@
 #include <string.h>
 #include <errno.h>
 #include "alice.h"
+#include "alice/port.h"
 #include "cJSON.h"
 #include "system4.h"
 #include "system4/ain.h"
@@ -330,17 +331,14 @@ static cJSON *ain_to_json(struct ain *ain)
 	return j;
 }
 
-void ain_dump_json(FILE *out, struct ain *ain)
+void ain_dump_json(struct port *port, struct ain *ain)
 {
 	cJSON *j = ain_to_json(ain);
 	char *str = cJSON_Print(j);
 
-	if (fwrite(str, strlen(str), 1, out) != 1)
+	if (!port_write_bytes(port, (uint8_t*)str, strlen(str)))
 		ERROR("Failed to write to file: %s", strerror(errno));
 
-	if (fclose(out))
-		ERROR("Failed to close file: %s", strerror(errno));
-
 	free(str);
 	cJSON_Delete(j);
 }
@@ -18,6 +18,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "system4/ain.h"
 #include "system4/instructions.h"
 #include "system4/string.h"
@@ -25,12 +26,13 @@
 #include "alice.h"
 #include "alice/ain.h"
 #include "alice/port.h"
+#include "little_endian.h"
 
 // Returns true if the current instruction can be elided.
 // We need to prevent eliding instructions that are jump targets.
-static bool can_elide(struct dasm_state *dasm)
+static bool can_elide(struct dasm_state *dasm, size_t addr)
 {
-	return !dasm_eof(dasm) && !dasm_is_jump_target(dasm);
+	return addr < dasm->ain->code_size && !dasm_is_jump_target(dasm, addr);
 }
 
 static void print_local(struct dasm_state *dasm, int32_t no)
@@ -157,7 +159,8 @@ static void local_emit(struct dasm_state *dasm, int32_t *args)
 static void localassign_emit(struct dasm_state *dasm, int32_t *args)
 {
 	print_local(dasm, args[0]);
-	port_printf(dasm->port, " %d", args[1]);
+	port_putc(dasm->port, ' ');
+	port_put_int(dasm->port, args[1]);
 }
 #define LOCALASSIGN_emit   localassign_emit
 #define X_LOCALASSIGN_emit localassign_emit
@@ -168,7 +171,8 @@ static void F_LOCALASSIGN_emit(struct dasm_state *dasm, int32_t *args)
 {
 	union { int32_t i; float f; } v = { .i = args[1] };
 	print_local(dasm, args[0]);
-	port_printf(dasm->port, " %f", v.f);
+	port_putc(dasm->port, ' ');
+	port_put_float(dasm->port, v.f);
 }
 
 static void S_LOCALASSIGN_emit(struct dasm_state *dasm, int32_t *args)
@@ -233,7 +237,8 @@ static void global_emit(struct dasm_state *dasm, int32_t *args)
 static void globalassign_emit(struct dasm_state *dasm, int32_t *args)
 {
 	dasm_print_identifier(dasm, dasm->ain->globals[args[0]].name);
-	port_printf(dasm->port, " %d", args[1]);
+	port_putc(dasm->port, ' ');
+	port_put_int(dasm->port, args[1]);
 }
 #define GLOBALASSIGN_emit   globalassign_emit
 #define X_GLOBALASSIGN_emit globalassign_emit
@@ -242,7 +247,8 @@ static void F_GLOBALASSIGN_emit(struct dasm_state *dasm, int32_t *args)
 {
 	union { int32_t i; float f; } v = { .i = args[1] };
 	dasm_print_identifier(dasm, dasm->ain->globals[args[0]].name);
-	port_printf(dasm->port, " %f", v.f);
+	port_putc(dasm->port, ' ');
+	port_put_float(dasm->port, v.f);
 }
 
 static bool struct_check(struct dasm_state *dasm, int32_t *args)
@@ -282,7 +288,8 @@ static void struct_emit(struct dasm_state *dasm, int32_t *args)
 static void structassign_emit(struct dasm_state *dasm, int32_t *args)
 {
 	struct_emit(dasm, args);
-	port_printf(dasm->port, " %d", args[1]);
+	port_putc(dasm->port, ' ');
+	port_put_int(dasm->port, args[1]);
 }
 #define STRUCTASSIGN_emit   structassign_emit
 #define X_STRUCTASSIGN_emit structassign_emit
@@ -291,7 +298,8 @@ static void F_STRUCTASSIGN_emit(struct dasm_state *dasm, int32_t *args)
 {
 	union { int32_t i; float f; } v = { .i = args[1] };
 	struct_emit(dasm, args);
-	port_printf(dasm->port, " %f", v.f);
+	port_putc(dasm->port, ' ');
+	port_put_float(dasm->port, v.f);
 }
 
 static bool PUSHVMETHOD_check(struct dasm_state *dasm, int32_t *args)
@@ -310,7 +318,6 @@ static void PUSHVMETHOD_emit(struct dasm_state *dasm, int32_t *args)
 }
 
 #define MACRO_INSTRUCTIONS_MAX 64
-#define MACRO_CHILDREN_MAX 16
 
 #define DEFMACRO(_name, ...) {					\
 		.name = "." #_name,				\
@@ -380,145 +387,139 @@ struct macrodef macrodefs[] = {
 	DEFMACRO(PUSHVMETHOD,       PUSHSTRUCTPAGE, PUSH, DUP_U2, PUSH, REF, SWAP, PUSH, ADD, REF),
 };
 
-struct macro_node {
-	const char * name;
-	enum opcode opcode;
-	int nr_children;
-	struct macro_node *children;
-	struct macro_node *parent;
-	dasm_save_t save;
-	bool (*check)(struct dasm_state *state, int32_t *args);
-	void (*emit)(struct dasm_state *state, int32_t *args);
+/*
+ * The macro definitions are compiled into a DFA (a trie, since each macro is a
+ * fixed instruction sequence) with a transition table indexed by state and
+ * opcode class. Only opcodes which appear in some macro are given a class;
+ * all other opcodes map to class 0, which has no transitions. State 0 is the
+ * start state, and is never the target of a transition.
+ */
+#define MACRO_STATES_MAX 512
+#define MACRO_CLASSES_MAX 32
+
+struct macro_table {
+	int nr_states;
+	int nr_classes;
+	uint8_t opcode_class[NR_OPCODES];
+	int16_t next[MACRO_STATES_MAX][MACRO_CLASSES_MAX];
+	// the macro matched in each state (or NULL)
+	const struct macrodef *accept[MACRO_STATES_MAX];
 };
 
-static struct macro_node *macros;
+static struct macro_table macro_table;
+static pthread_once_t macro_table_once = PTHREAD_ONCE_INIT;
 
-static struct macro_node *find_node(struct macro_node *parent, enum opcode opcode)
+static int macro_class(enum opcode opcode)
 {
-	for (int i = 0; i < parent->nr_children; i++) {
-		if (parent->children[i].opcode == opcode)
-			return &parent->children[i];
+	struct macro_table *t = &macro_table;
+	if (!t->opcode_class[opcode]) {
+		if (t->nr_classes >= MACRO_CLASSES_MAX)
+			ERROR("Exceeded macro opcode limit");
+		t->opcode_class[opcode] = t->nr_classes++;
 	}
-	return NULL;
-}
-
-static struct macro_node *add_child(struct macro_node *parent, enum opcode opcode)
-{
-	int i = parent->nr_children;
-	if (i >= MACRO_CHILDREN_MAX)
-		ERROR("Exceeded macro branch limit");
-	parent->children[i] = (struct macro_node) {
-		.opcode = opcode,
-		.nr_children = 0,
-		.children = xcalloc(MACRO_CHILDREN_MAX, sizeof(struct macro_node)),
-		.parent = parent,
-		.check = NULL,
-		.emit = NULL,
-	};
-	parent->nr_children++;
-	return &parent->children[i];
-}
-
-static void add_macro(struct macrodef *macro)
-{
-	struct macro_node *parent = macros;
-	for (int i = 0; macro->instructions[i] < NR_OPCODES; i++) {
-		struct macro_node *child = find_node(parent, macro->instructions[i]);
-		if (!child)
-			child = add_child(parent, macro->instructions[i]);
-		parent = child;
-	}
-
-	if (parent->emit) {
-		WARNING("Conflicting macro definitions (when adding %s)", macro->name);
-		return;
-	}
-
-	parent->name = macro->name;
-	parent->check = macro->check;
-	parent->emit = macro->emit;
+	return t->opcode_class[opcode];
 }
 
-// Transform macro list into a tree.
-static void create_macro_tree(void)
+static void compile_macros(void)
 {
-	macros = xcalloc(1, sizeof(struct macro_node));
-	macros->children = xcalloc(MACRO_CHILDREN_MAX, sizeof(struct macro_node));
+	struct macro_table *t = &macro_table;
+	t->nr_states = 1;
+	t->nr_classes = 1;
 	for (size_t i = 0; i < sizeof(macrodefs)/sizeof(*macrodefs); i++) {
-		add_macro(&macrodefs[i]);
+		const struct macrodef *macro = &macrodefs[i];
+		int state = 0;
+		for (int j = 0; macro->instructions[j] < NR_OPCODES; j++) {
+			int c = macro_class(macro->instructions[j]);
+			if (!t->next[state][c]) {
+				if (t->nr_states >= MACRO_STATES_MAX)
+					ERROR("Exceeded macro state limit");
+				t->next[state][c] = t->nr_states++;
+			}
+			state = t->next[state][c];
+		}
+
+		if (t->accept[state]) {
+			WARNING("Conflicting macro definitions (when adding %s)", macro->name);
+			continue;
+		}
+		t->accept[state] = macro;
 	}
 }
 
-static struct macro_node *match_rewind(struct dasm_state *dasm, struct macro_node *match)
+static int macro_next(int state, enum opcode opcode)
 {
-	do {
-		match = match->parent;
-	} while (match && !match->check);
+	return macro_table.next[state][macro_table.opcode_class[opcode]];
+}
 
-	if (match)
-		dasm_restore(dasm, match->save);
-	return match;
+/*
+ * Decode the instruction at `*addr` without reporting errors. Invalid
+ * instructions are treated as the end of the CODE section (as in
+ * dasm_get_instruction).
+ */
+static const struct instruction *peek_instruction(struct dasm_state *dasm, size_t *addr)
+{
+	if (*addr < dasm->ain->code_size) {
+		uint16_t opcode = LittleEndian_getW(dasm->ain->code, *addr);
+		if (opcode < NR_OPCODES && *addr + instructions[opcode].nr_args * 4 < dasm->ain->code_size)
+			return &instructions[opcode];
+	}
+	*addr = dasm->ain->code_size;
+	return &instructions[0];
 }
 
 static bool _dasm_print_macro(struct dasm_state *dasm)
 {
-	if (!macros)
-		create_macro_tree();
-
 	int argptr = 0;
 	int32_t args[MACRO_INSTRUCTIONS_MAX];
-
-	// match as many instructions as possible
-	struct macro_node *next, *node = macros;
-	while ((next = find_node(node, dasm->instr->opcode))) {
-		if (node != macros && !can_elide(dasm))
+	// the state after each matched instruction, and that instruction
+	int states[MACRO_INSTRUCTIONS_MAX];
+	dasm_save_t matched[MACRO_INSTRUCTIONS_MAX];
+
+	// match as many instructions as possible, in a single pass
+	int depth = 0, state = 0, next;
+	size_t addr = dasm->addr;
+	const struct instruction *instr = dasm->instr;
+	while ((next = macro_next(state, instr->opcode))) {
+		if (depth > 0 && !can_elide(dasm, addr))
 			return false;
 
-		for (int i = 0; i < dasm->instr->nr_args; i++) {
-			args[argptr++] = dasm_arg(dasm, i);
+		for (int i = 0; i < instr->nr_args; i++) {
+			args[argptr++] = LittleEndian_getDW(dasm->ain->code, addr + 2 + i*4);
 		}
 
-		node = next;
-		node->save = dasm_save(dasm);
-		dasm_next(dasm);
-	}
+		state = next;
+		states[depth] = state;
+		matched[depth] = (dasm_save_t) { .addr = addr, .instr = instr };
+		depth++;
 
-	// rewind to the last terminal node
-	if (!node->check)
-		node = match_rewind(dasm, node);
-	else
-		dasm_restore(dasm, node->save);
+		addr += instruction_width(instr->opcode);
+		instr = peek_instruction(dasm, &addr);
+	}
 
 	// find the longest match that passes the argument check
-	while (node && !node->check(dasm, args)) {
-		node = match_rewind(dasm, node);
+	for (; depth > 0; depth--) {
+		const struct macrodef *macro = macro_table.accept[states[depth-1]];
+		if (!macro || !macro->check(dasm, args))
+			continue;
+
+		// continue from the last instruction of the macro
+		dasm_restore(dasm, matched[depth-1]);
+		port_put_string(dasm->port, macro->name);
+		port_putc(dasm->port, ' ');
+		macro->emit(dasm, args);
+		port_putc(dasm->port, '\n');
+		return true;
 	}
-
-	// no match
-	if (!node)
-		return false;
-
-	port_printf(dasm->port, "%s ", node->name);
-	node->emit(dasm, args);
-	port_putc(dasm->port, '\n');
-	return true;
+	return false;
 }
 
 bool dasm_print_macro(struct dasm_state *dasm)
 {
-	// XXX: quick fail check
-	switch (dasm->instr->opcode) {
-	case PUSHLOCALPAGE:
-	case PUSHGLOBALPAGE:
-	case PUSHSTRUCTPAGE:
-		break;
-	default:
+	pthread_once(&macro_table_once, compile_macros);
+
+	// quick fail check
+	if (!macro_next(0, dasm->instr->opcode))
 		return false;
-	}
 
-	dasm_save_t save = dasm_save(dasm);
-	bool success = _dasm_print_macro(dasm);
-	if (!success)
-		dasm_restore(dasm, save);
-	return success;
+	return _dasm_print_macro(dasm);
 }
@@ -19,11 +19,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
-#include <zlib.h>
 #include "system4.h"
 #include "system4/ain.h"
 #include "system4/file.h"
 #include "system4/string.h"
+#include "alice.h"
 
 struct ain_buffer {
 	uint8_t *buf;
@@ -425,20 +425,18 @@ static uint8_t *ain_flatten(struct ain *ain, size_t *len)
 
 static uint8_t *ain_compress(uint8_t *buf, size_t *len)
 {
-	unsigned long dst_len = *len * 1.001 + 12;
-	uint8_t *dst = xmalloc(dst_len + 16);
+	size_t compressed_len;
+	uint8_t *compressed = zlib_compress(buf, *len, &compressed_len);
+	uint8_t *dst = xmalloc(compressed_len + 16);
 
 	memcpy(dst, "AI2\0\0\0\0", 8);
 	_write_int32(dst+8, *len);
-
-	int r = compress2(dst+16, &dst_len, buf, *len, 1);
-	if (r != Z_OK) {
-		ERROR("compress failed");
-	}
+	_write_int32(dst+12, compressed_len);
+	memcpy(dst+16, compressed, compressed_len);
+	free(compressed);
 	free(buf);
 
-	_write_int32(dst+12, dst_len);
-	*len = dst_len + 16;
+	*len = compressed_len + 16;
 	return dst;
 }
 
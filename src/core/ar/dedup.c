@@ -0,0 +1,377 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#include "system4.h"
+#include "system4/file.h"
+#include "alice.h"
+#include "alice/ar.h"
+#include "khash.h"
+
+/*
+ * Content deduplication for extraction. Outputs are identified by the SHA-256
+ * and size of the entry's data plus the output format (and any options that
+ * affect the output). The first task to
+ * produce an output claims it; later tasks with the same key wait for it and
+ * then link to it (reflink where supported, otherwise a hard link, otherwise
+ * a copy). With a store directory, outputs are also kept there by key so that
+ * later runs (e.g. on other versions of a game) can link instead of
+ * converting again. The store is trimmed in least-recently-used order: a
+ * store hit refreshes the output's modification time.
+ */
+
+struct dedup_entry {
+	char *path;
+	bool done;
+	bool ok;
+};
+
+KHASH_MAP_INIT_STR(dedup_table, struct dedup_entry*);
+
+struct ar_dedup {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	khash_t(dedup_table) *table;
+	char *store;
+	// statistics
+	struct ar_dedup_stats stats;
+};
+
+struct ar_dedup *ar_dedup_new(const char *store)
+{
+	struct ar_dedup *d = xcalloc(1, sizeof(struct ar_dedup));
+	pthread_mutex_init(&d->mutex, NULL);
+	pthread_cond_init(&d->cond, NULL);
+	d->table = kh_init(dedup_table);
+	if (store) {
+		mkdir_p(store);
+		d->store = xstrdup(store);
+	}
+	return d;
+}
+
+void ar_dedup_free(struct ar_dedup *d)
+{
+	for (khiter_t k = kh_begin(d->table); k != kh_end(d->table); k++) {
+		if (!kh_exist(d->table, k))
+			continue;
+		struct dedup_entry *e = kh_value(d->table, k);
+		free((char*)kh_key(d->table, k));
+		free(e->path);
+		free(e);
+	}
+	kh_destroy(dedup_table, d->table);
+	pthread_cond_destroy(&d->cond);
+	pthread_mutex_destroy(&d->mutex);
+	free(d->store);
+	free(d);
+}
+
+/*
+ * Get the key of the output `format` produced from `data`. Keys are based on
+ * SHA-256 since a collision would silently link the wrong output, and the
+ * store persists across runs.
+ */
+char *ar_dedup_key(const void *data, size_t size, const char *format)
+{
+	uint8_t digest[32];
+	sha256(data, size, digest);
+	char *key = xmalloc(64 + 1 + 20 + 1 + strlen(format) + 1);
+	for (int i = 0; i < 32; i++) {
+		sprintf(key + i*2, "%02x", digest[i]);
+	}
+	sprintf(key + 64, "-%" PRIu64 ".%s", (uint64_t)size, format);
+	return key;
+}
+
+static char *store_path(struct ar_dedup *d, const char *key)
+{
+	size_t store_len = strlen(d->store);
+	char *path = xmalloc(store_len + strlen(key) + 5);
+	// two-level layout to keep directories small
+	sprintf(path, "%s/%.2s/%s", d->store, key, key);
+	return path;
+}
+
+static bool copy_file(const char *src, const char *dst)
+{
+	FILE *in = file_open_utf8(src, "rb");
+	if (!in)
+		return false;
+	FILE *out = checked_fopen(dst, "wb");
+	uint8_t buf[65536];
+	size_t n;
+	bool ok = true;
+	while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+		if (fwrite(buf, 1, n, out) != n) {
+			ok = false;
+			break;
+		}
+	}
+	if (ferror(in))
+		ok = false;
+	fclose(in);
+	if (fclose(out))
+		ok = false;
+	return ok;
+}
+
+static bool reflink_file(possibly_unused const char *src, possibly_unused const char *dst)
+{
+#ifdef FICLONE
+	int in = open(src, O_RDONLY);
+	if (in >= 0) {
+		int out = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (out >= 0) {
+			int r = ioctl(out, FICLONE, in);
+			close(out);
+			if (!r) {
+				close(in);
+				return true;
+			}
+			unlink(dst);
+		}
+		close(in);
+	}
+#endif
+	return false;
+}
+
+/*
+ * Make `dst` an independent copy of `src`: a reflink if the file system
+ * supports it, otherwise a plain copy. Files in the store must never share
+ * an inode with an output file, since a later extraction may overwrite the
+ * output in place. `dst` must not exist.
+ */
+static bool store_copy(const char *src, const char *dst)
+{
+	return reflink_file(src, dst) || copy_file(src, dst);
+}
+
+/*
+ * Make `dst` a copy of `src`: a reflink if the file system supports it,
+ * otherwise a hard link, otherwise a plain copy. `dst` must not exist.
+ */
+bool ar_dedup_link(const char *src, const char *dst)
+{
+	if (reflink_file(src, dst))
+		return true;
+#ifndef _WIN32
+	if (!link(src, dst))
+		return true;
+#endif
+	return copy_file(src, dst);
+}
+
+static void account(struct ar_dedup *d, const char *path)
+{
+	ustat s;
+	if (stat_utf8(path, &s))
+		return;
+	pthread_mutex_lock(&d->mutex);
+	d->stats.nr_linked++;
+	d->stats.bytes_saved += s.st_size;
+	pthread_mutex_unlock(&d->mutex);
+}
+
+static void count_miss(struct ar_dedup *d)
+{
+	pthread_mutex_lock(&d->mutex);
+	d->stats.nr_missed++;
+	pthread_mutex_unlock(&d->mutex);
+}
+
+/*
+ * Try to create `output_file` from an existing output with the same key.
+ * Returns true if it was created. Otherwise the caller owns the key: it must
+ * produce the output itself and then call ar_dedup_done.
+ */
+bool ar_dedup_claim(struct ar_dedup *d, const char *key, const char *output_file)
+{
+	int ret;
+	pthread_mutex_lock(&d->mutex);
+	khiter_t k = kh_put(dedup_table, d->table, key, &ret);
+	if (ret) {
+		// first occurrence in this run
+		struct dedup_entry *e = xcalloc(1, sizeof(struct dedup_entry));
+		kh_key(d->table, k) = xstrdup(key);
+		kh_value(d->table, k) = e;
+		pthread_mutex_unlock(&d->mutex);
+
+		if (!d->store) {
+			count_miss(d);
+			return false;
+		}
+		char *path = store_path(d, key);
+		if (!file_exists(path) || !store_copy(path, output_file)) {
+			count_miss(d);
+			free(path);
+			return false;
+		}
+		// mark as recently used
+		utime(path, NULL);
+		account(d, output_file);
+		ar_dedup_done(d, key, output_file, true);
+		free(path);
+		return true;
+	}
+
+	// wait for the owner to finish
+	struct dedup_entry *e = kh_value(d->table, k);
+	while (!e->done)
+		pthread_cond_wait(&d->cond, &d->mutex);
+	pthread_mutex_unlock(&d->mutex);
+
+	if (!e->ok || !ar_dedup_link(e->path, output_file))
+		return false;
+	account(d, output_file);
+	return true;
+}
+
+/*
+ * Record the output produced for `key`, and add it to the store.
+ */
+void ar_dedup_done(struct ar_dedup *d, const char *key, const char *output_file, bool ok)
+{
+	if (ok && d->store) {
+		char *path = store_path(d, key);
+		if (!file_exists(path)) {
+			// copy under a temporary name so that concurrent runs never
+			// see a partial file
+			char *tmp = xmalloc(strlen(path) + 32);
+			sprintf(tmp, "%s.%ld.tmp", path, (long)getpid());
+			mkdir_for_file(path);
+			if (store_copy(output_file, tmp)) {
+				if (rename(tmp, path))
+					remove(tmp);
+			}
+			free(tmp);
+		}
+		free(path);
+	}
+
+	pthread_mutex_lock(&d->mutex);
+	khiter_t k = kh_get(dedup_table, d->table, key);
+	if (k != kh_end(d->table)) {
+		struct dedup_entry *e = kh_value(d->table, k);
+		if (!e->done) {
+			e->path = xstrdup(output_file);
+			e->ok = ok;
+			e->done = true;
+		}
+	}
+	pthread_cond_broadcast(&d->cond);
+	pthread_mutex_unlock(&d->mutex);
+}
+
+void ar_dedup_get_stats(struct ar_dedup *d, struct ar_dedup_stats *stats)
+{
+	pthread_mutex_lock(&d->mutex);
+	*stats = d->stats;
+	pthread_mutex_unlock(&d->mutex);
+}
+
+struct store_file {
+	char *path;
+	uint64_t size;
+	time_t mtime;
+};
+
+kv_decl(store_file_list, struct store_file);
+
+static int store_file_cmp(const void *_a, const void *_b)
+{
+	const struct store_file *a = _a, *b = _b;
+	if (a->mtime != b->mtime)
+		return a->mtime < b->mtime ? -1 : 1;
+	return strcmp(a->path, b->path);
+}
+
+static void list_store_dir(const char *dir, store_file_list *files, int depth)
+{
+	DIR *d = opendir(dir);
+	if (!d)
+		return;
+	struct dirent *e;
+	while ((e = readdir(d))) {
+		if (e->d_name[0] == '.')
+			continue;
+		char *path = xmalloc(strlen(dir) + strlen(e->d_name) + 2);
+		sprintf(path, "%s/%s", dir, e->d_name);
+		struct stat s;
+		if (stat(path, &s)) {
+			free(path);
+			continue;
+		}
+		if (S_ISDIR(s.st_mode) && depth == 0) {
+			list_store_dir(path, files, depth + 1);
+			free(path);
+		} else if (S_ISREG(s.st_mode) && depth == 1 && !strstr(e->d_name, ".tmp")) {
+			struct store_file f = { .path = path, .size = s.st_size, .mtime = s.st_mtime };
+			kv_push(struct store_file, *files, f);
+		} else {
+			free(path);
+		}
+	}
+	closedir(d);
+}
+
+/*
+ * Remove the least recently used outputs from the store until it holds at
+ * most `max_size` bytes.
+ */
+void ar_dedup_trim(struct ar_dedup *d, uint64_t max_size)
+{
+	if (!d->store)
+		return;
+
+	store_file_list files;
+	kv_init(files);
+	list_store_dir(d->store, &files, 0);
+	qsort(files.a, files.n, sizeof(struct store_file), store_file_cmp);
+
+	uint64_t total = 0;
+	for (size_t i = 0; i < files.n; i++) {
+		total += files.a[i].size;
+	}
+	for (size_t i = 0; i < files.n && total > max_size; i++) {
+		if (remove(files.a[i].path))
+			continue;
+		total -= files.a[i].size;
+		d->stats.nr_evicted++;
+		d->stats.bytes_evicted += files.a[i].size;
+	}
+
+	for (size_t i = 0; i < files.n; i++) {
+		free(files.a[i].path);
+	}
+	kv_destroy(files);
+}
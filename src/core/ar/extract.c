@@ -14,10 +14,16 @@
  * along with this program; if not, see <http://gnu.org/licenses/>.
  */
 
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 #include "system4.h"
 #include "system4/archive.h"
 #include "system4/ex.h"
@@ -27,6 +33,10 @@
 #include "alice/ar.h"
 #include "alice/ex.h"
 #include "alice/port.h"
+#include "alice/output_writer.h"
+#include "alice/tar.h"
+#include "alice/thread_pool.h"
+#include "khash.h"
 
 enum filetype {
 	FT_UNKNOWN,
@@ -114,17 +124,53 @@ static char *get_default_filename(struct archive_data *data, enum filetype ft, u
 	return u;
 }
 
+static bool needs_conversion(struct archive_data *data, uint32_t flags)
+{
+	return !(flags & AR_RAW) && (is_image_file(data) || is_ex_file(data));
+}
+
+/*
+ * Write an archived file to a stream, converting it if necessary.
+ */
+static void write_data(struct archive_data *data, FILE *f, uint32_t flags)
+{
+	bool output_img = !(flags & AR_RAW) && is_image_file(data);
+	bool output_ex = !(flags & AR_RAW) && is_ex_file(data);
+	if (!f)
+		f = stdout;
+
+	if (output_img) {
+		struct cg *cg = cg_load_data(data);
+		if (cg) {
+			cg_write(cg, AR_IMGENC(flags), f);
+			cg_free(cg);
+		} else {
+			WARNING("Failed to load CG");
+		}
+	} else if (output_ex) {
+		struct ex *ex = ex_read(data->data, data->size);
+		if (ex) {
+			struct port port;
+			port_file_init(&port, f);
+			ex_dump(&port, ex);
+			ex_free(ex);
+			port_close(&port);
+		} else {
+			WARNING("Failed to load .ex file");
+		}
+	} else if (fwrite(data->data, data->size, 1, f) != 1) {
+		ERROR("fwrite failed: %s", strerror(errno));
+	}
+}
+
 /*
  * Write an archived file to disk.
  */
 static bool write_file(struct archive_data *data, const char *output_file, enum filetype ft, uint32_t flags)
 {
 	FILE *f = NULL;
-	bool is_image = is_image_file(data);
-	bool output_img = !(flags & AR_RAW) && is_image;
-	bool output_ex = !(flags & AR_RAW) && is_ex_file(data);
 
-	if ((flags & AR_IMAGES_ONLY) && !is_image)
+	if ((flags & AR_IMAGES_ONLY) && !is_image_file(data))
 		return true;
 
 	if (!output_file) {
@@ -148,52 +194,703 @@ static bool write_file(struct archive_data *data, const char *output_file, enum
 		}
 	}
 
-	if (output_img) {
-		struct cg *cg = cg_load_data(data);
-		if (cg) {
-			cg_write(cg, AR_IMGENC(flags), f);
-			cg_free(cg);
-		} else {
-			WARNING("Failed to load CG");
-		}
-	} else if (output_ex) {
-		struct ex *ex = ex_read(data->data, data->size);
-		if (ex) {
-			struct port port;
-			port_file_init(&port, f);
-			ex_dump(&port, ex);
-			ex_free(ex);
-			port_close(&port);
-		} else {
-			WARNING("Failed to load .ex file");
-		}
-	} else if (fwrite(data->data, data->size, 1, f ? f : stdout) != 1) {
-		ERROR("fwrite failed: %s", strerror(errno));
-	}
+	write_data(data, f, flags);
 
 	if (f)
 		fclose(f);
 	return true;
 }
 
-static void extract_all_iter(struct archive_data *data, void *_output_dir);
+/*
+ * Extraction is split into tasks, one per archive entry. The index is walked
+ * on the calling thread, where each entry is loaded and assigned an output
+ * path (both of which rely on state that isn't thread-safe). Decoding,
+ * encoding and writing happen on the extractor's thread pool. Tasks are
+ * retired in the order they were created, so the NOTICE output matches the
+ * archive order regardless of the number of workers.
+ */
+
+enum extract_task_type {
+	EXTRACT_FILE,
+	EXTRACT_RANGE,
+	EXTRACT_SKIP,
+	EXTRACT_FLAT,
+	EXTRACT_LOAD_ERROR,
+};
+
+/*
+ * Reference-counted nested archive. Entries of a .flat file point into the
+ * data of the parent archive entry, so both must outlive every task created
+ * for the .flat file's entries. `data` is NULL when the .flat file was
+ * opened as a view of the mapped archive file.
+ */
+struct extract_ref {
+	int refs;
+	struct archive *ar;
+	struct archive_data *data;
+	struct extract_ref *parent;
+};
+
+/*
+ * Archive file opened for direct access to entry data. Used to copy raw
+ * entries from the archive file to the output file, and to open nested .flat
+ * files in place, without loading them.
+ */
+struct extract_source {
+	int fd;
+	struct ar_index *index;
+	// readahead state: [released, prefetched) may be resident
+	uint64_t prefetched;
+	uint64_t released;
+	struct extract_source *next;
+};
+
+// how far ahead of the scheduled entries the archive file is read
+#define PREFETCH_WINDOW (64 * 1024 * 1024)
+
+#ifndef _WIN32
+static uint64_t page_size(void)
+{
+	static uint64_t size = 0;
+	if (!size)
+		size = sysconf(_SC_PAGESIZE);
+	return size;
+}
+#endif
+
+/*
+ * Tell the kernel that the archive file will be read up to PREFETCH_WINDOW
+ * bytes past `off`.
+ */
+static void source_prefetch(struct extract_source *src, uint64_t off)
+{
+#ifndef _WIN32
+	uint64_t start = max(off, src->prefetched);
+	uint64_t end = off + PREFETCH_WINDOW;
+	if (end <= src->prefetched)
+		return;
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(src->fd, start, end - start, POSIX_FADV_WILLNEED);
+#endif
+	if (src->index->map && start < src->index->map_size) {
+		uint64_t page_start = start & ~(page_size() - 1);
+		uint64_t len = min(end, src->index->map_size) - page_start;
+		madvise(src->index->map + page_start, len, MADV_WILLNEED);
+	}
+	src->prefetched = end;
+#endif
+}
+
+/*
+ * Drop the part of the archive file before `off` from memory. Entries are
+ * scheduled (and retired) in offset order, so everything before the entry
+ * being retired has been processed.
+ */
+static void source_release(struct extract_source *src, uint64_t off)
+{
+#ifndef _WIN32
+	uint64_t end = off & ~(page_size() - 1);
+	if (end <= src->released)
+		return;
+#ifdef POSIX_FADV_DONTNEED
+	posix_fadvise(src->fd, src->released, end - src->released, POSIX_FADV_DONTNEED);
+#endif
+	// the mapping is private and read-only, so dropped pages are simply
+	// read again if they're still needed
+	if (src->index->map) {
+		end = min(end, src->index->map_size & ~(page_size() - 1));
+		if (end > src->released)
+			madvise(src->index->map + src->released, end - src->released, MADV_DONTNEED);
+	}
+	src->released = end;
+#endif
+}
+
+/*
+ * State of an incremental extraction (one per archive). Entries whose data
+ * hash, output format and output path match the previous run's sidecar
+ * manifest are not written again.
+ */
+struct extract_incr {
+	char *sidecar_path;
+	size_t base_len;
+	struct ar_sidecar *old;
+	struct ar_sidecar *new;
+	struct extract_incr *next;
+};
+
+struct extract_task {
+	struct thread_job job;
+	enum extract_task_type type;
+	// either a loaded descriptor or &view
+	struct archive_data *data;
+	// entry data read through the source's mapping. This is our own
+	// descriptor and is never passed to archive_free_data.
+	struct archive_data view;
+	struct extract_ref *ref;
+	// EXTRACT_RANGE
+	struct extract_source *src;
+	struct ar_index_entry *entry;
+	// AR_INCREMENTAL
+	struct extract_incr *incr;
+	struct ar_sidecar_entry *old;
+	char *key;
+	const char *format;
+	uint64_t off;
+	uint64_t size;
+	uint64_t hash;
+	bool hashed;
+	bool unchanged;
+	// deduplication
+	struct ar_dedup *dedup;
+	bool deduped;
+	struct output_writer *writer;
+	// tar output
+	struct tar_writer *tar;
+	FILE *tmp; // converted data, if any
+	char *output_file;
+	enum filetype ft;
+	uint32_t flags;
+	bool written;
+	// message slot (see extractor_message)
+	size_t slot;
+	struct extract_task *next;
+};
+
+struct extract_message {
+	bool warning;
+	char *text;
+};
+
+/*
+ * Messages of the tasks scheduled for one archive entry (including the
+ * entries of a nested .flat file). Entries may be scheduled out of order,
+ * but their messages are printed in index order.
+ */
+struct message_slot {
+	kvec_t(struct extract_message) messages;
+	// number of tasks in this slot which haven't been retired
+	unsigned pending;
+	// set once all tasks of this slot were scheduled
+	bool scheduled;
+};
+
+struct ar_extractor {
+	struct thread_pool *pool;
+	uint32_t flags;
+	unsigned nr_tasks;
+	unsigned max_tasks;
+	struct extract_task *head;
+	struct extract_task *tail;
+	struct extract_source *sources;
+	struct extract_incr *incrs;
+	struct ar_filter *filter;
+	struct output_writer *writer;
+	struct tar_writer *tar;
+	bool tar_quiet;
+	struct ar_dedup *dedup;
+	// message slots in index order; slots before next_slot were printed
+	kvec_t(struct message_slot) slots;
+	size_t next_slot;
+	// slot of the entry being scheduled
+	size_t cur_slot;
+};
 
 struct extract_all_iter_data {
+	struct ar_extractor *x;
 	char *prefix;
-	uint32_t flags;
+	struct extract_ref *ref;
+	struct extract_source *src;
+	struct extract_incr *incr;
+	const char *key_prefix;
+	struct tar_writer *tar;
 };
 
-static void extract_flat(struct archive_data *data, char *output_dir, uint32_t flags)
+static struct extract_ref *ref_get(struct extract_ref *ref)
+{
+	if (ref)
+		ref->refs++;
+	return ref;
+}
+
+static void ref_put(struct extract_ref *ref)
+{
+	if (!ref || --ref->refs > 0)
+		return;
+	archive_free(ref->ar);
+	if (ref->data)
+		archive_free_data(ref->data);
+	ref_put(ref->parent);
+	free(ref);
+}
+
+/*
+ * Write a raw entry by copying its byte range directly from the archive file.
+ */
+static bool write_range(struct extract_task *task)
+{
+	int fd = output_writer_open(task->writer, task->output_file, task->flags & AR_FORCE);
+	if (fd < 0)
+		return false;
+	if (!copy_fd_range(task->src->fd, task->entry->off, task->entry->size, fd))
+		ALICE_ERROR("Failed to copy \"%s\": %s", task->output_file, strerror(errno));
+	close(fd);
+	output_writer_account(task->writer, task->entry->size);
+	return true;
+}
+
+static void release_data(void *data)
+{
+	archive_free_data(data);
+}
+
+static void task_free_data(struct extract_task *task)
+{
+	if (task->data && task->data != &task->view)
+		archive_free_data(task->data);
+	task->data = NULL;
+	free(task->view.name);
+	task->view.name = NULL;
+}
+
+/*
+ * Write an entry through the output writer. Data that doesn't need to be
+ * converted is queued as-is; the writer takes ownership of the entry. Entries
+ * of nested .flat files are written synchronously instead, since their data
+ * is only valid while the task holds its reference to the nested archive.
+ * Deduplicated outputs are written synchronously too, as they may be linked
+ * as soon as the task completes.
+ */
+static bool write_task_file(struct extract_task *task)
+{
+	struct archive_data *data = task->data;
+	bool overwrite = task->flags & AR_FORCE;
+	if ((task->flags & AR_IMAGES_ONLY) && !is_image_file(data))
+		return true;
+
+	if (!needs_conversion(data, task->flags)) {
+		if (task->ref || task->dedup)
+			return output_writer_write_sync(task->writer, task->output_file,
+					data->data, data->size, overwrite);
+		// views stay valid until the writer is flushed
+		bool is_view = data == &task->view;
+		if (!output_writer_write(task->writer, task->output_file, data->data, data->size,
+					overwrite, is_view ? NULL : release_data, is_view ? NULL : data))
+			return false;
+		if (!is_view)
+			task->data = NULL;
+		return true;
+	}
+
+	int fd = output_writer_open(task->writer, task->output_file, overwrite);
+	if (fd < 0)
+		return false;
+	FILE *f = fdopen(fd, "wb");
+	if (!f)
+		ALICE_ERROR("fdopen(\"%s\"): %s", task->output_file, strerror(errno));
+	write_data(data, f, task->flags);
+	output_writer_account(task->writer, ftell(f));
+	fclose(f);
+	return true;
+}
+
+/*
+ * Map a byte range of a file. Returns a pointer to the range; the mapping
+ * must be released with unmap_range.
+ */
+static uint8_t *map_range(int fd, off_t off, size_t size, void **map_out, size_t *map_size_out)
+{
+#ifdef _WIN32
+	ALICE_ERROR("map_range not supported on Windows");
+#else
+	*map_out = NULL;
+	*map_size_out = 0;
+	if (!size)
+		return NULL;
+	off_t page_off = off & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+	size_t map_size = size + (off - page_off);
+	uint8_t *map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, page_off);
+	if (map == MAP_FAILED)
+		ALICE_ERROR("mmap: %s", strerror(errno));
+	*map_out = map;
+	*map_size_out = map_size;
+	return map + (off - page_off);
+#endif
+}
+
+static void unmap_range(possibly_unused void *map, possibly_unused size_t map_size)
+{
+#ifndef _WIN32
+	if (map)
+		munmap(map, map_size);
+#endif
+}
+
+static uint64_t hash_range(int fd, off_t off, size_t size)
+{
+	void *map;
+	size_t map_size;
+	uint8_t *data = map_range(fd, off, size, &map, &map_size);
+	uint64_t hash = hash64(data, size);
+	unmap_range(map, map_size);
+	return hash;
+}
+
+static uint64_t task_hash(struct extract_task *task)
+{
+	if (task->hashed)
+		return task->hash;
+	if (task->type == EXTRACT_RANGE)
+		task->hash = hash_range(task->src->fd, task->entry->off, task->entry->size);
+	else
+		task->hash = hash64(task->data->data, task->data->size);
+	task->hashed = true;
+	return task->hash;
+}
+
+/*
+ * Hash the entry's data and check it against the previous run.
+ */
+static bool task_unchanged(struct extract_task *task)
+{
+	task_hash(task);
+
+	struct ar_sidecar_entry *old = task->old;
+	return old && old->hash == task->hash && old->size == task->size
+		&& !strcmp(old->format, task->format)
+		&& !strcmp(old->path, task->output_file + task->incr->base_len)
+		&& file_exists(task->output_file);
+}
+
+/*
+ * In tar mode, the worker only converts the data (into a temporary file).
+ * The tar stream itself is written in order as tasks are retired.
+ */
+static void extract_task_convert(struct extract_task *task)
+{
+	if (task->type != EXTRACT_FILE || !needs_conversion(task->data, task->flags))
+		return;
+	if (!(task->tmp = tmpfile()))
+		ALICE_ERROR("tmpfile: %s", strerror(errno));
+	write_data(task->data, task->tmp, task->flags);
+	fflush(task->tmp);
+}
+
+/*
+ * The dedup store outlives this run, so outputs are keyed by a cryptographic
+ * hash of the entry's data rather than by task_hash. Converted text depends
+ * on the output encoding as well.
+ */
+static char *task_dedup_key(struct extract_task *task)
+{
+	char format[64];
+	if (!strcmp(task->format, "txtex"))
+		snprintf(format, sizeof(format), "%s.%s", task->format, get_output_encoding());
+	else
+		snprintf(format, sizeof(format), "%s", task->format);
+
+	if (task->type != EXTRACT_RANGE)
+		return ar_dedup_key(task->data->data, task->data->size, format);
+
+	void *map;
+	size_t map_size;
+	uint8_t *data = map_range(task->src->fd, task->entry->off, task->entry->size, &map, &map_size);
+	char *key = ar_dedup_key(data, task->entry->size, format);
+	unmap_range(map, map_size);
+	return key;
+}
+
+/*
+ * Link the output to an identical one if possible, otherwise write it and
+ * make it available to later duplicates.
+ */
+static void extract_task_dedup(struct extract_task *task)
+{
+	if (file_exists(task->output_file)) {
+		if (!(task->flags & AR_FORCE))
+			return;
+		remove(task->output_file);
+	}
+
+	char *key = task_dedup_key(task);
+	if (ar_dedup_claim(task->dedup, key, task->output_file)) {
+		task->written = task->deduped = true;
+	} else {
+		if (task->type == EXTRACT_FILE)
+			task->written = write_task_file(task);
+		else
+			task->written = write_range(task);
+		ar_dedup_done(task->dedup, key, task->output_file, task->written);
+	}
+	free(key);
+}
+
+static void extract_task_run(struct thread_job *job)
+{
+	struct extract_task *task = (struct extract_task*)job;
+	if (task->type != EXTRACT_FILE && task->type != EXTRACT_RANGE)
+		return;
+	if (task->tar) {
+		extract_task_convert(task);
+		return;
+	}
+	if (task->incr && (task->unchanged = task_unchanged(task)))
+		return;
+
+	output_writer_mkdir_for_file(task->writer, task->output_file);
+	if (task->dedup)
+		extract_task_dedup(task);
+	else if (task->type == EXTRACT_FILE)
+		task->written = write_task_file(task);
+	else
+		task->written = write_range(task);
+}
+
+/*
+ * Record the task's output in the new sidecar manifest.
+ */
+static void extract_task_record(struct extract_task *task)
+{
+	struct ar_sidecar *sc = task->incr->new;
+	switch (task->type) {
+	case EXTRACT_FILE:
+	case EXTRACT_RANGE:
+		if (task->written || task->unchanged)
+			ar_sidecar_add(sc, task->key, task->off, task->size, task->hash,
+					task->format, task->output_file + task->incr->base_len);
+		break;
+	case EXTRACT_SKIP:
+	case EXTRACT_LOAD_ERROR:
+		// keep whatever the previous run wrote
+		if (task->old)
+			ar_sidecar_add(sc, task->old->name, task->old->off, task->old->size,
+					task->old->hash, task->old->format, task->old->path);
+		break;
+	case EXTRACT_FLAT:
+		break;
+	}
+}
+
+static void print_message(bool warning, const char *text)
+{
+	if (warning)
+		WARNING("%s", text);
+	else
+		NOTICE("%s", text);
+}
+
+/*
+ * Print the messages of finished slots, in order. Messages of the first
+ * unfinished slot are printed too, since anything added to it later comes
+ * after them.
+ */
+static void flush_messages(struct ar_extractor *x)
+{
+	while (x->next_slot < kv_size(x->slots)) {
+		struct message_slot *slot = &kv_A(x->slots, x->next_slot);
+		for (size_t i = 0; i < kv_size(slot->messages); i++) {
+			print_message(kv_A(slot->messages, i).warning, kv_A(slot->messages, i).text);
+			free(kv_A(slot->messages, i).text);
+		}
+		kv_destroy(slot->messages);
+		kv_init(slot->messages);
+		if (!slot->scheduled || slot->pending)
+			return;
+		x->next_slot++;
+	}
+	// everything was printed: no task refers to a slot anymore
+	x->slots.n = 0;
+	x->next_slot = 0;
+}
+
+/*
+ * Add a slot for each of the next `n` entries (in index order), and return
+ * the first one.
+ */
+static size_t add_message_slots(struct ar_extractor *x, size_t n)
+{
+	size_t first = kv_size(x->slots);
+	for (size_t i = 0; i < n; i++) {
+		struct message_slot slot = {0};
+		kv_push(struct message_slot, x->slots, slot);
+	}
+	return first;
+}
+
+static void message_slot_scheduled(struct ar_extractor *x, size_t slot)
+{
+	kv_A(x->slots, slot).scheduled = true;
+	flush_messages(x);
+}
+
+/*
+ * Print a message in the order of the slot it belongs to. Called on the main
+ * thread only.
+ */
+static void extractor_message(struct ar_extractor *x, size_t slot, bool warning,
+		const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	char *text = xmalloc(n + 1);
+	va_start(ap, fmt);
+	vsnprintf(text, n + 1, fmt, ap);
+	va_end(ap);
+
+	if (slot == x->next_slot) {
+		print_message(warning, text);
+		free(text);
+		return;
+	}
+	struct extract_message msg = { .warning = warning, .text = text };
+	kv_push(struct extract_message, kv_A(x->slots, slot).messages, msg);
+}
+
+static void extract_task_write_tar(struct ar_extractor *x, struct extract_task *task)
+{
+	bool quiet = x->tar_quiet;
+	struct tar_writer *tar = task->tar;
+	switch (task->type) {
+	case EXTRACT_FILE:
+		if (task->tmp) {
+			uint64_t size = ftell(task->tmp);
+			rewind(task->tmp);
+			tar_write_header(tar, task->output_file, size);
+			tar_write_stream(tar, task->tmp, size);
+			fclose(task->tmp);
+		} else {
+			tar_write_header(tar, task->output_file, task->data->size);
+			tar_write_data(tar, task->data->data, task->data->size);
+		}
+		break;
+	case EXTRACT_RANGE:
+		tar_write_header(tar, task->output_file, task->entry->size);
+		tar_write_range(tar, task->src->fd, task->entry->off, task->entry->size);
+		break;
+	case EXTRACT_LOAD_ERROR:
+		extractor_message(x, task->slot, true, "Error loading file: %s", task->output_file);
+		return;
+	case EXTRACT_SKIP:
+		if (!quiet)
+			extractor_message(x, task->slot, false, "Skipping non-image file: %s",
+					task->output_file);
+		return;
+	case EXTRACT_FLAT:
+		if (!quiet)
+			extractor_message(x, task->slot, false, "Extracting %s...", task->output_file);
+		return;
+	}
+	if (!quiet)
+		extractor_message(x, task->slot, false, "%s", task->output_file);
+}
+
+static void extract_task_retire(struct ar_extractor *x, struct extract_task *task)
+{
+	if (task->src && !task->ref)
+		source_release(task->src, task->entry->off);
+
+	if (task->tar) {
+		extract_task_write_tar(x, task);
+		goto out;
+	}
+
+	const char *file = task->output_file;
+	switch (task->type) {
+	case EXTRACT_FILE:
+	case EXTRACT_RANGE:
+		if (task->unchanged)
+			extractor_message(x, task->slot, false, "Skipping unchanged file: %s", file);
+		else if (task->deduped)
+			extractor_message(x, task->slot, false, "%s (duplicate)", file);
+		else if (task->written)
+			extractor_message(x, task->slot, false, "%s", file);
+		else
+			extractor_message(x, task->slot, false, "Skipping existing file: %s", file);
+		break;
+	case EXTRACT_SKIP:
+		extractor_message(x, task->slot, false, "Skipping non-image file: %s", file);
+		break;
+	case EXTRACT_FLAT:
+		extractor_message(x, task->slot, false, "Extracting %s...", file);
+		break;
+	case EXTRACT_LOAD_ERROR:
+		extractor_message(x, task->slot, true, "Error loading file: %s", file);
+		break;
+	}
+
+	if (task->incr)
+		extract_task_record(task);
+out:
+	if (--kv_A(x->slots, task->slot).pending == 0)
+		flush_messages(x);
+	task_free_data(task);
+	ref_put(task->ref);
+	free(task->output_file);
+	free(task->key);
+	free(task);
+}
+
+/*
+ * Retire completed tasks in order, blocking until at most `max_tasks` remain
+ * in flight.
+ */
+static void extractor_retire(struct ar_extractor *x, unsigned max_tasks)
+{
+	while (x->head) {
+		struct extract_task *task = x->head;
+		if (!thread_pool_job_done(x->pool, &task->job)) {
+			if (x->nr_tasks <= max_tasks)
+				break;
+			thread_pool_wait_job(x->pool, &task->job);
+		}
+		x->head = task->next;
+		if (!x->head)
+			x->tail = NULL;
+		x->nr_tasks--;
+		extract_task_retire(x, task);
+	}
+}
+
+static void extractor_push(struct ar_extractor *x, struct extract_task *task)
+{
+	if (x->tail)
+		x->tail->next = task;
+	else
+		x->head = task;
+	x->tail = task;
+	x->nr_tasks++;
+	task->slot = x->cur_slot;
+	kv_A(x->slots, task->slot).pending++;
+
+	thread_pool_submit(x->pool, &task->job, extract_task_run);
+	extractor_retire(x, x->max_tasks);
+}
+
+static void extract_all_iter(struct archive_data *data, void *_iter_data);
+
+/*
+ * Schedule the entries of a nested .flat file. The .flat file's bytes are
+ * either a loaded entry (`data`, owned by the nested archive from here on)
+ * or a view of the mapped archive file (`data` is NULL).
+ */
+static void extract_flat(struct ar_extractor *x, const char *name, uint8_t *bytes, size_t size,
+		struct archive_data *data, char *output_dir, struct extract_ref *parent,
+		struct extract_incr *incr, const char *key)
 {
 	int error;
-	struct archive *ar = (struct archive*)flat_open(data->data, data->size, &error);
+	struct archive *ar = (struct archive*)flat_open(bytes, size, &error);
 	if (!ar) {
-		WARNING("Error opening FLAT archive: %s", archive_strerror(error));
+		extractor_message(x, x->cur_slot, true, "Error opening FLAT archive: %s",
+				archive_strerror(error));
+		if (data)
+			archive_free_data(data);
 		return;
 	}
 
 	// generate filename prefix
-	char *uname = conv_output(data->name);
+	char *uname = conv_output(name);
 	size_t dir_len = strlen(output_dir);
 	size_t name_len = strlen(uname);
 	char *prefix = xmalloc(dir_len + name_len + 2);
@@ -201,50 +898,207 @@ static void extract_flat(struct archive_data *data, char *output_dir, uint32_t f
 	strcpy(prefix+dir_len, uname);
 	strcpy(prefix+dir_len+name_len, ".");
 
-	struct extract_all_iter_data iter_data = { .prefix = prefix, .flags = flags };
+	struct extract_ref *ref = xcalloc(1, sizeof(struct extract_ref));
+	ref->refs = 1;
+	ref->ar = ar;
+	ref->data = data;
+	ref->parent = ref_get(parent);
+
+	char *key_prefix = NULL;
+	if (incr) {
+		size_t key_len = strlen(key);
+		key_prefix = xmalloc(key_len + 2);
+		memcpy(key_prefix, key, key_len);
+		strcpy(key_prefix + key_len, "/");
+	}
+
+	struct extract_all_iter_data iter_data = {
+		.x = x,
+		.prefix = prefix,
+		.ref = ref,
+		.src = NULL,
+		.incr = incr,
+		.key_prefix = key_prefix,
+		.tar = x->tar,
+	};
 	archive_for_each(ar, extract_all_iter, &iter_data);
-	archive_free(ar);
+	ref_put(ref);
+	free(key_prefix);
 	free(prefix);
 	free(uname);
 }
 
+static char *get_output_path(const char *prefix, struct archive_data *data, enum filetype ft, uint32_t flags)
+{
+	char *file_name = get_default_filename(data, ft, flags);
+	size_t prefix_len = strlen(prefix);
+	size_t name_len = strlen(file_name);
+	char *path = xmalloc(prefix_len + name_len + 1);
+	memcpy(path, prefix, prefix_len);
+	memcpy(path + prefix_len, file_name, name_len + 1);
+	free(file_name);
+	return path;
+}
+
+static const char *output_format(struct archive_data *data, uint32_t flags)
+{
+	if (flags & AR_RAW)
+		return "raw";
+	if (is_image_file(data))
+		return cg_file_extensions[AR_IMGENC(flags)];
+	if (is_ex_file(data))
+		return "txtex";
+	return "raw";
+}
+
+// key of an entry in the sidecar manifest
+static char *entry_key(struct extract_all_iter_data *iter_data, struct archive_data *data)
+{
+	char *name = conv_output(data->name);
+	if (!iter_data->key_prefix)
+		return name;
+
+	size_t prefix_len = strlen(iter_data->key_prefix);
+	size_t name_len = strlen(name);
+	char *key = xmalloc(prefix_len + name_len + 1);
+	memcpy(key, iter_data->key_prefix, prefix_len);
+	memcpy(key + prefix_len, name, name_len + 1);
+	free(name);
+	return key;
+}
+
+static void task_init_incr(struct extract_task *task, struct extract_all_iter_data *iter_data,
+		struct archive_data *data, struct ar_index_entry *e)
+{
+	struct extract_incr *incr = iter_data->incr;
+	task->key = entry_key(iter_data, data);
+	task->incr = incr;
+	task->off = e ? e->off : 0;
+	// changed entries always replace the previous output
+	task->flags |= AR_FORCE;
+	task->old = ar_sidecar_get(incr->old, task->key);
+}
+
+/*
+ * Check an entry against the extractor's filter. Only top-level entries are
+ * filtered; the contents of a selected .flat file are always extracted.
+ */
+static bool entry_selected(struct extract_all_iter_data *iter_data, struct archive_data *data)
+{
+	if (!iter_data->x->filter || iter_data->ref)
+		return true;
+
+	char *name = conv_utf8(data->name);
+	bool selected = ar_filter_match(iter_data->x->filter, name);
+	free(name);
+	if (selected || !iter_data->incr)
+		return selected;
+
+	// unselected entries keep their output from previous runs
+	char *key = entry_key(iter_data, data);
+	struct ar_sidecar_entry *old = ar_sidecar_get(iter_data->incr->old, key);
+	if (old)
+		ar_sidecar_add(iter_data->incr->new, old->name, old->off, old->size, old->hash,
+				old->format, old->path);
+	free(key);
+	return false;
+}
+
 static void extract_all_iter(struct archive_data *data, void *_iter_data)
 {
 	struct extract_all_iter_data *iter_data = _iter_data;
-
-	if (!archive_load_file(data)) {
-		char *u = conv_output(data->name);
-		WARNING("Error loading file: %s", u);
-		free(u);
+	if (!entry_selected(iter_data, data))
 		return;
+
+	struct extract_task *task = xcalloc(1, sizeof(struct extract_task));
+	task->flags = iter_data->x->flags;
+	task->ref = ref_get(iter_data->ref);
+	task->writer = iter_data->x->writer;
+	task->tar = iter_data->tar;
+	task->dedup = iter_data->tar ? NULL : iter_data->x->dedup;
+	task->size = data->size;
+	task->format = "raw";
+
+	struct ar_index_entry *e = NULL;
+	if (iter_data->src && (e = ar_index_get(iter_data->src->index, data->name))
+			&& e->size != data->size)
+		e = NULL;
+	if (iter_data->incr)
+		task_init_incr(task, iter_data, data, e);
+
+	if (e) {
+		task->src = iter_data->src;
+		task->entry = e;
+		source_prefetch(task->src, e->off);
 	}
 
-	enum filetype ft = get_filetype(data);
+	// raw entries are copied straight from the archive file when its
+	// index is available; the entry is never loaded
+	if (e && (task->flags & AR_RAW) && !(task->flags & AR_IMAGES_ONLY)) {
+		task->type = EXTRACT_RANGE;
+		task->output_file = get_output_path(iter_data->prefix, data, FT_UNKNOWN, task->flags);
+		extractor_push(iter_data->x, task);
+		return;
+	}
 
-	if (!(iter_data->flags & AR_RAW) && ft == FT_FLAT) {
-		char *u = conv_output(data->name);
-		NOTICE("Extracting %s...", u);
-		free(u);
-		extract_flat(data, iter_data->prefix, iter_data->flags);
+	// .flat files are opened in place when the archive file is mapped; the
+	// nested entries are read straight from the mapping
+	const uint8_t *view = e ? ar_index_view(iter_data->src->index, e) : NULL;
+	if (view && !(task->flags & AR_RAW) && !strcmp(ar_sniff_type(view, e->size), "flat")) {
+		task->type = EXTRACT_FLAT;
+		task->output_file = conv_output(data->name);
+		extractor_push(iter_data->x, task);
+		extract_flat(iter_data->x, data->name, (uint8_t*)view, e->size, NULL,
+				iter_data->prefix, iter_data->ref, task->incr, task->key);
 		return;
 	}
 
-	bool is_image = is_image_file(data);
-	char *file_name = get_default_filename(data, ft, iter_data->flags);
-	char output_file[PATH_MAX];
-	snprintf(output_file, PATH_MAX, "%s%s", iter_data->prefix, file_name);
-	free(file_name);
-	if (!is_image && (iter_data->flags & AR_IMAGES_ONLY)) {
-		NOTICE("Skipping non-image file: %s", output_file);
+	// read the entry through our own mapping of the archive file, which
+	// (unlike the archive's) is released as extraction progresses
+	if (view) {
+		task->view = *data;
+		task->view.name = xstrdup(data->name);
+		task->view.data = (uint8_t*)view;
+		task->data = &task->view;
+	} else {
+		task->data = archive_copy_descriptor(data);
+		if (!archive_load_file(task->data)) {
+			task->type = EXTRACT_LOAD_ERROR;
+			task->output_file = conv_output(data->name);
+			extractor_push(iter_data->x, task);
+			return;
+		}
+	}
+
+	task->ft = get_filetype(task->data);
+
+	if (!(task->flags & AR_RAW) && task->ft == FT_FLAT) {
+		// the .flat file's entries are extracted as tasks of their own;
+		// its data is owned by the nested archive from here on (unless
+		// it's a view)
+		struct archive_data *flat_data = task->data;
+		uint8_t *bytes = flat_data->data;
+		size_t size = flat_data->size;
+		if (flat_data == &task->view)
+			flat_data = NULL;
+		task->type = EXTRACT_FLAT;
+		task->data = NULL;
+		task->output_file = conv_output(data->name);
+		extractor_push(iter_data->x, task);
+		extract_flat(iter_data->x, data->name, bytes, size,
+				flat_data, iter_data->prefix, iter_data->ref, task->incr, task->key);
 		return;
 	}
 
-	mkdir_for_file(output_file);
+	task->output_file = get_output_path(iter_data->prefix, task->data, task->ft, task->flags);
+	if (task->incr || task->dedup)
+		task->format = output_format(task->data, task->flags);
 
-	if (write_file(data, output_file, ft, iter_data->flags))
-		NOTICE("%s", output_file);
+	if ((task->flags & AR_IMAGES_ONLY) && !is_image_file(task->data))
+		task->type = EXTRACT_SKIP;
 	else
-		NOTICE("Skipping existing file: %s", output_file);
+		task->type = EXTRACT_FILE;
+	extractor_push(iter_data->x, task);
 }
 
 static void check_flags(uint32_t *flags)
@@ -254,15 +1108,247 @@ static void check_flags(uint32_t *flags)
 	}
 }
 
-void ar_extract_all(struct archive *ar, const char *_output_file, uint32_t flags)
+struct ar_extractor *ar_extractor_new(uint32_t flags, int nr_jobs)
 {
 	check_flags(&flags);
-	char *output_file = output_file_dir(_output_file);
-	struct extract_all_iter_data data = { .prefix = output_file, .flags = flags };
-	archive_for_each(ar, extract_all_iter, &data);
+	struct ar_extractor *x = xcalloc(1, sizeof(struct ar_extractor));
+	x->pool = thread_pool_new(nr_jobs);
+	x->writer = output_writer_new(nr_jobs);
+	x->flags = flags;
+	// bound the number of loaded entries waiting for a worker
+	x->max_tasks = thread_pool_size(x->pool) * 4;
+	return x;
+}
+
+void ar_extractor_set_filter(struct ar_extractor *x, struct ar_filter *filter)
+{
+	x->filter = filter;
+}
+
+void ar_extractor_set_dedup(struct ar_extractor *x, struct ar_dedup *dedup)
+{
+	x->dedup = dedup;
+}
+
+void ar_extractor_set_tar(struct ar_extractor *x, struct tar_writer *tar, bool quiet)
+{
+	x->tar = tar;
+	x->tar_quiet = quiet;
+}
+
+static struct extract_source *extract_source_open(struct ar_extractor *x, const char *path)
+{
+#ifdef _WIN32
+	return NULL;
+#else
+	struct ar_index *index = ar_index_read(path);
+	if (!index)
+		return NULL;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ar_index_free(index);
+		return NULL;
+	}
+
+	// nested .flat files are only extracted when not in raw mode
+	if (!(x->flags & AR_RAW))
+		ar_index_map(index, path);
+
+	struct extract_source *src = xcalloc(1, sizeof(struct extract_source));
+	src->fd = fd;
+	src->index = index;
+	src->next = x->sources;
+	x->sources = src;
+	return src;
+#endif
+}
+
+static struct extract_incr *extract_incr_open(struct ar_extractor *x, const char *path,
+		const char *output_dir)
+{
+	const char *base = strrchr(path, '/');
+	base = base ? base + 1 : path;
+
+	struct extract_incr *incr = xcalloc(1, sizeof(struct extract_incr));
+	size_t dir_len = strlen(output_dir);
+	size_t base_len = strlen(base);
+	incr->sidecar_path = xmalloc(dir_len + base_len + sizeof(".alice-ar..tsv"));
+	sprintf(incr->sidecar_path, "%s.alice-ar.%s.tsv", output_dir, base);
+	incr->base_len = dir_len;
+	incr->old = ar_sidecar_read(incr->sidecar_path);
+	incr->new = ar_sidecar_new();
+	incr->next = x->incrs;
+	x->incrs = incr;
+	return incr;
+}
+
+KHASH_SET_INIT_STR(path_set);
+
+/*
+ * Remove outputs of entries that disappeared from the archive (or whose
+ * output path changed), then write the new sidecar manifest.
+ */
+static void extract_incr_finish(struct extract_incr *incr)
+{
+	khash_t(path_set) *paths = kh_init(path_set);
+	for (size_t i = 0; i < ar_sidecar_size(incr->new); i++) {
+		int ret;
+		kh_put(path_set, paths, ar_sidecar_entry(incr->new, i)->path, &ret);
+	}
+
+	char *dir = xstrdup(incr->sidecar_path);
+	dir[incr->base_len] = '\0';
+	for (size_t i = 0; i < ar_sidecar_size(incr->old); i++) {
+		struct ar_sidecar_entry *e = ar_sidecar_entry(incr->old, i);
+		if (kh_get(path_set, paths, e->path) != kh_end(paths))
+			continue;
+		char *output_file = xmalloc(incr->base_len + strlen(e->path) + 1);
+		strcpy(output_file, dir);
+		strcpy(output_file + incr->base_len, e->path);
+		if (file_exists(output_file)) {
+			if (remove(output_file))
+				WARNING("Failed to remove %s: %s", output_file, strerror(errno));
+			else
+				NOTICE("Removed %s", output_file);
+		}
+		free(output_file);
+	}
+	free(dir);
+	kh_destroy(path_set, paths);
+
+	mkdir_for_file(incr->sidecar_path);
+	ar_sidecar_write(incr->new, incr->sidecar_path);
+}
+
+struct offset_entry {
+	struct archive_data *data;
+	uint64_t off;
+	// position in index order
+	size_t pos;
+};
+
+struct offset_list {
+	kvec_t(struct offset_entry) entries;
+	struct ar_index *index;
+};
+
+static void collect_iter(struct archive_data *data, void *_list)
+{
+	struct offset_list *list = _list;
+	struct ar_index_entry *e = ar_index_get(list->index, data->name);
+	struct offset_entry oe = {
+		.data = archive_copy_descriptor(data),
+		// entries missing from the index go last
+		.off = e ? e->off : UINT64_MAX,
+		.pos = kv_size(list->entries),
+	};
+	kv_push(struct offset_entry, list->entries, oe);
+}
+
+static int offset_entry_cmp(const void *_a, const void *_b)
+{
+	const struct offset_entry *a = _a, *b = _b;
+	if (a->off != b->off)
+		return a->off < b->off ? -1 : 1;
+	return a->data->no - b->data->no;
+}
+
+/*
+ * Schedule the entries of an archive in the order their data is stored in
+ * the archive file, so that it is read sequentially. Tasks are retired in
+ * the order they were scheduled (which source_release depends on), so tar
+ * members come out in offset order. Messages are still printed in index
+ * order: each entry gets the message slot of its index position.
+ */
+static void extract_in_offset_order(struct archive *ar, struct extract_source *src,
+		struct extract_all_iter_data *data)
+{
+	struct offset_list list;
+	kv_init(list.entries);
+	list.index = src->index;
+	archive_for_each(ar, collect_iter, &list);
+	qsort(list.entries.a, kv_size(list.entries), sizeof(struct offset_entry), offset_entry_cmp);
+
+#ifndef _WIN32
+	if (src->index->map)
+		madvise(src->index->map, src->index->map_size, MADV_SEQUENTIAL);
+#endif
+	size_t first_slot = add_message_slots(data->x, kv_size(list.entries));
+	for (size_t i = 0; i < kv_size(list.entries); i++) {
+		data->x->cur_slot = first_slot + kv_A(list.entries, i).pos;
+		extract_all_iter(kv_A(list.entries, i).data, data);
+		archive_free_data(kv_A(list.entries, i).data);
+		message_slot_scheduled(data->x, data->x->cur_slot);
+	}
+	kv_destroy(list.entries);
+}
+
+void ar_extractor_add(struct ar_extractor *x, struct archive *ar, const char *path,
+		const char *_output_file)
+{
+	struct extract_source *src = NULL;
+	if (path)
+		src = extract_source_open(x, path);
+
+	// in tar mode, entries are named relative to the root of the tar file
+	char *output_file = x->tar ? xstrdup("") : output_file_dir(_output_file);
+	struct extract_incr *incr = NULL;
+	if (path && (x->flags & AR_INCREMENTAL))
+		incr = extract_incr_open(x, path, output_file);
+
+	struct extract_all_iter_data data = {
+		.x = x,
+		.prefix = output_file,
+		.ref = NULL,
+		.src = src,
+		.incr = incr,
+		.key_prefix = NULL,
+		.tar = x->tar,
+	};
+	if (src) {
+		extract_in_offset_order(ar, src, &data);
+	} else {
+		// scheduled in index order: a single slot will do
+		x->cur_slot = add_message_slots(x, 1);
+		archive_for_each(ar, extract_all_iter, &data);
+		message_slot_scheduled(x, x->cur_slot);
+	}
 	free(output_file);
 }
 
+void ar_extractor_free(struct ar_extractor *x)
+{
+	extractor_retire(x, 0);
+	flush_messages(x);
+	kv_destroy(x->slots);
+	thread_pool_free(x->pool);
+	output_writer_free(x->writer);
+	while (x->incrs) {
+		struct extract_incr *incr = x->incrs;
+		x->incrs = incr->next;
+		extract_incr_finish(incr);
+		ar_sidecar_free(incr->old);
+		ar_sidecar_free(incr->new);
+		free(incr->sidecar_path);
+		free(incr);
+	}
+	while (x->sources) {
+		struct extract_source *src = x->sources;
+		x->sources = src->next;
+		close(src->fd);
+		ar_index_free(src->index);
+		free(src);
+	}
+	free(x);
+}
+
+void ar_extract_all(struct archive *ar, const char *output_file, uint32_t flags)
+{
+	struct ar_extractor *x = ar_extractor_new(flags, 0);
+	ar_extractor_add(x, ar, NULL, output_file);
+	ar_extractor_free(x);
+}
+
 void ar_extract_file(struct archive *ar, char *file_name, char *output_file, uint32_t flags)
 {
 	check_flags(&flags);
@@ -0,0 +1,270 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#ifdef HAVE_REGEX
+#include <regex.h>
+#endif
+#include "system4.h"
+#include "system4/file.h"
+#include "alice.h"
+#include "alice/ar.h"
+#include "khash.h"
+#include "kvec.h"
+
+/*
+ * Entry filters for ar extract. An entry is selected if its name matches any
+ * glob pattern, regular expression or listed name. Names are compared in
+ * UTF-8 with '/' as the path separator, ignoring (ASCII) case.
+ */
+
+KHASH_MAP_INIT_STR(filter_name_table, bool);
+
+struct ar_filter {
+	kvec_t(char*) globs;
+#ifdef HAVE_REGEX
+	kvec_t(regex_t) regexes;
+#endif
+	khash_t(filter_name_table) *names;
+	unsigned nr_rules;
+};
+
+struct ar_filter *ar_filter_new(void)
+{
+	struct ar_filter *f = xcalloc(1, sizeof(struct ar_filter));
+	kv_init(f->globs);
+#ifdef HAVE_REGEX
+	kv_init(f->regexes);
+#endif
+	f->names = kh_init(filter_name_table);
+	return f;
+}
+
+void ar_filter_free(struct ar_filter *f)
+{
+	for (size_t i = 0; i < kv_size(f->globs); i++) {
+		free(kv_A(f->globs, i));
+	}
+	kv_destroy(f->globs);
+#ifdef HAVE_REGEX
+	for (size_t i = 0; i < kv_size(f->regexes); i++) {
+		regfree(&kv_A(f->regexes, i));
+	}
+	kv_destroy(f->regexes);
+#endif
+	for (khiter_t k = kh_begin(f->names); k != kh_end(f->names); k++) {
+		if (kh_exist(f->names, k))
+			free((char*)kh_key(f->names, k));
+	}
+	kh_destroy(filter_name_table, f->names);
+	free(f);
+}
+
+bool ar_filter_empty(struct ar_filter *f)
+{
+	return f->nr_rules == 0;
+}
+
+// lowercase and use '/' as the path separator
+static char *normalize_name(const char *name)
+{
+	char *s = xstrdup(name);
+	for (char *p = s; *p; p++) {
+		if (*p == '\\')
+			*p = '/';
+		else
+			*p = tolower((unsigned char)*p);
+	}
+	return s;
+}
+
+void ar_filter_add_glob(struct ar_filter *f, const char *pattern)
+{
+	kv_push(char*, f->globs, normalize_name(pattern));
+	f->nr_rules++;
+}
+
+void ar_filter_add_regex(struct ar_filter *f, const char *pattern)
+{
+#ifdef HAVE_REGEX
+	regex_t re;
+	int rv = regcomp(&re, pattern, REG_EXTENDED | REG_ICASE | REG_NOSUB);
+	if (rv) {
+		char msg[256];
+		regerror(rv, &re, msg, sizeof(msg));
+		ALICE_ERROR("Invalid regular expression \"%s\": %s", pattern, msg);
+	}
+	kv_push(regex_t, f->regexes, re);
+	f->nr_rules++;
+#else
+	ALICE_ERROR("Regular expressions are not supported on this platform");
+#endif
+}
+
+void ar_filter_add_name(struct ar_filter *f, const char *name)
+{
+	int ret;
+	char *key = normalize_name(name);
+	khiter_t k = kh_put(filter_name_table, f->names, key, &ret);
+	if (!ret) {
+		free(key);
+		return;
+	}
+	kh_value(f->names, k) = false;
+	f->nr_rules++;
+}
+
+/*
+ * Add names from a file, one per line. Empty lines are ignored.
+ */
+void ar_filter_read_list(struct ar_filter *f, const char *path)
+{
+	size_t len;
+	char *text = file_read(path, &len);
+	if (!text)
+		ALICE_ERROR("Failed to read \"%s\"", path);
+
+	size_t start = 0;
+	for (size_t i = 0; i <= len; i++) {
+		if (i < len && text[i] != '\n')
+			continue;
+		size_t end = i;
+		if (end > start && text[end-1] == '\r')
+			end--;
+		if (end > start) {
+			char *name = xmalloc(end - start + 1);
+			memcpy(name, text + start, end - start);
+			name[end - start] = '\0';
+			ar_filter_add_name(f, name);
+			free(name);
+		}
+		start = i + 1;
+	}
+	free(text);
+}
+
+/*
+ * Find the ']' closing the bracket expression at `pat`, or NULL if the
+ * expression is unterminated.
+ */
+static const char *bracket_end(const char *pat)
+{
+	const char *p = pat + 1;
+	if (*p == '!' || *p == '^')
+		p++;
+	// a ']' directly after the '[' is a literal
+	if (*p == ']')
+		p++;
+	return strchr(p, ']');
+}
+
+static bool glob_match(const char *pat, const char *s)
+{
+	const char *star_pat = NULL;
+	const char *star_s = NULL;
+	while (*s) {
+		if (*pat == '*') {
+			star_pat = ++pat;
+			star_s = s;
+			continue;
+		}
+		const char *end;
+		if (*pat == '[' && (end = bracket_end(pat))) {
+			const char *p = pat + 1;
+			bool negate = *p == '!' || *p == '^';
+			bool matched = false;
+			if (negate)
+				p++;
+			// a ']' directly after the '[' is a literal
+			do {
+				if (p[1] == '-' && p[2] && p[2] != ']') {
+					if (*s >= p[0] && *s <= p[2])
+						matched = true;
+					p += 3;
+				} else {
+					if (*s == *p)
+						matched = true;
+					p++;
+				}
+			} while (p < end);
+			if (matched != negate) {
+				pat = end + 1;
+				s++;
+				continue;
+			}
+		} else if (*pat == '?' || *pat == *s) {
+			pat++;
+			s++;
+			continue;
+		}
+		// mismatch: backtrack to the last '*'
+		if (!star_pat)
+			return false;
+		pat = star_pat;
+		s = ++star_s;
+	}
+	while (*pat == '*')
+		pat++;
+	return !*pat;
+}
+
+/*
+ * Check whether the entry `name` (in UTF-8) is selected by the filter.
+ */
+bool ar_filter_match(struct ar_filter *f, const char *name)
+{
+	char *s = normalize_name(name);
+	bool match = false;
+
+	khiter_t k = kh_get(filter_name_table, f->names, s);
+	if (k != kh_end(f->names)) {
+		kh_value(f->names, k) = true;
+		match = true;
+		goto out;
+	}
+	for (size_t i = 0; i < kv_size(f->globs); i++) {
+		if (glob_match(kv_A(f->globs, i), s)) {
+			match = true;
+			goto out;
+		}
+	}
+#ifdef HAVE_REGEX
+	for (size_t i = 0; i < kv_size(f->regexes); i++) {
+		if (!regexec(&kv_A(f->regexes, i), s, 0, NULL, 0)) {
+			match = true;
+			goto out;
+		}
+	}
+#endif
+out:
+	free(s);
+	return match;
+}
+
+/*
+ * Warn about listed names which didn't match any entry.
+ */
+void ar_filter_warn_unmatched(struct ar_filter *f)
+{
+	for (khiter_t k = kh_begin(f->names); k != kh_end(f->names); k++) {
+		if (kh_exist(f->names, k) && !kh_value(f->names, k))
+			WARNING("No file with name \"%s\"", kh_key(f->names, k));
+	}
+}
@@ -0,0 +1,254 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "system4.h"
+#include "system4/buffer.h"
+#include "system4/file.h"
+#include "system4/string.h"
+#include "alice.h"
+#include "alice/ar.h"
+#include "khash.h"
+#include "little_endian.h"
+
+/*
+ * Direct reader for archive indices. Unlike the libsys4 archive interface,
+ * this exposes where each entry's data is stored in the archive file, which
+ * allows entries to be copied, sniffed or scheduled without loading them.
+ * Only .afa (v1/v2) archives are supported; for other formats the fast paths
+ * which depend on the index are simply not taken.
+ */
+
+KHASH_MAP_INIT_STR(index_name_table, size_t);
+
+static size_t remaining(struct buffer *r)
+{
+	return r->index < r->size ? r->size - r->index : 0;
+}
+
+static bool afa_read_entries(struct ar_index *index, struct buffer *r)
+{
+	for (size_t i = 0; i < index->nr_entries; i++) {
+		struct ar_index_entry *e = &index->entries[i];
+		if (remaining(r) < 8)
+			return false;
+		uint32_t name_len = buffer_read_int32(r);
+		uint32_t padded_len = buffer_read_int32(r);
+		if (name_len > padded_len || remaining(r) < padded_len)
+			return false;
+		e->name = make_string((char*)r->buf + r->index, name_len);
+		buffer_skip(r, padded_len);
+
+		if (remaining(r) < (index->version == 1 ? 20 : 16))
+			return false;
+		e->id = index->version == 1 ? (uint32_t)buffer_read_int32(r) : (uint32_t)i;
+		e->unknown0 = buffer_read_int32(r);
+		e->unknown1 = buffer_read_int32(r);
+		e->off = index->data_start + (uint32_t)buffer_read_int32(r);
+		e->size = buffer_read_int32(r);
+	}
+	return true;
+}
+
+struct ar_index *ar_index_read(const char *path)
+{
+	uint8_t hdr[AFA_HEADER_SIZE];
+	FILE *f = file_open_utf8(path, "rb");
+	if (!f)
+		return NULL;
+	if (fread(hdr, AFA_HEADER_SIZE, 1, f) != 1)
+		goto err_close;
+	if (memcmp(hdr, "AFAH", 4) || memcmp(hdr+8, "AlicArch", 8) || memcmp(hdr+28, "INFO", 4))
+		goto err_close;
+
+	struct ar_index *index = xcalloc(1, sizeof(struct ar_index));
+	index->version = LittleEndian_getDW(hdr, 16);
+	index->data_start = LittleEndian_getDW(hdr, 24);
+	index->nr_entries = (uint32_t)LittleEndian_getDW(hdr, 40);
+	if (index->version < 1 || index->version > 2)
+		goto err_free;
+
+	// sanity-check sizes before allocating: the compressed index must fit in
+	// the file, and deflate can't expand data by more than ~1032:1
+	uint32_t info_size = LittleEndian_getDW(hdr, 32);
+	off_t fsize = file_size(path);
+	if (info_size < 16 || fsize < AFA_HEADER_SIZE || info_size - 16 > fsize - AFA_HEADER_SIZE)
+		goto err_free;
+	unsigned long compressed_size = info_size - 16;
+	unsigned long uncompressed_size = (uint32_t)LittleEndian_getDW(hdr, 36);
+	if (uncompressed_size > (uint64_t)compressed_size * 1032 + 64)
+		goto err_free;
+	if (index->nr_entries > uncompressed_size / 16)
+		goto err_free;
+	uint8_t *compressed = xmalloc(compressed_size);
+	if (fread(compressed, compressed_size, 1, f) != 1) {
+		free(compressed);
+		goto err_free;
+	}
+
+	uint8_t *raw = xmalloc(uncompressed_size);
+	int rv = uncompress(raw, &uncompressed_size, compressed, compressed_size);
+	free(compressed);
+	if (rv != Z_OK) {
+		free(raw);
+		goto err_free;
+	}
+
+	struct buffer r;
+	buffer_init(&r, raw, uncompressed_size);
+	index->entries = xcalloc(index->nr_entries, sizeof(struct ar_index_entry));
+	bool ok = afa_read_entries(index, &r);
+	free(raw);
+	if (!ok)
+		goto err_free;
+
+	khash_t(index_name_table) *names = kh_init(index_name_table);
+	for (size_t i = 0; i < index->nr_entries; i++) {
+		int ret;
+		khiter_t k = kh_put(index_name_table, names, index->entries[i].name->text, &ret);
+		if (ret)
+			kh_value(names, k) = i;
+	}
+	index->name_table = names;
+
+	fclose(f);
+	return index;
+err_free:
+	ar_index_free(index);
+err_close:
+	fclose(f);
+	return NULL;
+}
+
+struct ar_index_entry *ar_index_get(struct ar_index *index, const char *name)
+{
+	khash_t(index_name_table) *names = index->name_table;
+	khiter_t k = kh_get(index_name_table, names, name);
+	if (k == kh_end(names))
+		return NULL;
+	return &index->entries[kh_value(names, k)];
+}
+
+/*
+ * Map the archive file so that entry data can be accessed via
+ * ar_index_peek. On Windows the file is read through stdio instead.
+ */
+bool ar_index_map(struct ar_index *index, const char *path)
+{
+#ifdef _WIN32
+	index->file = file_open_utf8(path, "rb");
+	return !!index->file;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat s;
+	if (fstat(fd, &s) || s.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	void *map = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+	index->map = map;
+	index->map_size = s.st_size;
+	return true;
+#endif
+}
+
+/*
+ * Copy up to `size` bytes from the start of an entry's data into `buf`.
+ * Returns the number of bytes copied.
+ */
+size_t ar_index_peek(struct ar_index *index, struct ar_index_entry *e, void *buf, size_t size)
+{
+	size = min(size, e->size);
+	if (index->map) {
+		if (e->off >= index->map_size)
+			return 0;
+		size = min(size, index->map_size - e->off);
+		memcpy(buf, index->map + e->off, size);
+		return size;
+	}
+	if (index->file) {
+		if (fseek(index->file, e->off, SEEK_SET))
+			return 0;
+		return fread(buf, 1, size, index->file);
+	}
+	return 0;
+}
+
+/*
+ * Get a pointer to an entry's data in the mapped archive file, or NULL if the
+ * file isn't mapped.
+ */
+const uint8_t *ar_index_view(struct ar_index *index, struct ar_index_entry *e)
+{
+	if (!index->map || e->off > index->map_size || e->size > index->map_size - e->off)
+		return NULL;
+	return index->map + e->off;
+}
+
+/*
+ * Guess the type of a file from its first AR_SNIFF_SIZE bytes.
+ */
+const char *ar_sniff_type(const uint8_t *head, size_t size)
+{
+	uint8_t buf[AR_SNIFF_SIZE] = {0};
+	if (size < 4)
+		return "unknown";
+	memcpy(buf, head, min(size, AR_SNIFF_SIZE));
+
+	enum cg_type type = cg_check_format(buf);
+	if (type != ALCG_UNKNOWN)
+		return cg_file_extensions[type];
+	if (!memcmp(buf, "HEAD", 4))
+		return "ex";
+	if (!memcmp(buf, "FLAT", 4) || (!memcmp(buf, "ELNA", 4) && !memcmp(buf+8, "FLAT", 4)))
+		return "flat";
+	return "unknown";
+}
+
+void ar_index_free(struct ar_index *index)
+{
+#ifndef _WIN32
+	if (index->map)
+		munmap(index->map, index->map_size);
+#endif
+	if (index->file)
+		fclose(index->file);
+	if (index->name_table)
+		kh_destroy(index_name_table, (khash_t(index_name_table)*)index->name_table);
+	if (index->entries) {
+		for (size_t i = 0; i < index->nr_entries; i++) {
+			if (index->entries[i].name)
+				free_string(index->entries[i].name);
+		}
+		free(index->entries);
+	}
+	free(index);
+}
@@ -30,6 +30,8 @@
 #include "alice/ar.h"
 #include "alice/ex.h"
 #include "alice/flat.h"
+#include "alice/thread_pool.h"
+#include "khash.h"
 
 static char path_separator = '/';
 
@@ -73,7 +75,7 @@ static struct ar_file_spec **alicepack_to_file_list(struct ar_manifest *mf, size
 	*size_out = mf->nr_rows;
 
 	for (size_t i = 0; i < mf->nr_rows; i++) {
-		files[i] = xmalloc(sizeof(struct ar_file_spec));
+		files[i] = xcalloc(1, sizeof(struct ar_file_spec));
 		files[i]->type = AR_FILE_SPEC_DISK;
 		files[i]->disk.path = string_ref(mf->alicepack[i].filename);
 		files[i]->name = string_dup(mf->alicepack[i].filename);
@@ -82,39 +84,160 @@ static struct ar_file_spec **alicepack_to_file_list(struct ar_manifest *mf, size
 	return files;
 }
 
-static void convert_file(struct string *src, enum ar_filetype src_fmt, struct string *dst, enum ar_filetype dst_fmt)
+/*
+ * Conversions are organized as a list of tasks, built by walking the source
+ * directories of every manifest line. Image conversions and copies run on a
+ * thread pool as soon as they are found; .txtex and .flat conversions go
+ * through parsers which aren't reentrant, so they are run one at a time by
+ * the calling thread. Tasks are completed (and reported) in the order they
+ * were found, which is independent of the number of threads.
+ *
+ * With a cache directory, outputs are kept in a content-addressed store (see
+ * dedup.c) keyed by the hash of the source file and the conversion. A source
+ * whose key is found in the store is linked rather than converted, so that
+ * e.g. a fresh checkout (with new mtimes) doesn't have to be converted again.
+ */
+
+// bump when the output of a conversion changes, to invalidate cached outputs
+#define CONVERT_CACHE_VERSION 1
+enum convert_task_type {
+	CONVERT_CG,
+	CONVERT_COPY,
+	CONVERT_EX,
+	CONVERT_FLAT,
+};
+
+struct convert_task {
+	struct thread_job job;
+	enum convert_task_type type;
+	struct string *src;
+	// output file, or output directory for CONVERT_FLAT
+	struct string *dst;
+	// file name (CONVERT_FLAT)
+	char *name;
+	enum ar_filetype src_fmt;
+	enum ar_filetype dst_fmt;
+	// conversion cache
+	struct ar_dedup *cache;
+	char *key;
+	bool cached;
+	// set by the worker on failure
+	bool failed;
+	bool fatal;
+	char error[256];
+};
+
+struct convert_graph {
+	struct thread_pool *pool;
+	struct ar_dedup *cache;
+	// number of threads scanning directories
+	int nr_scan_jobs;
+	kvec_t(struct convert_task*) tasks;
+};
+
+/*
+ * Try to link the output of a task from the cache, given the contents of its
+ * source file. If the output isn't cached, the task must produce it and then
+ * call cache_store.
+ */
+static bool cache_lookup(struct convert_task *task, const uint8_t *data, size_t size)
 {
-	// ensure directory exists for dst
-	mkdir_for_file(dst->text);
+	// existing outputs may be links into the cache; never write through them
+	remove(task->dst->text);
+	if (!task->cache)
+		return false;
+
+	// .ex output also depends on the encoding the .txtex file is parsed
+	// with and on the compression level
+	char format[128];
+	if (task->type == CONVERT_EX)
+		snprintf(format, sizeof(format), "%s.%s.%d.%s.z%d", ar_ft_extensions[task->src_fmt],
+				ar_ft_extensions[task->dst_fmt], CONVERT_CACHE_VERSION,
+				get_input_encoding(), zlib_get_level());
+	else
+		snprintf(format, sizeof(format), "%s.%s.%d", ar_ft_extensions[task->src_fmt],
+				ar_ft_extensions[task->dst_fmt], CONVERT_CACHE_VERSION);
+	task->key = ar_dedup_key(data, size, format);
+
+	task->cached = ar_dedup_claim(task->cache, task->key, task->dst->text);
+	return task->cached;
+}
 
-	switch (src_fmt) {
-	case AR_FT_PNG:
-	case AR_FT_QNT: {
-		struct cg *cg = cg_load_file(src->text);
-		if (!cg)
-			return;
-		FILE *f = checked_fopen(dst->text, "wb");
-		if (!cg_write(cg, ar_filetype_to_cg_type(dst_fmt), f)) {
-			ALICE_ERROR("failed to encode file \"%s\"", dst->text);
+static void cache_store(struct convert_task *task, bool ok)
+{
+	if (task->key)
+		ar_dedup_done(task->cache, task->key, task->dst->text, ok);
+}
+
+static void convert_cg(struct thread_job *job)
+{
+	struct convert_task *task = (struct convert_task*)job;
+	size_t size;
+	uint8_t *data = file_read(task->src->text, &size);
+	if (!data) {
+		task->failed = true;
+		snprintf(task->error, sizeof(task->error), "failed to read file");
+		return;
+	}
+	if (cache_lookup(task, data, size)) {
+		free(data);
+		return;
+	}
+	struct cg *cg = cg_load_buffer(data, size);
+	free(data);
+	if (!cg) {
+		task->failed = true;
+		snprintf(task->error, sizeof(task->error), "failed to load image");
+		cache_store(task, false);
+		return;
+	}
+	FILE *f = file_open_utf8(task->dst->text, "wb");
+	if (!f) {
+		task->failed = task->fatal = true;
+		snprintf(task->error, sizeof(task->error), "fopen(\"%s\"): %s",
+				task->dst->text, strerror(errno));
+	} else {
+		if (!cg_write(cg, ar_filetype_to_cg_type(task->dst_fmt), f)) {
+			task->failed = task->fatal = true;
+			snprintf(task->error, sizeof(task->error), "failed to encode file \"%s\"",
+					task->dst->text);
 		}
 		fclose(f);
-		cg_free(cg);
-		break;
 	}
-	case AR_FT_X:
-	case AR_FT_TXTEX: {
-		if (dst_fmt != AR_FT_EX && dst_fmt != AR_FT_PACTEX)
-			ALICE_ERROR("Invalid output format for .txtex files");
-		struct ex *ex = ex_parse_file(src->text);
-		if (!ex)
-			ALICE_ERROR("Failed to parse .txtex file: %s", src->text);
-		ex_write_file(dst->text, ex);
-		ex_free(ex);
-		break;
+	cg_free(cg);
+	cache_store(task, !task->failed);
+}
+
+static void convert_copy(struct thread_job *job)
+{
+	struct convert_task *task = (struct convert_task*)job;
+	remove(task->dst->text);
+	if (!file_copy(task->src->text, task->dst->text)) {
+		task->failed = task->fatal = true;
+		snprintf(task->error, sizeof(task->error), "failed to copy file \"%s\": %s",
+				task->dst->text, strerror(errno));
 	}
-	default:
-		ALICE_ERROR("Filetype not supported as source format");
+}
+
+static void convert_ex(struct convert_task *task)
+{
+	size_t size;
+	uint8_t *data = file_read(task->src->text, &size);
+	if (!data)
+		ALICE_ERROR("Failed to read .txtex file: %s", task->src->text);
+	if (cache_lookup(task, data, size)) {
+		free(data);
+		return;
 	}
+	if (task->dst_fmt != AR_FT_EX && task->dst_fmt != AR_FT_PACTEX)
+		ALICE_ERROR("Invalid output format for .txtex files");
+	struct ex *ex = ex_parse_mem(data, size, task->src->text);
+	free(data);
+	if (!ex)
+		ALICE_ERROR("Failed to parse .txtex file: %s", task->src->text);
+	ex_write_file(task->dst->text, ex);
+	ex_free(ex);
+	cache_store(task, true);
 }
 
 /*
@@ -177,123 +300,207 @@ static void convert_flat(struct string *src, enum ar_filetype src_fmt,
 	free_string(output_path);
 }
 
-static void convert_dir(struct string *src_dir, enum ar_filetype src_fmt,
-			struct string *dst_dir, enum ar_filetype dst_fmt)
+static void convert_graph_push(struct convert_graph *g, enum convert_task_type type,
+		struct string *src, enum ar_filetype src_fmt, struct string *dst,
+		enum ar_filetype dst_fmt, const char *name)
 {
-	char *d_name;
-	UDIR *d = checked_opendir(src_dir->text);
-	while ((d_name = readdir_utf8(d)) != NULL) {
-		if (d_name[0] == '.') {
-			free(d_name);
-			continue;
-		}
+	struct convert_task *task = xcalloc(1, sizeof(struct convert_task));
+	task->type = type;
+	task->src = string_ref(src);
+	task->dst = string_ref(dst);
+	task->name = name ? xstrdup(name) : NULL;
+	task->src_fmt = src_fmt;
+	task->dst_fmt = dst_fmt;
+	task->cache = g->cache;
+	kv_push(struct convert_task*, g->tasks, task);
+
+	if (type == CONVERT_CG)
+		thread_pool_submit(g->pool, &task->job, convert_cg);
+	else if (type == CONVERT_COPY)
+		thread_pool_submit(g->pool, &task->job, convert_copy);
+}
+
+KHASH_MAP_INIT_STR(mtime_table, time_t);
+
+/*
+ * Get the directory part of a relative path, or NULL if there is none.
+ */
+static struct string *rel_dirname(struct string *name)
+{
+	const char *sep = strrchr(name->text, '/');
+	return sep ? make_string(name->text, sep - name->text) : NULL;
+}
 
-		ustat src_s;
-		struct string *src_path = string_path_join(src_dir, d_name);
-		struct string *dst_base = string_path_join(dst_dir, d_name);
-		struct string *dst_path = replace_extension(dst_base->text, ar_ft_extensions[dst_fmt]);
-		checked_stat(src_path->text, &src_s);
+static bool string_equal(struct string *a, struct string *b)
+{
+	if (!a || !b)
+		return a == b;
+	return a->size == b->size && !memcmp(a->text, b->text, a->size);
+}
 
-		if (S_ISDIR(src_s.st_mode)) {
-			convert_dir(src_path, src_fmt, dst_base, dst_fmt);
-			goto loop_next;
+static void convert_dir(struct convert_graph *g, struct string *src_dir, enum ar_filetype src_fmt,
+			struct string *dst_dir, enum ar_filetype dst_fmt)
+{
+	// read the whole tree up front, in a deterministic order
+	ar_scan_list src;
+	ar_scan_dir(src_dir, dst_fmt == AR_FT_FLAT ? NULL : ar_ft_extensions[src_fmt],
+			g->nr_scan_jobs, &src);
+
+	// modification times of existing outputs; with a cache, up-to-date
+	// outputs are found by content instead
+	ar_scan_list dst;
+	kv_init(dst);
+	khash_t(mtime_table) *dst_mtimes = kh_init(mtime_table);
+	if (!g->cache && dst_fmt != AR_FT_FLAT && is_directory(dst_dir->text)) {
+		ar_scan_dir(dst_dir, ar_ft_extensions[dst_fmt], g->nr_scan_jobs, &dst);
+		for (size_t i = 0; i < dst.n; i++) {
+			if (dst.a[i].type != AR_SCAN_FILE)
+				continue;
+			int ret;
+			khiter_t k = kh_put(mtime_table, dst_mtimes, dst.a[i].name->text, &ret);
+			kh_value(dst_mtimes, k) = dst.a[i].mtime;
 		}
-		if (!S_ISREG(src_s.st_mode)) {
-			NOTICE("Skipping \"%s\": not a regular file", src_path->text);
-			goto loop_next;
+	}
+
+	// relative directory for which the output directory was last created
+	struct string *made_dst_dir = NULL;
+	bool made_any_dst_dir = false;
+	for (size_t i = 0; i < src.n; i++) {
+		struct ar_scan_entry *e = &src.a[i];
+		if (e->type == AR_SCAN_SPECIAL) {
+			NOTICE("Skipping \"%s\": not a regular file", e->path->text);
+			continue;
 		}
 		// flat conversion is a special case
 		if (dst_fmt == AR_FT_FLAT) {
-			convert_flat(src_path, src_fmt, dst_dir, d_name);
-			goto loop_next;
+			struct string *rel_dir = rel_dirname(e->name);
+			struct string *out_dir = rel_dir ? string_path_join(dst_dir, rel_dir->text)
+				: string_ref(dst_dir);
+			const char *sep = strrchr(e->name->text, '/');
+			convert_graph_push(g, CONVERT_FLAT, e->path, src_fmt, out_dir, dst_fmt,
+					sep ? sep + 1 : e->name->text);
+			free_string(out_dir);
+			if (rel_dir)
+				free_string(rel_dir);
+			continue;
 		}
-
-		if (strcasecmp(file_extension(d_name), ar_ft_extensions[src_fmt])) {
-			NOTICE("Skipping \"%s\": wrong file extension", src_path->text);
-			goto loop_next;
+		if (e->type == AR_SCAN_FILTERED) {
+			NOTICE("Skipping \"%s\": wrong file extension", e->path->text);
+			continue;
 		}
 
-		if (file_exists(dst_path->text)) {
-			ustat dst_s;
-			checked_stat(dst_path->text, &dst_s);
-			if (src_s.st_mtime < dst_s.st_mtime)
-				goto loop_next;
+		struct string *dst_name = replace_extension(e->name->text, ar_ft_extensions[dst_fmt]);
+		khiter_t k = kh_get(mtime_table, dst_mtimes, dst_name->text);
+		if (k != kh_end(dst_mtimes) && e->mtime < kh_value(dst_mtimes, k)) {
+			free_string(dst_name);
+			continue;
+		}
+		struct string *dst_path = string_path_join(dst_dir, dst_name->text);
+		free_string(dst_name);
+
+		// ensure directory exists for dst
+		struct string *rel_dir = rel_dirname(e->name);
+		if (!made_any_dst_dir || !string_equal(rel_dir, made_dst_dir)) {
+			mkdir_for_file(dst_path->text);
+			if (made_dst_dir)
+				free_string(made_dst_dir);
+			made_dst_dir = rel_dir;
+			made_any_dst_dir = true;
+		} else if (rel_dir) {
+			free_string(rel_dir);
 		}
 
-		NOTICE("%s -> %s", src_path->text, dst_path->text);
-
-		// skip transcode if src/dst formats match
+		enum convert_task_type type;
 		if (src_fmt == dst_fmt) {
-			if (!file_copy(src_path->text, dst_path->text)) {
-				ALICE_ERROR("failed to copy file \"%s\": %s", dst_path->text, strerror(errno));
-			}
-			goto loop_next;
+			// skip transcode if src/dst formats match
+			type = CONVERT_COPY;
+		} else if (src_fmt == AR_FT_PNG || src_fmt == AR_FT_QNT) {
+			type = CONVERT_CG;
+		} else if (src_fmt == AR_FT_X || src_fmt == AR_FT_TXTEX) {
+			type = CONVERT_EX;
+		} else {
+			ALICE_ERROR("Filetype not supported as source format");
 		}
-
-		convert_file(src_path, src_fmt, dst_path, dst_fmt);
-
-	loop_next:
-		free_string(src_path);
+		convert_graph_push(g, type, e->path, src_fmt, dst_path, dst_fmt, NULL);
 		free_string(dst_path);
-		free_string(dst_base);
-		free(d_name);
 	}
-	closedir_utf8(d);
+
+	if (made_dst_dir)
+		free_string(made_dst_dir);
+	kh_destroy(mtime_table, dst_mtimes);
+	ar_scan_list_free(&dst);
+	ar_scan_list_free(&src);
 }
 
-static void batchpack_convert(struct batchpack_line *line)
+/*
+ * Complete the tasks of a conversion graph in order.
+ */
+static void convert_graph_finish(struct convert_graph *g)
 {
-	convert_dir(line->src, line->src_fmt, line->dst, line->dst_fmt);
+	for (size_t i = 0; i < g->tasks.n; i++) {
+		struct convert_task *task = g->tasks.a[i];
+		switch (task->type) {
+		case CONVERT_CG:
+		case CONVERT_COPY:
+			thread_pool_wait_job(g->pool, &task->job);
+			if (task->fatal)
+				ALICE_ERROR("%s: %s", task->src->text, task->error);
+			if (task->failed)
+				WARNING("%s: %s", task->src->text, task->error);
+			else
+				NOTICE("%s -> %s%s", task->src->text, task->dst->text,
+						task->cached ? " (cached)" : "");
+			break;
+		case CONVERT_EX:
+			convert_ex(task);
+			NOTICE("%s -> %s%s", task->src->text, task->dst->text,
+					task->cached ? " (cached)" : "");
+			break;
+		case CONVERT_FLAT:
+			convert_flat(task->src, task->src_fmt, task->dst, task->name);
+			break;
+		}
+		free_string(task->src);
+		free_string(task->dst);
+		free(task->name);
+		free(task->key);
+		free(task);
+	}
+	kv_destroy(g->tasks);
 }
 
-static void dir_to_file_list(struct string *dst, struct string *base_name, ar_file_list *files, enum ar_filetype fmt)
+static void dir_to_file_list(struct string *dst, ar_file_list *files, enum ar_filetype fmt,
+		int nr_jobs)
 {
 	// add all files in dst to file list
-	// TODO: filter by file extension?
-	char *d_name;
-	UDIR *d = checked_opendir(dst->text);
-	while ((d_name = readdir_utf8(d)) != NULL) {
-		if (d_name[0] == '.')
-			goto loop_next;
-
-		ustat s;
-		struct string *path = string_path_join(dst, d_name);
-		struct string *name = string_path_join(base_name, d_name);
-		checked_stat(path->text, &s);
-
-		if (S_ISDIR(s.st_mode)) {
-			dir_to_file_list(path, name, files, fmt);
-			free_string(path);
-			free_string(name);
-			goto loop_next;
-		}
-		if (!S_ISREG(s.st_mode)) {
-			WARNING("Skipping \"%s\": not a regular file", path->text);
-			free_string(path);
-			free_string(name);
-			goto loop_next;
+	ar_scan_list list;
+	ar_scan_dir(dst, fmt ? ar_ft_extensions[fmt] : NULL, nr_jobs, &list);
+	for (size_t i = 0; i < list.n; i++) {
+		struct ar_scan_entry *e = &list.a[i];
+		if (e->type == AR_SCAN_SPECIAL) {
+			WARNING("Skipping \"%s\": not a regular file", e->path->text);
+			continue;
 		}
-		if (fmt && strcasecmp(file_extension(d_name), ar_ft_extensions[fmt])) {
-			NOTICE("Skipping \"%s\": wrong file extension", path->text);
-			free_string(path);
-			free_string(name);
-			goto loop_next;
+		if (e->type == AR_SCAN_FILTERED) {
+			NOTICE("Skipping \"%s\": wrong file extension", e->path->text);
+			continue;
 		}
 
-		struct ar_file_spec *spec = xmalloc(sizeof(struct ar_file_spec));
+		// the size and mtime are kept so that the file isn't stat'ed again
+		struct ar_file_spec *spec = xcalloc(1, sizeof(struct ar_file_spec));
 		spec->type = AR_FILE_SPEC_DISK;
-		spec->disk.path = path;
-		spec->name = name;
+		spec->disk.path = string_ref(e->path);
+		spec->disk.size = e->size;
+		spec->disk.mtime = e->mtime;
+		spec->name = string_ref(e->name);
 		kv_push(struct ar_file_spec*, *files, spec);
-loop_next:
-		free(d_name);
 	}
-	closedir_utf8(d);
+	ar_scan_list_free(&list);
 }
 
 void ar_dir_to_file_list(struct string *dir, ar_file_list *files, enum ar_filetype fmt)
 {
-	dir_to_file_list(dir, &EMPTY_STRING, files, fmt);
+	dir_to_file_list(dir, files, fmt, 0);
 }
 
 static int file_spec_compare(const void *_a, const void *_b)
@@ -308,12 +515,19 @@ void ar_file_list_sort(ar_file_list *list)
 	qsort(list->a, list->n, sizeof(struct ar_file_spec*), file_spec_compare);
 }
 
-static struct ar_file_spec **batchpack_to_file_list(struct ar_manifest *mf, size_t *size_out)
+static struct ar_file_spec **batchpack_to_file_list(struct ar_manifest *mf,
+		const struct ar_pack_options *opt, size_t *size_out)
 {
 	ar_file_list files;
 	kv_init(files);
 
 	// convert files
+	struct convert_graph g = {
+		.pool = thread_pool_new(opt ? opt->nr_jobs : 0),
+		.cache = opt && opt->cache_dir ? ar_dedup_new(opt->cache_dir) : NULL,
+		.nr_scan_jobs = opt ? opt->nr_jobs : 0,
+	};
+	kv_init(g.tasks);
 	for (size_t i = 0; i < mf->nr_rows; i++) {
 		struct string *src = mf->batchpack[i].src;
 		struct string *dst = mf->batchpack[i].dst;
@@ -325,9 +539,22 @@ static struct ar_file_spec **batchpack_to_file_list(struct ar_manifest *mf, size
 		if (strcmp(src->text, dst->text)) {
 			if (!is_directory(src->text))
 				ALICE_ERROR("line %d: \"%s\" is not a directory", (int)i+2, src->text);
-			batchpack_convert(mf->batchpack+i);
+			struct batchpack_line *line = &mf->batchpack[i];
+			convert_dir(&g, line->src, line->src_fmt, line->dst, line->dst_fmt);
 		}
 	}
+	convert_graph_finish(&g);
+	thread_pool_free(g.pool);
+	if (g.cache) {
+		ar_dedup_trim(g.cache, opt->cache_size);
+		struct ar_dedup_stats stats;
+		ar_dedup_get_stats(g.cache, &stats);
+		NOTICE("Conversion cache: %lu hits, %lu misses", stats.nr_linked, stats.nr_missed);
+		if (stats.nr_evicted)
+			NOTICE("Conversion cache: evicted %lu files (%.1f MiB)", stats.nr_evicted,
+					stats.bytes_evicted / (1024.0 * 1024.0));
+		ar_dedup_free(g.cache);
+	}
 
 	// create file list from output dirs
 	for (size_t i = 0; i < mf->nr_rows; i++) {
@@ -341,7 +568,7 @@ static struct ar_file_spec **batchpack_to_file_list(struct ar_manifest *mf, size
 			}
 		}
 		if (!duplicate) {
-			dir_to_file_list(dst, string_ref(&EMPTY_STRING), &files, mf->batchpack[i].dst_fmt);
+			dir_to_file_list(dst, &files, mf->batchpack[i].dst_fmt, opt ? opt->nr_jobs : 0);
 		}
 	}
 
@@ -368,14 +595,11 @@ static void alicecg2_to_batchpack(struct ar_manifest *mf)
 static void ar_to_file_spec_iter(struct archive_data *data, void *user)
 {
 	ar_file_list *files = user;
-	if (!archive_load_file(data))
-		ALICE_ERROR("Error loading archive file: %s", data->name);
 
+	// the entry is only loaded when the archive is written
 	struct ar_file_spec *spec = xmalloc(sizeof(struct ar_file_spec));
-	spec->type = AR_FILE_SPEC_MEM;
-	spec->mem.data = xmalloc(data->size);
-	spec->mem.size = data->size;
-	memcpy(spec->mem.data, data->data, data->size);
+	spec->type = AR_FILE_SPEC_ARCHIVE;
+	spec->archive.data = archive_copy_descriptor(data);
 
 	char *tmp = conv_input(data->name);
 	spec->name = cstr_to_string(tmp);
@@ -389,7 +613,8 @@ void ar_to_file_list(struct archive *ar, ar_file_list *files)
 	archive_for_each(ar, ar_to_file_spec_iter, files);
 }
 
-static struct ar_file_spec **manifest_to_file_list(struct ar_manifest *mf, size_t *size_out)
+static struct ar_file_spec **manifest_to_file_list(struct ar_manifest *mf,
+		const struct ar_pack_options *opt, size_t *size_out)
 {
 	struct ar_file_spec **files;
 	switch (mf->type) {
@@ -398,10 +623,10 @@ static struct ar_file_spec **manifest_to_file_list(struct ar_manifest *mf, size_
 		break;
 	case AR_MF_ALICECG2:
 		alicecg2_to_batchpack(mf);
-		files = batchpack_to_file_list(mf, size_out);
+		files = batchpack_to_file_list(mf, opt, size_out);
 		break;
 	case AR_MF_BATCHPACK:
-		files = batchpack_to_file_list(mf, size_out);
+		files = batchpack_to_file_list(mf, opt, size_out);
 		break;
 	case AR_MF_NL5:
 	case AR_MF_WAVLINKER:
@@ -467,6 +692,9 @@ void ar_file_spec_free(struct ar_file_spec *spec)
 	case AR_FILE_SPEC_MEM:
 		free(spec->mem.data);
 		break;
+	case AR_FILE_SPEC_ARCHIVE:
+		archive_free_data(spec->archive.data);
+		break;
 	}
 	free(spec);
 }
@@ -478,22 +706,74 @@ void ar_file_list_free(ar_file_list *list)
 	}
 }
 
-void ar_pack_manifest(struct ar_manifest *ar, int afa_version)
+void ar_pack_manifest(struct ar_manifest *ar, const struct ar_pack_options *opt)
+{
+	size_t nr_files;
+	struct ar_file_spec **files = manifest_to_file_list(ar, opt, &nr_files);
+	write_afa(ar->output_path, files, nr_files, opt);
+	for (size_t i = 0; i < nr_files; i++) {
+		ar_file_spec_free(files[i]);
+	}
+	free(files);
+}
+
+/*
+ * Update the archive in place if it exists; otherwise create it.
+ */
+static void update_manifest(struct ar_manifest *ar, const struct ar_pack_options *opt, unsigned flags)
 {
+	if (!file_exists(ar->output_path->text)) {
+		ar_pack_manifest(ar, opt);
+		return;
+	}
+
 	size_t nr_files;
-	struct ar_file_spec **files = manifest_to_file_list(ar, &nr_files);
-	write_afa(ar->output_path, files, nr_files, afa_version);
+	struct ar_file_spec **files = manifest_to_file_list(ar, opt, &nr_files);
+	if (!update_afa(ar->output_path, files, nr_files, flags))
+		ALICE_ERROR("%s: not an .afa archive", ar->output_path->text);
+	if (flags & AR_UPDATE_COMPACT)
+		compact_afa(ar->output_path);
 	for (size_t i = 0; i < nr_files; i++) {
 		ar_file_spec_free(files[i]);
 	}
 	free(files);
 }
 
-void ar_pack(const char *manifest, int afa_version)
+static bool path_is_absolute(const char *path)
 {
+#ifdef _WIN32
+	return path[0] == '/' || path[0] == '\\' || (path[0] && path[1] == ':');
+#else
+	return path[0] == '/';
+#endif
+}
+
+/*
+ * Make a path given on the command line absolute, since the manifest's paths
+ * are resolved relative to its own directory. Returns the new path (if any),
+ * which must be freed by the caller.
+ */
+static struct string *absolute_path(const char *cwd, const char **path)
+{
+	if (!*path || path_is_absolute(*path))
+		return NULL;
+	struct string *dir = cstr_to_string(cwd);
+	struct string *abs = string_path_join(dir, *path);
+	free_string(dir);
+	*path = abs->text;
+	return abs;
+}
+
+static void pack(const char *manifest, const struct ar_pack_options *opt, bool update,
+		unsigned update_flags)
+{
+	struct ar_pack_options o = AR_PACK_OPTIONS_DEFAULT;
+	if (opt)
+		o = *opt;
+
 	struct ar_manifest *mf = ar_parse_manifest(manifest);
 	if (mf->afa_version > 0)
-		afa_version = mf->afa_version;
+		o.afa_version = mf->afa_version;
 	if (mf->backslash)
 		ar_set_path_separator('\\');
 
@@ -504,10 +784,68 @@ void ar_pack(const char *manifest, int afa_version)
 	// paths are relative to manifest location
 	char *old_cwd = xmalloc(2048);
 	old_cwd = getcwd(old_cwd, 2048);
+	struct string *cache_dir = absolute_path(old_cwd, &o.cache_dir);
+	struct string *order_file = absolute_path(old_cwd, &o.order_file);
 	chdir_to_file(manifest);
 
-	ar_pack_manifest(mf, afa_version);
+	if (update)
+		update_manifest(mf, &o, update_flags);
+	else
+		ar_pack_manifest(mf, &o);
 	free_manifest(mf);
 	chdir(old_cwd);
 	free(old_cwd);
+	if (cache_dir)
+		free_string(cache_dir);
+	if (order_file)
+		free_string(order_file);
+}
+
+void ar_pack(const char *manifest, const struct ar_pack_options *opt)
+{
+	pack(manifest, opt, false, 0);
+}
+
+void ar_update(const char *manifest, const struct ar_pack_options *opt, unsigned flags)
+{
+	pack(manifest, opt, true, flags);
+}
+
+static bool same_file(const char *a, const char *b)
+{
+	struct stat sa, sb;
+	if (stat(a, &sa) || stat(b, &sb))
+		return false;
+	return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+/*
+ * Convert an archive of any supported type to .afa. Entries are streamed from
+ * the input archive's mapping while the output is written, without being
+ * extracted or copied into memory first.
+ */
+void ar_repack(const char *input, const char *output, const struct ar_pack_options *opt)
+{
+	enum archive_type type;
+	int error = ARCHIVE_FILE_ERROR;
+	struct archive *ar = open_archive(input, &type, &error);
+	if (!ar)
+		ALICE_ERROR("Error opening archive file '%s': %s", input, archive_strerror(error));
+	if (type == AR_FLAT)
+		ALICE_ERROR("'%s': .flat files can't be repacked", input);
+	// the output would be truncated while the input is still mapped
+	if (same_file(input, output))
+		ALICE_ERROR("'%s': input and output are the same file", output);
+
+	ar_file_list files;
+	kv_init(files);
+	ar_to_file_list(ar, &files);
+
+	struct string *out = cstr_to_string(output);
+	write_afa(out, files.a, files.n, opt);
+	free_string(out);
+
+	ar_file_list_free(&files);
+	kv_destroy(files);
+	archive_free(ar);
 }
@@ -0,0 +1,262 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "system4.h"
+#include "system4/file.h"
+#include "system4/string.h"
+#include "alice.h"
+#include "alice/ar.h"
+#include "alice/thread_pool.h"
+#include "kvec.h"
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#endif
+
+/*
+ * Recursive directory scanner. Each directory is read by a job on a thread
+ * pool, which submits a job for every subdirectory it finds, so independent
+ * subtrees are walked concurrently. Entry types are taken from d_type where
+ * the file system provides it, and only files which pass the extension filter
+ * are stat'ed (relative to their directory's descriptor) for their size and
+ * modification time. Reading directories is bound by latency rather than CPU
+ * (particularly on network file systems), so by default more threads are used
+ * than there are processors.
+ */
+
+#define SCAN_DEFAULT_JOBS 8
+
+struct scanner {
+	struct thread_pool *pool;
+	const char *ext;
+	pthread_mutex_t mutex;
+	ar_scan_list entries;
+	kvec_t(struct scan_job*) jobs;
+};
+
+struct scan_job {
+	struct thread_job job;
+	struct scanner *s;
+	struct string *path;
+	struct string *name;
+};
+
+static void scan_dir_job(struct thread_job *job);
+
+static void scan_submit(struct scanner *s, struct string *path, struct string *name)
+{
+	struct scan_job *job = xcalloc(1, sizeof(struct scan_job));
+	job->s = s;
+	job->path = path;
+	job->name = name;
+	pthread_mutex_lock(&s->mutex);
+	kv_push(struct scan_job*, s->jobs, job);
+	pthread_mutex_unlock(&s->mutex);
+	thread_pool_submit(s->pool, &job->job, scan_dir_job);
+}
+
+static bool ext_matches(const char *filter, const char *name)
+{
+	if (!filter)
+		return true;
+	const char *ext = file_extension(name);
+	return ext && !strcasecmp(ext, filter);
+}
+
+enum entry_kind {
+	KIND_UNKNOWN,
+	KIND_DIR,
+	KIND_FILE,
+	KIND_SPECIAL,
+};
+
+static enum entry_kind stat_kind(ustat *st)
+{
+	if (S_ISDIR(st->st_mode))
+		return KIND_DIR;
+	if (S_ISREG(st->st_mode))
+		return KIND_FILE;
+	return KIND_SPECIAL;
+}
+
+/*
+ * Add an entry found in a directory. `st` is NULL if the entry hasn't been
+ * stat'ed yet; `do_stat` stats it on demand.
+ */
+static void scan_entry(struct scan_job *job, ar_scan_list *out, const char *d_name,
+		enum entry_kind kind, bool (*do_stat)(void*, const char*, ustat*), void *ctx)
+{
+	ustat st;
+	bool have_stat = false;
+	struct string *path = string_path_join(job->path, d_name);
+	if (kind == KIND_UNKNOWN) {
+		if (!do_stat(ctx, d_name, &st))
+			ALICE_ERROR("stat(\"%s\"): %s", path->text, strerror(errno));
+		kind = stat_kind(&st);
+		have_stat = true;
+	}
+
+	struct string *name = string_path_join(job->name, d_name);
+	if (kind == KIND_DIR) {
+		scan_submit(job->s, path, name);
+		return;
+	}
+
+	struct ar_scan_entry e = {
+		.path = path,
+		.name = name,
+	};
+	if (kind == KIND_SPECIAL) {
+		e.type = AR_SCAN_SPECIAL;
+	} else if (!ext_matches(job->s->ext, d_name)) {
+		e.type = AR_SCAN_FILTERED;
+	} else {
+		if (!have_stat && !do_stat(ctx, d_name, &st))
+			ALICE_ERROR("stat(\"%s\"): %s", path->text, strerror(errno));
+		e.type = AR_SCAN_FILE;
+		e.size = st.st_size;
+		e.mtime = st.st_mtime;
+	}
+	kv_push(struct ar_scan_entry, *out, e);
+}
+
+#ifdef _WIN32
+static bool stat_path(void *ctx, const char *d_name, ustat *st)
+{
+	struct string *path = string_path_join(ctx, d_name);
+	bool ok = !stat_utf8(path->text, st);
+	free_string(path);
+	return ok;
+}
+#else
+static bool stat_at(void *ctx, const char *d_name, ustat *st)
+{
+	return !fstatat(*(int*)ctx, d_name, st, 0);
+}
+
+static enum entry_kind dirent_kind(struct dirent *d)
+{
+#ifdef DT_UNKNOWN
+	switch (d->d_type) {
+	case DT_DIR: return KIND_DIR;
+	case DT_REG: return KIND_FILE;
+	// symbolic links are followed
+	case DT_LNK:
+	case DT_UNKNOWN: return KIND_UNKNOWN;
+	default: return KIND_SPECIAL;
+	}
+#else
+	return KIND_UNKNOWN;
+#endif
+}
+#endif
+
+static void scan_dir_job(struct thread_job *_job)
+{
+	struct scan_job *job = (struct scan_job*)_job;
+	ar_scan_list found;
+	kv_init(found);
+
+#ifdef _WIN32
+	char *d_name;
+	UDIR *d = checked_opendir(job->path->text);
+	while ((d_name = readdir_utf8(d)) != NULL) {
+		if (d_name[0] != '.')
+			scan_entry(job, &found, d_name, KIND_UNKNOWN, stat_path, job->path);
+		free(d_name);
+	}
+	closedir_utf8(d);
+#else
+	DIR *d = opendir(job->path->text);
+	if (!d)
+		ALICE_ERROR("opendir(\"%s\"): %s", job->path->text, strerror(errno));
+	int fd = dirfd(d);
+	struct dirent *ent;
+	while ((ent = readdir(d)) != NULL) {
+		if (ent->d_name[0] != '.')
+			scan_entry(job, &found, ent->d_name, dirent_kind(ent), stat_at, &fd);
+	}
+	closedir(d);
+#endif
+
+	pthread_mutex_lock(&job->s->mutex);
+	for (size_t i = 0; i < found.n; i++) {
+		kv_push(struct ar_scan_entry, job->s->entries, found.a[i]);
+	}
+	pthread_mutex_unlock(&job->s->mutex);
+	kv_destroy(found);
+}
+
+/*
+ * Compare paths component by component, so that the result is the order in
+ * which a depth-first walk visiting the entries of each directory in sorted
+ * order would find them.
+ */
+static int scan_entry_compare(const void *_a, const void *_b)
+{
+	const unsigned char *a = (const unsigned char*)((const struct ar_scan_entry*)_a)->name->text;
+	const unsigned char *b = (const unsigned char*)((const struct ar_scan_entry*)_b)->name->text;
+	for (; *a && *a == *b; a++, b++);
+	unsigned ca = *a == '/' ? 1 : *a;
+	unsigned cb = *b == '/' ? 1 : *b;
+	return (int)ca - (int)cb;
+}
+
+/*
+ * Recursively list the files under `dir` (excluding directories and hidden
+ * entries). Files whose extension matches `ext` (or all regular files, if
+ * `ext` is NULL) are stat'ed. Entries are named relative to `dir` and sorted.
+ */
+void ar_scan_dir(struct string *dir, const char *ext, int nr_jobs, ar_scan_list *out)
+{
+	struct scanner s = {
+		.pool = thread_pool_new(nr_jobs < 1 ? max(thread_pool_nr_cpus(), SCAN_DEFAULT_JOBS) : nr_jobs),
+		.ext = ext,
+	};
+	pthread_mutex_init(&s.mutex, NULL);
+	kv_init(s.entries);
+	kv_init(s.jobs);
+
+	scan_submit(&s, string_dup(dir), make_string("", 0));
+	thread_pool_wait(s.pool);
+	thread_pool_free(s.pool);
+
+	for (size_t i = 0; i < s.jobs.n; i++) {
+		free_string(s.jobs.a[i]->path);
+		free_string(s.jobs.a[i]->name);
+		free(s.jobs.a[i]);
+	}
+	kv_destroy(s.jobs);
+	pthread_mutex_destroy(&s.mutex);
+
+	qsort(s.entries.a, s.entries.n, sizeof(struct ar_scan_entry), scan_entry_compare);
+	*out = s.entries;
+}
+
+void ar_scan_list_free(ar_scan_list *list)
+{
+	for (size_t i = 0; i < list->n; i++) {
+		free_string(list->a[i].path);
+		free_string(list->a[i].name);
+	}
+	kv_destroy(*list);
+}
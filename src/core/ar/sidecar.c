@@ -0,0 +1,202 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include "system4.h"
+#include "system4/file.h"
+#include "alice.h"
+#include "alice/ar.h"
+#include "khash.h"
+#include "kvec.h"
+
+/*
+ * Sidecar manifest written next to the output of an incremental extraction.
+ * One line per extracted entry:
+ *
+ *     <name> TAB <offset> TAB <size> TAB <hash> TAB <format> TAB <path>
+ *
+ * where <path> is relative to the output directory and <hash> is the hash64
+ * of the entry's data (as stored in the archive) in hexadecimal.
+ */
+
+#define SIDECAR_MAGIC "# alice-ar sidecar v1"
+
+KHASH_MAP_INIT_STR(sidecar_name_table, size_t);
+
+struct sidecar_data {
+	kvec_t(struct ar_sidecar_entry) entries;
+	khash_t(sidecar_name_table) *names;
+};
+
+struct ar_sidecar *ar_sidecar_new(void)
+{
+	struct ar_sidecar *sc = xcalloc(1, sizeof(struct ar_sidecar));
+	struct sidecar_data *d = xcalloc(1, sizeof(struct sidecar_data));
+	kv_init(d->entries);
+	d->names = kh_init(sidecar_name_table);
+	sc->priv = d;
+	return sc;
+}
+
+void ar_sidecar_free(struct ar_sidecar *sc)
+{
+	struct sidecar_data *d = sc->priv;
+	for (size_t i = 0; i < kv_size(d->entries); i++) {
+		struct ar_sidecar_entry *e = &kv_A(d->entries, i);
+		free(e->name);
+		free(e->format);
+		free(e->path);
+	}
+	kv_destroy(d->entries);
+	kh_destroy(sidecar_name_table, d->names);
+	free(d);
+	free(sc);
+}
+
+size_t ar_sidecar_size(struct ar_sidecar *sc)
+{
+	return kv_size(((struct sidecar_data*)sc->priv)->entries);
+}
+
+struct ar_sidecar_entry *ar_sidecar_entry(struct ar_sidecar *sc, size_t i)
+{
+	return &kv_A(((struct sidecar_data*)sc->priv)->entries, i);
+}
+
+struct ar_sidecar_entry *ar_sidecar_get(struct ar_sidecar *sc, const char *name)
+{
+	struct sidecar_data *d = sc->priv;
+	khiter_t k = kh_get(sidecar_name_table, d->names, name);
+	if (k == kh_end(d->names))
+		return NULL;
+	return &kv_A(d->entries, kh_value(d->names, k));
+}
+
+void ar_sidecar_add(struct ar_sidecar *sc, const char *name, uint64_t off, uint64_t size,
+		uint64_t hash, const char *format, const char *path)
+{
+	struct sidecar_data *d = sc->priv;
+	struct ar_sidecar_entry e = {
+		.name = xstrdup(name),
+		.off = off,
+		.size = size,
+		.hash = hash,
+		.format = xstrdup(format),
+		.path = xstrdup(path),
+	};
+
+	int ret;
+	khiter_t k = kh_put(sidecar_name_table, d->names, e.name, &ret);
+	if (!ret) {
+		// duplicate name: replace the existing entry
+		struct ar_sidecar_entry *old = &kv_A(d->entries, kh_value(d->names, k));
+		free(e.name);
+		free(old->format);
+		free(old->path);
+		e.name = old->name;
+		*old = e;
+		return;
+	}
+	kh_value(d->names, k) = kv_size(d->entries);
+	kv_push(struct ar_sidecar_entry, d->entries, e);
+}
+
+static char *next_field(char **p, char sep)
+{
+	char *s = *p;
+	if (!s)
+		return NULL;
+	char *end = strchr(s, sep);
+	if (end) {
+		*end = '\0';
+		*p = end + 1;
+	} else {
+		*p = NULL;
+	}
+	return s;
+}
+
+struct ar_sidecar *ar_sidecar_read(const char *path)
+{
+	struct ar_sidecar *sc = ar_sidecar_new();
+	if (!file_exists(path))
+		return sc;
+
+	size_t len;
+	char *text = file_read(path, &len);
+	if (!text) {
+		WARNING("Failed to read %s", path);
+		return sc;
+	}
+	text = xrealloc(text, len + 1);
+	text[len] = '\0';
+
+	char *p = text;
+	char *line = next_field(&p, '\n');
+	if (!line || strcmp(line, SIDECAR_MAGIC)) {
+		WARNING("Ignoring invalid sidecar manifest: %s", path);
+		free(text);
+		return sc;
+	}
+
+	unsigned long line_nr = 1;
+	while ((line = next_field(&p, '\n'))) {
+		line_nr++;
+		if (!*line)
+			continue;
+		char *fields[6];
+		char *q = line;
+		for (int i = 0; i < 6; i++) {
+			fields[i] = next_field(&q, '\t');
+		}
+		if (!fields[5]) {
+			WARNING("%s:%lu: malformed line", path, line_nr);
+			continue;
+		}
+		ar_sidecar_add(sc, fields[0],
+				strtoull(fields[1], NULL, 10),
+				strtoull(fields[2], NULL, 10),
+				strtoull(fields[3], NULL, 16),
+				fields[4], fields[5]);
+	}
+	free(text);
+	return sc;
+}
+
+bool ar_sidecar_write(struct ar_sidecar *sc, const char *path)
+{
+	FILE *f = checked_fopen(path, "wb");
+	if (!f)
+		return false;
+
+	struct sidecar_data *d = sc->priv;
+	fprintf(f, "%s\n", SIDECAR_MAGIC);
+	for (size_t i = 0; i < kv_size(d->entries); i++) {
+		struct ar_sidecar_entry *e = &kv_A(d->entries, i);
+		fprintf(f, "%s\t%" PRIu64 "\t%" PRIu64 "\t%016" PRIx64 "\t%s\t%s\n",
+				e->name, e->off, e->size, e->hash, e->format, e->path);
+	}
+	if (fclose(f)) {
+		WARNING("Failed to write %s: %s", path, strerror(errno));
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,475 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "system4.h"
+#include "system4/archive.h"
+#include "system4/file.h"
+#include "system4/string.h"
+#include "system4/utfsjis.h"
+#include "alice.h"
+#include "alice/ar.h"
+#include "khash.h"
+#include "kvec.h"
+#include "little_endian.h"
+
+/*
+ * In-place updates of .afa archives. New and changed entries are appended to
+ * the end of the DATA section and the INFO table is rewritten to point at
+ * them; all other entries stay where they are. Replaced entries leave unused
+ * data behind, which is reclaimed by compacting the archive.
+ *
+ * Files whose size matches their entry are compared with the archive's copy.
+ * With AR_UPDATE_TRUST_MTIME, files on disk which are also older than the
+ * archive file are assumed to be unchanged without being read. This is only
+ * safe if files are never copied with their original modification times
+ * (e.g. unpacked from a zip, or with cp -p or rsync).
+ */
+
+KHASH_SET_INIT_STR(name_set);
+
+#define COPY_BUFFER_SIZE (1024 * 1024)
+
+// when the INFO table outgrows the space before the DATA section, the data
+// is moved to a boundary of this size to leave room for future updates
+#define RELOCATE_ALIGN (1024 * 1024)
+
+static uint8_t zpad[8] = {0};
+
+static uint64_t align8(uint64_t i)
+{
+	return (i+7) & ~7;
+}
+
+static char *tmp_path(const char *path)
+{
+	size_t len = strlen(path);
+	char *tmp = xmalloc(len + 5);
+	memcpy(tmp, path, len);
+	memcpy(tmp + len, ".tmp", 5);
+	return tmp;
+}
+
+static void checked_fseek(FILE *f, uint64_t off, const char *path)
+{
+	if (fseeko(f, off, SEEK_SET))
+		ALICE_ERROR("fseeko(\"%s\"): %s", path, strerror(errno));
+}
+
+static void checked_read(void *buf, size_t size, FILE *f, const char *path)
+{
+	if (fread(buf, size, 1, f) != 1)
+		ALICE_ERROR("Error reading \"%s\"", path);
+}
+
+/*
+ * Copy `size` bytes at offset `off` of `in` to the current position of `out`.
+ */
+static void copy_range(FILE *in, uint64_t off, uint64_t size, FILE *out, const char *path)
+{
+#ifndef _WIN32
+	fflush(out);
+	off_t pos = ftello(out);
+	if (copy_fd_range(fileno(in), off, size, fileno(out))) {
+		// resynchronize the stream with the file descriptor
+		checked_fseek(out, pos + size, path);
+		return;
+	}
+	checked_fseek(out, pos, path);
+#endif
+	uint8_t *buf = xmalloc(COPY_BUFFER_SIZE);
+	checked_fseek(in, off, path);
+	while (size > 0) {
+		size_t n = min(size, COPY_BUFFER_SIZE);
+		checked_read(buf, n, in, path);
+		checked_fwrite(buf, n, out);
+		size -= n;
+	}
+	free(buf);
+}
+
+static FILE *open_spec(struct ar_file_spec *spec)
+{
+	FILE *in = file_open_utf8(spec->disk.path->text, "rb");
+	if (!in)
+		ALICE_ERROR("fopen(\"%s\"): %s", spec->disk.path->text, strerror(errno));
+	return in;
+}
+
+static uint64_t spec_size(struct ar_file_spec *spec)
+{
+	off_t size = 0;
+	switch (spec->type) {
+	case AR_FILE_SPEC_DISK:
+		size = spec->disk.size ? (off_t)spec->disk.size : file_size(spec->disk.path->text);
+		break;
+	case AR_FILE_SPEC_MEM:
+		size = spec->mem.size;
+		break;
+	case AR_FILE_SPEC_ARCHIVE:
+		size = spec->archive.data->size;
+		break;
+	}
+	if (size <= 0)
+		ALICE_ERROR("can't determine size of file: %s", spec->name->text);
+	return size;
+}
+
+/*
+ * Get the contents of a file which isn't on disk (or NULL if it is). Archive
+ * entries are loaded until spec_unload is called.
+ */
+static uint8_t *spec_load(struct ar_file_spec *spec)
+{
+	switch (spec->type) {
+	case AR_FILE_SPEC_DISK:
+		break;
+	case AR_FILE_SPEC_MEM:
+		return spec->mem.data;
+	case AR_FILE_SPEC_ARCHIVE:
+		if (!archive_load_file(spec->archive.data))
+			ALICE_ERROR("Error loading archive file: %s", spec->name->text);
+		return spec->archive.data->data;
+	}
+	return NULL;
+}
+
+static void spec_unload(struct ar_file_spec *spec)
+{
+	if (spec->type == AR_FILE_SPEC_ARCHIVE)
+		archive_release_file(spec->archive.data);
+}
+
+/*
+ * Check whether a file on disk was modified before `archive_mtime`.
+ */
+static bool older_than(struct ar_file_spec *spec, time_t archive_mtime)
+{
+	if (spec->type != AR_FILE_SPEC_DISK)
+		return false;
+	time_t mtime = spec->disk.mtime;
+	if (!mtime) {
+		ustat s;
+		if (stat_utf8(spec->disk.path->text, &s))
+			return false;
+		mtime = s.st_mtime;
+	}
+	// a file modified in the same second as the archive may be newer
+	return mtime < archive_mtime;
+}
+
+/*
+ * Check whether a file has the same contents as an (equally sized) entry.
+ */
+static bool same_contents(FILE *f, struct ar_index_entry *e, struct ar_file_spec *spec,
+		const char *path)
+{
+	uint8_t *a = xmalloc(COPY_BUFFER_SIZE);
+	uint8_t *mem = spec_load(spec);
+	uint8_t *b = mem ? mem : xmalloc(COPY_BUFFER_SIZE);
+	FILE *in = mem ? NULL : open_spec(spec);
+
+	bool same = true;
+	checked_fseek(f, e->off, path);
+	for (uint64_t pos = 0; same && pos < e->size; pos += COPY_BUFFER_SIZE) {
+		size_t n = min(e->size - pos, COPY_BUFFER_SIZE);
+		checked_read(a, n, f, path);
+		if (in) {
+			checked_read(b, n, in, spec->disk.path->text);
+			same = !memcmp(a, b, n);
+		} else {
+			same = !memcmp(a, b + pos, n);
+		}
+	}
+
+	if (in) {
+		fclose(in);
+		free(b);
+	} else {
+		spec_unload(spec);
+	}
+	free(a);
+	return same;
+}
+
+/*
+ * Append a file to the archive at `off`. Returns the size of the file.
+ */
+static uint64_t append_spec(FILE *f, uint64_t off, struct ar_file_spec *spec, uint64_t size,
+		const char *path)
+{
+	checked_fseek(f, off, path);
+	uint8_t *mem = spec_load(spec);
+	if (mem) {
+		checked_fwrite(mem, size, f);
+		spec_unload(spec);
+	} else {
+		FILE *in = open_spec(spec);
+		copy_range(in, 0, size, f, path);
+		fclose(in);
+	}
+	if (align8(size) != size)
+		checked_fwrite(zpad, align8(size) - size, f);
+	return size;
+}
+
+/*
+ * Rewrite the archive with its DATA section moved to `data_start`. Entry
+ * offsets are relative to the start of the DATA section, so the data is moved
+ * as a whole and the INFO table is unchanged.
+ */
+static void relocate_data(FILE *f, const char *path, int version, size_t nr_entries,
+		uint32_t old_data_start, uint32_t data_start, uint64_t data_size, uint8_t *table,
+		unsigned long table_len, unsigned long uncompressed_size)
+{
+	char *tmp = tmp_path(path);
+	FILE *out = checked_fopen(tmp, "wb");
+	afa_write_header(out, version, nr_entries, data_start, table, table_len,
+			uncompressed_size, data_size);
+	copy_range(f, old_data_start + 8, data_size, out, path);
+	if (fclose(out))
+		ALICE_ERROR("fclose(\"%s\"): %s", tmp, strerror(errno));
+	fclose(f);
+	if (rename(tmp, path))
+		ALICE_ERROR("rename(\"%s\", \"%s\"): %s", tmp, path, strerror(errno));
+	free(tmp);
+}
+
+struct sort_entry {
+	char *key;
+	struct ar_index_entry e;
+};
+
+static int sort_entry_cmp(const void *_a, const void *_b)
+{
+	const struct sort_entry *a = _a, *b = _b;
+	return strcmp(a->key, b->key);
+}
+
+/*
+ * Sort entries by (UTF-8) name, as write_afa does for new archives. In v2
+ * archives an entry's id is its position in the index.
+ */
+static void sort_entries(struct ar_index_entry *entries, size_t n, int version)
+{
+	struct sort_entry *s = xcalloc(n, sizeof(struct sort_entry));
+	for (size_t i = 0; i < n; i++) {
+		s[i].key = sjis2utf(entries[i].name->text, entries[i].name->size);
+		s[i].e = entries[i];
+	}
+	qsort(s, n, sizeof(struct sort_entry), sort_entry_cmp);
+	for (size_t i = 0; i < n; i++) {
+		entries[i] = s[i].e;
+		if (version != 1)
+			entries[i].id = i;
+		free(s[i].key);
+	}
+	free(s);
+}
+
+bool update_afa(struct string *filename, struct ar_file_spec **files, size_t nr_files,
+		unsigned flags)
+{
+	const char *path = filename->text;
+	struct ar_index *index = ar_index_read(path);
+	if (!index)
+		return false;
+
+	ustat archive_stat;
+	checked_stat(path, &archive_stat);
+
+	FILE *f = file_open_utf8(path, "r+b");
+	if (!f)
+		ALICE_ERROR("fopen(\"%s\"): %s", path, strerror(errno));
+
+	uint8_t data_hdr[8];
+	checked_fseek(f, index->data_start, path);
+	checked_read(data_hdr, 8, f, path);
+	if (memcmp(data_hdr, "DATA", 4))
+		ALICE_ERROR("%s: DATA section not found", path);
+	uint64_t data_end = index->data_start + (uint32_t)LittleEndian_getDW(data_hdr, 4);
+
+	// the updated index: the existing entries followed by new ones (sorted
+	// before the index is written)
+	kvec_t(struct ar_index_entry) entries;
+	kv_init(entries);
+	for (size_t i = 0; i < index->nr_entries; i++) {
+		struct ar_index_entry e = index->entries[i];
+		e.name = string_ref(e.name);
+		kv_push(struct ar_index_entry, entries, e);
+	}
+
+	size_t nr_added = 0, nr_changed = 0, nr_unchanged = 0;
+	uint64_t dead_bytes = 0, appended_bytes = 0;
+	khash_t(name_set) *seen = kh_init(name_set);
+	for (size_t i = 0; i < nr_files; i++) {
+		char *name = utf2sjis(files[i]->name->text, files[i]->name->size);
+		int ret;
+		kh_put(name_set, seen, name, &ret);
+		if (!ret) {
+			WARNING("Duplicate file in manifest: %s", files[i]->name->text);
+			free(name);
+			continue;
+		}
+
+		uint64_t size = spec_size(files[i]);
+		if (size > UINT32_MAX || data_end + align8(size) - index->data_start > UINT32_MAX)
+			ALICE_ERROR("%s: archive too large", path);
+
+		struct ar_index_entry *e = ar_index_get(index, name);
+		if (e && e->size == size && (((flags & AR_UPDATE_TRUST_MTIME)
+						&& older_than(files[i], archive_stat.st_mtime))
+					|| same_contents(f, e, files[i], path))) {
+			nr_unchanged++;
+			continue;
+		}
+
+		NOTICE("%s", files[i]->name->text);
+		append_spec(f, data_end, files[i], size, path);
+		if (e) {
+			e = &kv_A(entries, e - index->entries);
+			dead_bytes += align8(e->size);
+			nr_changed++;
+		} else {
+			// v2 ids are assigned when the entries are sorted
+			struct ar_index_entry new_entry = {
+				.name = make_string(name, strlen(name)),
+				.id = index->version == 1 ? afa_id_of_filename(files[i]->name->text) : 0,
+			};
+			kv_push(struct ar_index_entry, entries, new_entry);
+			e = &kv_A(entries, kv_size(entries) - 1);
+			nr_added++;
+		}
+		e->off = data_end;
+		e->size = size;
+		data_end += align8(size);
+		appended_bytes += align8(size);
+	}
+
+	if (nr_added || nr_changed) {
+		// new entries were appended to the end of the index
+		if (nr_added)
+			sort_entries(entries.a, kv_size(entries), index->version);
+		unsigned long table_len, uncompressed_size;
+		uint8_t *table = afa_build_index(entries.a, kv_size(entries), index->version,
+				index->data_start, &table_len, &uncompressed_size);
+		uint64_t data_size = data_end - (index->data_start + 8);
+		if (AFA_HEADER_SIZE + table_len <= index->data_start) {
+			checked_fseek(f, 0, path);
+			afa_write_header(f, index->version, kv_size(entries), index->data_start,
+					table, table_len, uncompressed_size, data_size);
+			if (fclose(f))
+				ALICE_ERROR("fclose(\"%s\"): %s", path, strerror(errno));
+		} else {
+			uint32_t data_start = (AFA_HEADER_SIZE + table_len + RELOCATE_ALIGN - 1)
+				& ~(RELOCATE_ALIGN - 1);
+			NOTICE("INFO table outgrew its space; moving DATA section to 0x%x", data_start);
+			relocate_data(f, path, index->version, kv_size(entries), index->data_start,
+					data_start, data_size, table, table_len, uncompressed_size);
+		}
+		free(table);
+	} else {
+		fclose(f);
+	}
+
+	// count data which was already unused before this update
+	uint64_t live_bytes = 0;
+	for (size_t i = 0; i < index->nr_entries; i++) {
+		live_bytes += align8(index->entries[i].size);
+	}
+	uint64_t old_data_size = data_end - appended_bytes - (index->data_start + 8);
+	dead_bytes += old_data_size > live_bytes ? old_data_size - live_bytes : 0;
+
+	NOTICE("Updated %s: %zu added, %zu changed, %zu unchanged (%.1f MiB appended)",
+			path, nr_added, nr_changed, nr_unchanged, appended_bytes / (1024.0 * 1024.0));
+	if (dead_bytes)
+		NOTICE("%.1f MiB of unused data in archive (use --compact to reclaim)",
+				dead_bytes / (1024.0 * 1024.0));
+
+	for (khiter_t k = kh_begin(seen); k != kh_end(seen); k++) {
+		if (kh_exist(seen, k))
+			free((char*)kh_key(seen, k));
+	}
+	kh_destroy(name_set, seen);
+	for (size_t i = 0; i < kv_size(entries); i++) {
+		free_string(kv_A(entries, i).name);
+	}
+	kv_destroy(entries);
+	ar_index_free(index);
+	return true;
+}
+
+/*
+ * Rewrite an .afa archive without its unused data. Entries are laid out in
+ * index order, as write_afa does.
+ */
+bool compact_afa(struct string *filename)
+{
+	const char *path = filename->text;
+	struct ar_index *index = ar_index_read(path);
+	if (!index)
+		return false;
+
+	FILE *f = file_open_utf8(path, "rb");
+	if (!f)
+		ALICE_ERROR("fopen(\"%s\"): %s", path, strerror(errno));
+
+	// new offsets, relative to the start of the DATA section
+	struct ar_index_entry *entries = xcalloc(index->nr_entries, sizeof(struct ar_index_entry));
+	uint64_t off = 8;
+	for (size_t i = 0; i < index->nr_entries; i++) {
+		entries[i] = index->entries[i];
+		entries[i].off = off;
+		off += align8(entries[i].size);
+	}
+	uint64_t data_size = off - 8;
+
+	unsigned long table_len, uncompressed_size;
+	uint8_t *table = afa_build_index(entries, index->nr_entries, index->version, 0,
+			&table_len, &uncompressed_size);
+	uint32_t data_start = (AFA_HEADER_SIZE + table_len + 0xFFF) & ~0xFFF;
+
+	char *tmp = tmp_path(path);
+	FILE *out = checked_fopen(tmp, "wb");
+	afa_write_header(out, index->version, index->nr_entries, data_start, table, table_len,
+			uncompressed_size, data_size);
+	for (size_t i = 0; i < index->nr_entries; i++) {
+		struct ar_index_entry *e = &index->entries[i];
+		copy_range(f, e->off, e->size, out, path);
+		if (align8(e->size) != e->size)
+			checked_fwrite(zpad, align8(e->size) - e->size, out);
+	}
+	if (fclose(out))
+		ALICE_ERROR("fclose(\"%s\"): %s", tmp, strerror(errno));
+	fclose(f);
+
+	uint64_t old_size = file_size(path);
+	if (rename(tmp, path))
+		ALICE_ERROR("rename(\"%s\", \"%s\"): %s", tmp, path, strerror(errno));
+	uint64_t new_size = data_start + 8 + data_size;
+	NOTICE("Compacted %s: %.1f MiB reclaimed", path,
+			old_size > new_size ? (old_size - new_size) / (1024.0 * 1024.0) : 0.0);
+
+	free(tmp);
+	free(table);
+	free(entries);
+	ar_index_free(index);
+	return true;
+}
@@ -19,7 +19,8 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
-#include <zlib.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include "system4.h"
 #include "system4/archive.h"
 #include "system4/buffer.h"
@@ -28,15 +29,506 @@
 #include "system4/utfsjis.h"
 #include "alice.h"
 #include "alice/ar.h"
+#include "alice/thread_pool.h"
+#include "khash.h"
+#include "kvec.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 
 static uint32_t align8(uint32_t i)
 {
 	return (i+7) & ~7;
 }
 
+static uint32_t align_to(uint32_t i, uint32_t align)
+{
+	return (i + align - 1) & ~(align - 1);
+}
+
 static uint8_t zpad[0x1000] = {0};
 
-static int id_of_filename(const char *name)
+static void write_zeros(FILE *f, size_t n)
+{
+	while (n > 0) {
+		size_t len = min(n, sizeof(zpad));
+		checked_fwrite(zpad, len, f);
+		n -= len;
+	}
+}
+
+// Input files are read in chunks of (at most) this size.
+#define CHUNK_SIZE (1024 * 1024)
+#define MIN_CHUNK_SIZE (64 * 1024)
+
+// Disk files at least this large are copied in-kernel when possible, bypassing
+// the read buffers entirely.
+#define COPY_THRESHOLD (4 * CHUNK_SIZE)
+
+enum data_block_type {
+	BLOCK_MEM,
+	BLOCK_READ,
+	BLOCK_COPY,
+	BLOCK_ARCHIVE,
+};
+
+/*
+ * A contiguous piece of the DATA section: either (part of) an input file, an
+ * in-memory file, or an entry of a source archive.
+ */
+struct data_block {
+	enum data_block_type type;
+	struct ar_file_spec *file;
+	off_t off;
+	size_t size;
+	// padding following the block (after the last block of a file)
+	unsigned pad;
+	// read slot (BLOCK_READ)
+	unsigned slot;
+};
+
+struct read_slot {
+	struct thread_job job;
+	struct data_block *block;
+	uint8_t *buf;
+	int error;
+};
+
+/*
+ * The DATA section is written in order by the calling thread, while a pool of
+ * reader threads fills a fixed ring of buffers with the blocks that come next.
+ * Memory use is bounded by the size of the ring, regardless of file sizes.
+ */
+struct data_writer {
+	FILE *out;
+	struct thread_pool *pool;
+	struct read_slot *slots;
+	unsigned nr_slots;
+	size_t chunk_size;
+	kvec_t(struct data_block) blocks;
+	// padding preceding the first block
+	unsigned lead_pad;
+	// next block to be scheduled for reading
+	size_t next_read;
+};
+
+static void read_block(struct thread_job *job)
+{
+	struct read_slot *slot = (struct read_slot*)job;
+	struct data_block *b = slot->block;
+	slot->error = 0;
+
+	FILE *in = file_open_utf8(b->file->disk.path->text, "rb");
+	if (!in) {
+		slot->error = errno;
+		return;
+	}
+	if (b->off && fseeko(in, b->off, SEEK_SET)) {
+		slot->error = errno;
+	} else if (fread(slot->buf, b->size, 1, in) != 1) {
+		// a short read means the file was truncated after it was sized
+		slot->error = ferror(in) ? errno : EIO;
+	}
+	fclose(in);
+}
+
+/*
+ * Schedule the next block to be read into a (free) slot.
+ */
+static void schedule_read(struct data_writer *w, unsigned slot)
+{
+	for (; w->next_read < kv_size(w->blocks); w->next_read++) {
+		struct data_block *b = &kv_A(w->blocks, w->next_read);
+		if (b->type != BLOCK_READ)
+			continue;
+		b->slot = slot;
+		w->slots[slot].block = b;
+		thread_pool_submit(w->pool, &w->slots[slot].job, read_block);
+		w->next_read++;
+		return;
+	}
+}
+
+static void add_block(struct data_writer *w, enum data_block_type type,
+		struct ar_file_spec *file, off_t off, size_t size)
+{
+	struct data_block b = {
+		.type = type,
+		.file = file,
+		.off = off,
+		.size = size,
+	};
+	kv_push(struct data_block, w->blocks, b);
+}
+
+/*
+ * Set up the blocks of the DATA section. Files are written in the order given
+ * by `order`, at the offsets given by `offsets` (relative to the DATA header),
+ * and the gaps between them are padded with zeros up to `end`. Files for which `dup_of` is set share the
+ * data of an earlier file and aren't written.
+ */
+static void data_writer_init(struct data_writer *w, FILE *out, struct ar_file_spec **files,
+		off_t *sizes, uint32_t *offsets, ssize_t *dup_of, size_t *order, size_t nr_files,
+		uint32_t end, const struct ar_pack_options *opt)
+{
+	w->out = out;
+	w->chunk_size = max(MIN_CHUNK_SIZE, min(CHUNK_SIZE, opt->buffer_size / 2));
+	w->nr_slots = max(2, opt->buffer_size / w->chunk_size);
+	w->lead_pad = 0;
+	w->next_read = 0;
+	kv_init(w->blocks);
+
+	uint32_t pos = 8;
+	for (size_t k = 0; k < nr_files; k++) {
+		size_t i = order[k];
+		if (dup_of && dup_of[i] >= 0)
+			continue;
+		if (kv_size(w->blocks))
+			kv_A(w->blocks, kv_size(w->blocks) - 1).pad = offsets[i] - pos;
+		else
+			w->lead_pad = offsets[i] - pos;
+		pos = offsets[i] + sizes[i];
+
+		if (files[i]->type == AR_FILE_SPEC_MEM) {
+			add_block(w, BLOCK_MEM, files[i], 0, sizes[i]);
+		} else if (files[i]->type == AR_FILE_SPEC_ARCHIVE) {
+			add_block(w, BLOCK_ARCHIVE, files[i], 0, sizes[i]);
+		}
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE)
+		else if (sizes[i] >= COPY_THRESHOLD) {
+			add_block(w, BLOCK_COPY, files[i], 0, sizes[i]);
+		}
+#endif
+		else {
+			for (off_t off = 0; off < sizes[i]; off += w->chunk_size) {
+				add_block(w, BLOCK_READ, files[i], off,
+						min((off_t)w->chunk_size, sizes[i] - off));
+			}
+		}
+	}
+	if (kv_size(w->blocks))
+		kv_A(w->blocks, kv_size(w->blocks) - 1).pad = end - pos;
+
+	// don't allocate more buffers than there are blocks to fill them
+	size_t nr_reads = 0;
+	for (size_t i = 0; i < kv_size(w->blocks); i++) {
+		if (kv_A(w->blocks, i).type == BLOCK_READ)
+			nr_reads++;
+	}
+	w->nr_slots = min(w->nr_slots, max(nr_reads, 1));
+
+	w->pool = thread_pool_new(opt->nr_jobs);
+	w->slots = xcalloc(w->nr_slots, sizeof(struct read_slot));
+	for (unsigned i = 0; i < w->nr_slots; i++) {
+		w->slots[i].buf = xmalloc(w->chunk_size);
+	}
+}
+
+static void data_writer_fini(struct data_writer *w)
+{
+	thread_pool_free(w->pool);
+	for (unsigned i = 0; i < w->nr_slots; i++) {
+		free(w->slots[i].buf);
+	}
+	free(w->slots);
+	kv_destroy(w->blocks);
+}
+
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE)
+static void copy_block(struct data_writer *w, struct data_block *b)
+{
+	const char *path = b->file->disk.path->text;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		ALICE_ERROR("open(\"%s\"): %s", path, strerror(errno));
+	fflush(w->out);
+	if (!copy_fd_range(fd, b->off, b->size, fileno(w->out)))
+		ALICE_ERROR("Error copying \"%s\": %s", path, strerror(errno));
+	// resynchronize the stream with the file descriptor
+	if (fseeko(w->out, 0, SEEK_END))
+		ALICE_ERROR("fseeko: %s", strerror(errno));
+	close(fd);
+}
+#endif
+
+/*
+ * Write an entry of a source archive. For mmapped archives, loading the entry
+ * only points it into the mapping, so the data is written straight from the
+ * page cache.
+ */
+static void write_archive_block(struct data_writer *w, struct data_block *b)
+{
+	struct archive_data *data = b->file->archive.data;
+	if (!archive_load_file(data))
+		ALICE_ERROR("Error loading archive file: %s", b->file->name->text);
+	if (data->size != b->size)
+		ALICE_ERROR("Size of archive file changed: %s", b->file->name->text);
+	checked_fwrite(data->data, b->size, w->out);
+	archive_release_file(data);
+}
+
+static void write_data(struct data_writer *w)
+{
+	for (unsigned i = 0; i < w->nr_slots; i++) {
+		schedule_read(w, i);
+	}
+
+	write_zeros(w->out, w->lead_pad);
+	for (size_t i = 0; i < kv_size(w->blocks); i++) {
+		struct data_block *b = &kv_A(w->blocks, i);
+		switch (b->type) {
+		case BLOCK_MEM:
+			checked_fwrite(b->file->mem.data, b->size, w->out);
+			break;
+		case BLOCK_READ: {
+			struct read_slot *slot = &w->slots[b->slot];
+			thread_pool_wait_job(w->pool, &slot->job);
+			if (slot->error)
+				ALICE_ERROR("Error reading \"%s\": %s", b->file->disk.path->text,
+						strerror(slot->error));
+			checked_fwrite(slot->buf, b->size, w->out);
+			schedule_read(w, b->slot);
+			break;
+		}
+		case BLOCK_COPY:
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE)
+			copy_block(w, b);
+#endif
+			break;
+		case BLOCK_ARCHIVE:
+			write_archive_block(w, b);
+			break;
+		}
+		write_zeros(w->out, b->pad);
+	}
+}
+
+struct hash_job {
+	struct thread_job job;
+	struct ar_file_spec *file;
+	size_t size;
+	uint64_t hash;
+};
+
+// archives aren't safe to load from concurrently (e.g. FILE*-backed ones)
+static pthread_mutex_t archive_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Get the first `size` bytes of a file's data. The data must be released with
+ * release_file_data.
+ */
+static uint8_t *get_file_data(struct ar_file_spec *file, size_t size)
+{
+	if (file->type == AR_FILE_SPEC_MEM)
+		return file->mem.data;
+	if (file->type == AR_FILE_SPEC_ARCHIVE) {
+		pthread_mutex_lock(&archive_mutex);
+		bool ok = archive_load_file(file->archive.data);
+		pthread_mutex_unlock(&archive_mutex);
+		if (!ok)
+			ALICE_ERROR("Error loading archive file: %s", file->name->text);
+		return file->archive.data->data;
+	}
+	const char *path = file->disk.path->text;
+#ifdef _WIN32
+	size_t file_size;
+	uint8_t *data = file_read(path, &file_size);
+	if (!data || file_size < size)
+		ALICE_ERROR("Error reading \"%s\"", path);
+	return data;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		ALICE_ERROR("open(\"%s\"): %s", path, strerror(errno));
+	uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		ALICE_ERROR("mmap(\"%s\"): %s", path, strerror(errno));
+	return map;
+#endif
+}
+
+static void release_file_data(struct ar_file_spec *file, uint8_t *data, possibly_unused size_t size)
+{
+	if (file->type == AR_FILE_SPEC_MEM)
+		return;
+	if (file->type == AR_FILE_SPEC_ARCHIVE) {
+		pthread_mutex_lock(&archive_mutex);
+		archive_release_file(file->archive.data);
+		pthread_mutex_unlock(&archive_mutex);
+		return;
+	}
+#ifdef _WIN32
+	free(data);
+#else
+	munmap(data, size);
+#endif
+}
+
+static void hash_file(struct thread_job *job)
+{
+	struct hash_job *hj = (struct hash_job*)job;
+	if (!hj->size) {
+		hj->hash = hash64(NULL, 0);
+		return;
+	}
+	uint8_t *data = get_file_data(hj->file, hj->size);
+	hj->hash = hash64(data, hj->size);
+	release_file_data(hj->file, data, hj->size);
+}
+
+/*
+ * Check whether two files of the given size have identical contents.
+ */
+static bool same_file_data(struct ar_file_spec *a, struct ar_file_spec *b, size_t size)
+{
+	if (!size)
+		return true;
+	uint8_t *da = get_file_data(a, size);
+	uint8_t *db = get_file_data(b, size);
+	bool same = !memcmp(da, db, size);
+	release_file_data(b, db, size);
+	release_file_data(a, da, size);
+	return same;
+}
+
+KHASH_MAP_INIT_INT64(payload_table, size_t);
+
+/*
+ * Find files with identical contents. For each file, `dup_of` is set to the
+ * index of the first file (in layout order) with the same contents, or -1.
+ * Files are matched by the hash and size of their data, and candidates are
+ * compared byte by byte so that a hash collision can't merge different files.
+ */
+static void find_duplicates(struct ar_file_spec **files, off_t *sizes, size_t *order,
+		size_t nr_files, ssize_t *dup_of, int nr_jobs)
+{
+	struct hash_job *jobs = xcalloc(nr_files, sizeof(struct hash_job));
+	struct thread_pool *pool = thread_pool_new(nr_jobs);
+	for (size_t i = 0; i < nr_files; i++) {
+		jobs[i].file = files[i];
+		jobs[i].size = sizes[i];
+		thread_pool_submit(pool, &jobs[i].job, hash_file);
+	}
+	thread_pool_free(pool);
+
+	uint64_t saved = 0;
+	size_t nr_dups = 0;
+	khash_t(payload_table) *table = kh_init(payload_table);
+	for (size_t n = 0; n < nr_files; n++) {
+		size_t i = order[n];
+		int ret;
+		khiter_t k = kh_put(payload_table, table, jobs[i].hash, &ret);
+		if (ret) {
+			kh_value(table, k) = i;
+			dup_of[i] = -1;
+		} else if (sizes[kh_value(table, k)] == sizes[i]
+				&& same_file_data(files[kh_value(table, k)], files[i], sizes[i])) {
+			dup_of[i] = kh_value(table, k);
+			saved += align8(sizes[i]);
+			nr_dups++;
+		} else {
+			dup_of[i] = -1;
+		}
+	}
+	kh_destroy(payload_table, table);
+	free(jobs);
+
+	if (nr_dups)
+		NOTICE("Deduplicated %zu files (%" PRIu64 " bytes saved)", nr_dups, saved);
+}
+
+KHASH_MAP_INIT_STR(layout_table, size_t);
+
+static char *layout_key(const char *name, size_t len)
+{
+	char *key = xmalloc(len + 1);
+	for (size_t i = 0; i < len; i++) {
+		key[i] = name[i] == '\\' ? '/' : name[i];
+	}
+	key[len] = '\0';
+	return key;
+}
+
+/*
+ * Get the order in which the data of the files is laid out. If `path` is
+ * given, it names a file listing entry names (one per line, in the order in
+ * which they are first accessed, e.g. a recorded access trace); those files
+ * come first, and the remaining files follow in index order. Lines starting
+ * with '#' and repeated names are ignored.
+ */
+static size_t *layout_order(struct ar_file_spec **files, size_t nr_files, const char *path)
+{
+	size_t *order = xcalloc(nr_files, sizeof(size_t));
+	if (!path) {
+		for (size_t i = 0; i < nr_files; i++) {
+			order[i] = i;
+		}
+		return order;
+	}
+
+	size_t len;
+	char *text = file_read(path, &len);
+	if (!text)
+		ALICE_ERROR("Failed to read \"%s\"", path);
+
+	khash_t(layout_table) *table = kh_init(layout_table);
+	for (size_t i = 0; i < nr_files; i++) {
+		int ret;
+		char *key = layout_key(files[i]->name->text, files[i]->name->size);
+		khiter_t k = kh_put(layout_table, table, key, &ret);
+		if (!ret) {
+			free(key);
+			continue;
+		}
+		kh_value(table, k) = i;
+	}
+
+	bool *placed = xcalloc(nr_files, sizeof(bool));
+	size_t n = 0, nr_unmatched = 0;
+	size_t start = 0;
+	for (size_t i = 0; i <= len; i++) {
+		if (i < len && text[i] != '\n')
+			continue;
+		size_t end = i;
+		if (end > start && text[end-1] == '\r')
+			end--;
+		if (end > start && text[start] != '#') {
+			char *key = layout_key(text + start, end - start);
+			khiter_t k = kh_get(layout_table, table, key);
+			if (k == kh_end(table)) {
+				nr_unmatched++;
+			} else if (!placed[kh_value(table, k)]) {
+				placed[kh_value(table, k)] = true;
+				order[n++] = kh_value(table, k);
+			}
+			free(key);
+		}
+		start = i + 1;
+	}
+	if (nr_unmatched)
+		WARNING("%zu names in \"%s\" are not in the archive", nr_unmatched, path);
+	NOTICE("Laid out %zu of %zu files in profile order", n, nr_files);
+
+	for (size_t i = 0; i < nr_files; i++) {
+		if (!placed[i])
+			order[n++] = i;
+	}
+
+	for (khiter_t k = kh_begin(table); k != kh_end(table); k++) {
+		if (kh_exist(table, k))
+			free((char*)kh_key(table, k));
+	}
+	kh_destroy(layout_table, table);
+	free(placed);
+	free(text);
+	return order;
+}
+
+uint32_t afa_id_of_filename(const char *name)
 {
 	// XXX: we parse every number in the filename and keep the last one
 	int result = 0;
@@ -53,64 +545,54 @@ static int id_of_filename(const char *name)
 	return result;
 }
 
-void write_afa(struct string *filename, struct ar_file_spec **files, size_t nr_files, int version)
+/*
+ * Serialize and compress the INFO table of an .afa archive. Entry names are
+ * SJIS, and entry offsets are written relative to `base`.
+ */
+uint8_t *afa_build_index(struct ar_index_entry *entries, size_t nr_entries, int version,
+		uint32_t base, unsigned long *size_out, unsigned long *uncompressed_size_out)
 {
-	if (version < 1 || version > 2)
-		ALICE_ERROR("Unsupported AFA version: %d", version);
-
-	// open output file
-	FILE *f = checked_fopen(filename->text, "wb");
-
-	// get file sizes
-	off_t *sizes = xcalloc(nr_files, sizeof(off_t));
-	size_t data_size = 0;
-	for (size_t i = 0; i < nr_files; i++) {
-		if (files[i]->type == AR_FILE_SPEC_DISK) {
-			sizes[i] = file_size(files[i]->disk.path->text);
-		} else if (files[i]->type == AR_FILE_SPEC_MEM) {
-			sizes[i] = files[i]->mem.size;
-		}
-		if (sizes[i] <= 0) {
-			ALICE_ERROR("can't determine size of file: %s", files[i]->name->text);
-		}
-		data_size += align8(sizes[i]);
-	}
-
-	// write index to buffer
-	off_t off = 8;
 	struct buffer buf;
 	buffer_init(&buf, NULL, 0);
-	for (size_t i = 0; i < nr_files; i++) {
-		char *u = utf2sjis(files[i]->name->text, files[i]->name->size);
-		buffer_write_int32(&buf, strlen(u));
-		buffer_write_pascal_cstring(&buf, u);
+	for (size_t i = 0; i < nr_entries; i++) {
+		struct ar_index_entry *e = &entries[i];
+		buffer_write_int32(&buf, e->name->size);
+		buffer_write_pascal_cstring(&buf, e->name->text);
 		// file ID
 		if (version == 1)
-			buffer_write_int32(&buf, id_of_filename(files[i]->name->text));
-		buffer_write_int32(&buf, 0); // timestamp?
-		buffer_write_int32(&buf, 0); // timestamp?
-		buffer_write_int32(&buf, off);
-		buffer_write_int32(&buf, sizes[i]);
-		off += align8(sizes[i]);
-		free(u);
+			buffer_write_int32(&buf, e->id);
+		buffer_write_int32(&buf, e->unknown0); // timestamp?
+		buffer_write_int32(&buf, e->unknown1); // timestamp?
+		buffer_write_int32(&buf, e->off - base);
+		buffer_write_int32(&buf, e->size);
 	}
 
 	// compress index
 	unsigned long uncompressed_size = buf.index;
-	unsigned long file_table_len = uncompressed_size * 1.001 + 12;
-	uint8_t *file_table = xmalloc(file_table_len);
-	int r = compress2(file_table, &file_table_len, buf.buf, uncompressed_size, 1);
-	if (r != Z_OK) {
-		ALICE_ERROR("compress2 failed");
-	}
+	size_t file_table_len;
+	uint8_t *file_table = zlib_compress(buf.buf, uncompressed_size, &file_table_len);
+	free(buf.buf);
 
-	// XXX: ALDExplorer won't open archive unless data_start is aligned to 0x1000.
-	//      On the other hand, AliceSoft aligns to 1MB (???)
-	size_t data_start = (44 + file_table_len + 0xFFF) & ~0xFFF;
-	size_t pad = data_start - (44 + file_table_len);
+	*size_out = file_table_len;
+	*uncompressed_size_out = uncompressed_size;
+	return file_table;
+}
+
+/*
+ * Write the header and (compressed) INFO table of an .afa archive, padding up
+ * to `data_start`, and the header of the DATA chunk. `data_size` is the size
+ * of the data following the DATA header.
+ */
+void afa_write_header(FILE *f, int version, size_t nr_entries, uint32_t data_start,
+		uint8_t *file_table, unsigned long file_table_len, unsigned long uncompressed_size,
+		uint64_t data_size)
+{
+	assert(data_start >= AFA_HEADER_SIZE + file_table_len);
+	size_t pad = data_start - (AFA_HEADER_SIZE + file_table_len);
 
 	// write header to buffer
-	buf.index = 0;
+	struct buffer buf;
+	buffer_init(&buf, NULL, 0);
 	buffer_write_bytes(&buf, (uint8_t*)"AFAH", 4);
 	buffer_write_int32(&buf, 0x1c);
 	buffer_write_bytes(&buf, (uint8_t*)"AlicArch", 8);
@@ -120,49 +602,134 @@ void write_afa(struct string *filename, struct ar_file_spec **files, size_t nr_f
 	buffer_write_bytes(&buf, (uint8_t*)"INFO", 4);
 	buffer_write_int32(&buf, file_table_len + 16);
 	buffer_write_int32(&buf, uncompressed_size);
-	buffer_write_int32(&buf, nr_files);
+	buffer_write_int32(&buf, nr_entries);
 
 	// write header to archive
 	checked_fwrite(buf.buf, buf.index, f);
 
 	// write index to archive
 	checked_fwrite(file_table, file_table_len, f);
-	free(file_table);
 
 	// write padding to archive
 	buf.index = 0;
-	if (pad) {
-		if (pad >= 8) {
-			buffer_write_bytes(&buf, (uint8_t*)"DUMM", 4);
-			buffer_write_int32(&buf, pad);
-			pad -= 8;
-		}
-		buffer_write_bytes(&buf, zpad, pad);
+	if (pad >= 8) {
+		buffer_write_bytes(&buf, (uint8_t*)"DUMM", 4);
+		buffer_write_int32(&buf, pad);
+		pad -= 8;
 	}
+	checked_fwrite(buf.buf, buf.index, f);
+	write_zeros(f, pad);
 
-	// write files to archive
+	// write DATA header to archive
+	buf.index = 0;
 	buffer_write_bytes(&buf, (uint8_t*)"DATA", 4);
 	buffer_write_int32(&buf, data_size+8);
 	checked_fwrite(buf.buf, buf.index, f);
+	free(buf.buf);
+}
+
+void write_afa(struct string *filename, struct ar_file_spec **files, size_t nr_files,
+		const struct ar_pack_options *opt)
+{
+	struct ar_pack_options default_opt = AR_PACK_OPTIONS_DEFAULT;
+	if (!opt)
+		opt = &default_opt;
+	int version = opt->afa_version;
+	if (version < 1 || version > 2)
+		ALICE_ERROR("Unsupported AFA version: %d", version);
+	if (opt->align < 8 || (opt->align & (opt->align - 1)))
+		ALICE_ERROR("Invalid alignment: %u", opt->align);
+
+	// open output file
+	FILE *f = checked_fopen(filename->text, "wb");
+
+	// get file sizes
+	off_t *sizes = xcalloc(nr_files, sizeof(off_t));
 	for (size_t i = 0; i < nr_files; i++) {
 		if (files[i]->type == AR_FILE_SPEC_DISK) {
-			FILE *in = checked_fopen(files[i]->disk.path->text, "rb");
-			uint8_t *tmp = xmalloc(sizes[i]);
-			checked_fread(tmp, sizes[i], in);
-			checked_fwrite(tmp, sizes[i], f);
-			free(tmp);
-			fclose(in);
+			sizes[i] = files[i]->disk.size ? (off_t)files[i]->disk.size
+				: file_size(files[i]->disk.path->text);
 		} else if (files[i]->type == AR_FILE_SPEC_MEM) {
-			checked_fwrite(files[i]->mem.data, sizes[i], f);
+			sizes[i] = files[i]->mem.size;
+		} else if (files[i]->type == AR_FILE_SPEC_ARCHIVE) {
+			sizes[i] = files[i]->archive.data->size;
+		}
+		if (sizes[i] <= 0) {
+			ALICE_ERROR("can't determine size of file: %s", files[i]->name->text);
+		}
+	}
+
+	// the index is written in the given order, but the data may be laid out
+	// in a different one
+	size_t *order = layout_order(files, nr_files, opt->order_file);
+
+	// store identical payloads once
+	ssize_t *dup_of = NULL;
+	if (opt->dedup) {
+		dup_of = xcalloc(nr_files, sizeof(ssize_t));
+		find_duplicates(files, sizes, order, nr_files, dup_of, opt->nr_jobs);
+	}
+
+	// lay out data
+	uint32_t *offsets = xcalloc(nr_files, sizeof(uint32_t));
+	uint32_t off = 8;
+	uint64_t align_pad = 0;
+	for (size_t k = 0; k < nr_files; k++) {
+		size_t i = order[k];
+		if (dup_of && dup_of[i] >= 0) {
+			offsets[i] = offsets[dup_of[i]];
+			continue;
+		}
+		if (opt->align > 8 && (uint64_t)sizes[i] >= opt->align_threshold) {
+			uint32_t aligned = align_to(off, opt->align);
+			align_pad += aligned - off;
+			off = aligned;
 		}
+		offsets[i] = off;
+		off += align8(sizes[i]);
+	}
+	uint64_t data_size = off - 8;
+	if (opt->align > 8) {
+		NOTICE("Alignment padding: %" PRIu64 " bytes (%.2f%% of data)", align_pad,
+				data_size ? align_pad * 100.0 / data_size : 0.0);
+	}
 
-		int pad = align8(sizes[i]) - sizes[i];
-		if (pad)
-			checked_fwrite(zpad, pad, f);
+	// build index
+	struct ar_index_entry *entries = xcalloc(nr_files, sizeof(struct ar_index_entry));
+	for (size_t i = 0; i < nr_files; i++) {
+		char *u = utf2sjis(files[i]->name->text, files[i]->name->size);
+		entries[i].name = make_string(u, strlen(u));
+		entries[i].id = afa_id_of_filename(files[i]->name->text);
+		entries[i].off = offsets[i];
+		entries[i].size = sizes[i];
+		free(u);
 	}
+	unsigned long file_table_len, uncompressed_size;
+	uint8_t *file_table = afa_build_index(entries, nr_files, version, 0, &file_table_len,
+			&uncompressed_size);
+	for (size_t i = 0; i < nr_files; i++) {
+		free_string(entries[i].name);
+	}
+	free(entries);
+
+	// XXX: ALDExplorer won't open archive unless data_start is aligned to 0x1000.
+	//      On the other hand, AliceSoft aligns to 1MB (???)
+	//      Aligned entries are aligned in the file as well as in the DATA section.
+	size_t data_start = align_to(AFA_HEADER_SIZE + file_table_len, max(0x1000, opt->align));
+	afa_write_header(f, version, nr_files, data_start, file_table, file_table_len,
+			uncompressed_size, data_size);
+	free(file_table);
+
+	// write files to archive
+	struct data_writer w;
+	data_writer_init(&w, f, files, sizes, offsets, dup_of, order, nr_files, off, opt);
+	write_data(&w);
+	data_writer_fini(&w);
 
 	fflush(f);
 	fclose(f);
-	free(buf.buf);
 	free(sizes);
+	free(offsets);
+	free(order);
+	free(dup_of);
 }
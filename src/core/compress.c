@@ -0,0 +1,188 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "system4.h"
+#include "alice.h"
+#include "alice/thread_pool.h"
+
+/*
+ * Shared zlib compression for the file formats written by alice-tools.
+ * Large inputs are compressed pigz-style: the input is split into blocks
+ * which are deflated in parallel, each primed with the 32 KiB of input
+ * preceding it and ended with a sync flush, and the raw deflate blocks are
+ * concatenated into a single standard zlib stream. The format depends only
+ * on the input size, so the output is the same for any number of jobs.
+ */
+
+#define BLOCK_SIZE (128 * 1024)
+#define DICT_SIZE (32 * 1024)
+
+// inputs smaller than this are compressed as a single stream with compress2
+#define PARALLEL_THRESHOLD (4 * BLOCK_SIZE)
+
+static int compression_level = 1;
+static int compression_jobs = 0;
+
+void zlib_set_level(int level)
+{
+	if (level < 0 || level > 9)
+		ALICE_ERROR("Invalid compression level: %d", level);
+	compression_level = level;
+}
+
+int zlib_get_level(void)
+{
+	return compression_level;
+}
+
+void zlib_set_jobs(int nr_jobs)
+{
+	compression_jobs = nr_jobs;
+}
+
+struct deflate_block {
+	struct thread_job job;
+	const uint8_t *data;
+	size_t size;
+	size_t dict_size;
+	bool last;
+	uint8_t *out;
+	size_t out_size;
+	bool ok;
+};
+
+static void deflate_block(struct thread_job *job)
+{
+	struct deflate_block *b = (struct deflate_block*)job;
+	z_stream s = {0};
+	if (deflateInit2(&s, compression_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return;
+	if (b->dict_size)
+		deflateSetDictionary(&s, b->data - b->dict_size, b->dict_size);
+
+	// a sync flush adds an empty stored block (at most 5 bytes + alignment)
+	size_t bound = deflateBound(&s, b->size) + 16;
+	b->out = xmalloc(bound);
+	s.next_in = (Bytef*)b->data;
+	s.avail_in = b->size;
+	s.next_out = b->out;
+	s.avail_out = bound;
+	int r = deflate(&s, b->last ? Z_FINISH : Z_SYNC_FLUSH);
+	if (b->last)
+		b->ok = r == Z_STREAM_END;
+	else
+		b->ok = r == Z_OK && s.avail_in == 0 && s.avail_out > 0;
+	b->out_size = bound - s.avail_out;
+	deflateEnd(&s);
+}
+
+static uint32_t adler32_all(const uint8_t *data, size_t size)
+{
+	uLong adler = adler32(0, NULL, 0);
+	while (size > 0) {
+		uInt n = min(size, 1u << 30);
+		adler = adler32(adler, data, n);
+		data += n;
+		size -= n;
+	}
+	return adler;
+}
+
+/*
+ * The zlib stream header: 32K window, deflate, with the level hint zlib
+ * itself would write.
+ */
+static void write_zlib_header(uint8_t *out)
+{
+	int level_flags;
+	if (compression_level < 2)
+		level_flags = 0;
+	else if (compression_level < 6)
+		level_flags = 1;
+	else if (compression_level == 6)
+		level_flags = 2;
+	else
+		level_flags = 3;
+	unsigned header = (0x78 << 8) | (level_flags << 6);
+	header += 31 - (header % 31);
+	out[0] = header >> 8;
+	out[1] = header & 0xff;
+}
+
+/*
+ * Compress `size` bytes of `src` into a zlib stream, at the level set with
+ * zlib_set_level. Returns a newly allocated buffer.
+ */
+uint8_t *zlib_compress(const uint8_t *src, size_t size, size_t *size_out)
+{
+	if (size < PARALLEL_THRESHOLD) {
+		unsigned long len = compressBound(size);
+		uint8_t *dst = xmalloc(len);
+		if (compress2(dst, &len, src, size, compression_level) != Z_OK)
+			ALICE_ERROR("compress failed");
+		*size_out = len;
+		return dst;
+	}
+
+	size_t nr_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	struct deflate_block *blocks = xcalloc(nr_blocks, sizeof(struct deflate_block));
+	int nr_jobs = compression_jobs < 1 ? thread_pool_nr_cpus() : compression_jobs;
+	struct thread_pool *pool = nr_jobs > 1 ? thread_pool_new(nr_jobs) : NULL;
+	for (size_t i = 0; i < nr_blocks; i++) {
+		size_t off = i * BLOCK_SIZE;
+		blocks[i].data = src + off;
+		blocks[i].size = min(BLOCK_SIZE, size - off);
+		blocks[i].dict_size = min(off, DICT_SIZE);
+		blocks[i].last = i == nr_blocks - 1;
+		// with a single job the same blocks are deflated synchronously
+		if (pool)
+			thread_pool_submit(pool, &blocks[i].job, deflate_block);
+		else
+			deflate_block(&blocks[i].job);
+	}
+	uint32_t adler = adler32_all(src, size);
+	if (pool)
+		thread_pool_free(pool);
+
+	size_t out_size = 2 + 4;
+	for (size_t i = 0; i < nr_blocks; i++) {
+		if (!blocks[i].ok)
+			ALICE_ERROR("compress failed");
+		out_size += blocks[i].out_size;
+	}
+
+	uint8_t *out = xmalloc(out_size);
+	write_zlib_header(out);
+	size_t pos = 2;
+	for (size_t i = 0; i < nr_blocks; i++) {
+		memcpy(out + pos, blocks[i].out, blocks[i].out_size);
+		pos += blocks[i].out_size;
+		free(blocks[i].out);
+	}
+	out[pos++] = adler >> 24;
+	out[pos++] = adler >> 16;
+	out[pos++] = adler >> 8;
+	out[pos++] = adler;
+	free(blocks);
+
+	*size_out = out_size;
+	return out;
+}
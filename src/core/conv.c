@@ -89,11 +89,14 @@ static char *convert_text(iconv_t cd, const char *str, size_t len)
 
 static const char *input_encoding = "CP932";
 static const char *output_encoding = "UTF-8";
-static iconv_t output_conv = (iconv_t)-1;
-static iconv_t input_conv = (iconv_t)-1;
-static iconv_t utf8_conv = (iconv_t)-1;
-static iconv_t output_utf8_conv = (iconv_t)-1;
-static iconv_t utf8_input_conv = (iconv_t)-1;
+
+// iconv descriptors carry conversion state, so each thread opens its own.
+// Encodings should be set before any worker threads are started.
+static _Thread_local iconv_t output_conv = (iconv_t)-1;
+static _Thread_local iconv_t input_conv = (iconv_t)-1;
+static _Thread_local iconv_t utf8_conv = (iconv_t)-1;
+static _Thread_local iconv_t output_utf8_conv = (iconv_t)-1;
+static _Thread_local iconv_t utf8_input_conv = (iconv_t)-1;
 
 static void free_conv(iconv_t *conv)
 {
@@ -103,15 +106,24 @@ static void free_conv(iconv_t *conv)
 	}
 }
 
+/*
+ * Close the calling thread's iconv descriptors. Worker threads must call this
+ * before exiting.
+ */
+void conv_thread_fini(void)
+{
+	free_conv(&output_conv);
+	free_conv(&input_conv);
+	free_conv(&utf8_conv);
+	free_conv(&output_utf8_conv);
+	free_conv(&utf8_input_conv);
+}
+
 void set_input_encoding(const char *enc)
 {
 	if (strcmp(enc, input_encoding)) {
 		input_encoding = enc;
-		free_conv(&output_conv);
-		free_conv(&input_conv);
-		free_conv(&utf8_conv);
-		free_conv(&output_utf8_conv);
-		free_conv(&utf8_input_conv);
+		conv_thread_fini();
 	}
 }
 
@@ -119,14 +131,20 @@ void set_output_encoding(const char *enc)
 {
 	if (strcmp(enc, output_encoding)) {
 		output_encoding = enc;
-		free_conv(&output_conv);
-		free_conv(&input_conv);
-		free_conv(&utf8_conv);
-		free_conv(&output_utf8_conv);
-		free_conv(&utf8_input_conv);
+		conv_thread_fini();
 	}
 }
 
+const char *get_input_encoding(void)
+{
+	return input_encoding;
+}
+
+const char *get_output_encoding(void)
+{
+	return output_encoding;
+}
+
 void set_encodings(const char *input_enc, const char *output_enc)
 {
 	set_input_encoding(input_enc);
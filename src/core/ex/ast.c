@@ -16,6 +16,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include "system4.h"
 #include "system4/ex.h"
 #include "system4/file.h"
@@ -49,6 +50,27 @@ struct ex *ex_parse_file(const char *path)
 	return ex;
 }
 
+/*
+ * Parse the contents of the .txtex file at `path`, which were already read
+ * into memory. Included files are resolved relative to `path`.
+ */
+struct ex *ex_parse_mem(const uint8_t *data, size_t size, const char *path)
+{
+#ifdef _WIN32
+	// no fmemopen
+	return ex_parse_file(path);
+#else
+	char *basepath = strdup(path_dirname(path));
+	FILE *f = size ? fmemopen((void*)data, size, "rb") : fopen("/dev/null", "rb");
+	if (!f)
+		ALICE_ERROR("fmemopen: %s", strerror(errno));
+	struct ex *ex = ex_parse(f, basepath);
+	fclose(f);
+	free(basepath);
+	return ex;
+#endif
+}
+
 /*
  * Values
  */
@@ -41,7 +41,9 @@ static void indent(struct port *port, int level)
 static void ex_dump_string(struct port *port, struct string *str)
 {
 	char *u = escape_string(str->text);
-	port_printf(port, "\"%s\"", u);
+	port_putc(port, '"');
+	port_put_string(port, u);
+	port_putc(port, '"');
 	free(u);
 }
 
@@ -49,7 +51,7 @@ static void ex_dump_identifier(struct port *port, struct string *s)
 {
 	// empty identifier
 	if (s->size == 0) {
-		port_printf(port, "\"\"");
+		port_put_string(port, "\"\"");
 		return;
 	}
 
@@ -72,7 +74,7 @@ static void ex_dump_identifier(struct port *port, struct string *s)
 	// FIXME: don't reencode if output format is UTF-8 (the default)
 	free(u);
 	u = conv_output(s->text);
-	port_printf(port, "%s", u);
+	port_put_string(port, u);
 	free(u);
 }
 
@@ -83,8 +85,8 @@ static void _ex_dump_tree(struct port *port, struct ex_tree *tree, int indent_le
 static void _ex_dump_value(struct port *port, struct ex_value *val, bool in_line, int indent_level)
 {
 	switch (val->type) {
-	case EX_INT:    port_printf(port, "%d", val->i); break;
-	case EX_FLOAT:  port_printf(port, "%f", val->f); break;
+	case EX_INT:    port_put_int(port, val->i); break;
+	case EX_FLOAT:  port_put_float(port, val->f); break;
 	case EX_STRING: ex_dump_string(port, val->s); break;
 	case EX_TABLE:  _ex_dump_table(port, val->t, indent_level); break;
 	case EX_LIST:   _ex_dump_list(port, val->list, in_line, indent_level); break;
@@ -101,7 +103,7 @@ void ex_dump_key_value(struct port *port, struct string *key, struct ex_value *v
 {
 	port_printf(port, "%s ", ex_strtype(val->type));
 	ex_dump_identifier(port, key);
-	port_printf(port, " = ");
+	port_put_string(port, " = ");
 	ex_dump_value(port, val);
 }
 
@@ -110,51 +112,51 @@ static void ex_dump_field(struct port *port, struct ex_field *field, int indent_
 	port_printf(port, "%s%s ", field->is_index ? "indexed " : "", ex_strtype(field->type));
 	ex_dump_identifier(port, field->name);
 	if (field->has_value) {
-		port_printf(port, " = ");
+		port_put_string(port, " = ");
 		_ex_dump_value(port, &field->value, true, indent_level);
 	}
 
 	if (field->nr_subfields) {
-		port_printf(port, " { ");
+		port_put_string(port, " { ");
 		for (uint32_t i = 0; i < field->nr_subfields; i++) {
 			ex_dump_field(port, &field->subfields[i], indent_level);
 			if (i+1 < field->nr_subfields)
-				port_printf(port, ", ");
+				port_put_string(port, ", ");
 		}
-		port_printf(port, " }");
+		port_put_string(port, " }");
 	}
 }
 
 static void ex_dump_row(struct port *port, struct ex_value *row, uint32_t nr_columns, int indent_level)
 {
-	port_printf(port, "{ ");
+	port_put_string(port, "{ ");
 	for (uint32_t i = 0; i < nr_columns; i++) {
 		_ex_dump_value(port, &row[i], true, indent_level);
 		if (i+1 < nr_columns)
-			port_printf(port, ", ");
+			port_put_string(port, ", ");
 	}
-	port_printf(port, " }");
+	port_put_string(port, " }");
 }
 
 static void ex_dump_fields(struct port *port, struct ex_table *table, int indent_level)
 {
 	indent(port, indent_level);
-	port_printf(port, "{ ");
+	port_put_string(port, "{ ");
 	for (uint32_t i = 0; i < table->nr_fields; i++) {
 		ex_dump_field(port, &table->fields[i], indent_level);
 		if (i+1 < table->nr_fields)
-			port_printf(port, ", ");
+			port_put_string(port, ", ");
 	}
-	port_printf(port, " },\n");
+	port_put_string(port, " },\n");
 }
 
 void ex_dump_table_row(struct port *port, struct ex_table *table, int row)
 {
-	port_printf(port, "{\n");
+	port_put_string(port, "{\n");
 	ex_dump_fields(port, table, 1);
 	indent(port, 1);
 	ex_dump_row(port, table->rows[row], table->nr_columns, 1);
-	port_printf(port, "\n}");
+	port_put_string(port, "\n}");
 }
 
 static void _ex_dump_table(struct port *port, struct ex_table *table, int indent_level)
@@ -220,29 +222,29 @@ static void _ex_dump_tree(struct port *port, struct ex_tree *tree, int indent_le
 {
 	if (tree->is_leaf) {
 		if (tree->leaf.value.type == EX_TABLE)
-			port_printf(port, "(table) ");
+			port_put_string(port, "(table) ");
 		else if (tree->leaf.value.type == EX_LIST)
-			port_printf(port, "(list) ");
+			port_put_string(port, "(list) ");
 		else if (tree->leaf.value.type == EX_TREE)
-			port_printf(port, "(tree) "); // shouldn't happen?
+			port_put_string(port, "(tree) "); // shouldn't happen?
 		_ex_dump_value(port, &tree->leaf.value, true, indent_level);
 		return;
 	}
 
-	port_printf(port, "{\n");
+	port_put_string(port, "{\n");
 
 	indent_level++;
 	for (uint32_t i = 0; i < tree->nr_children; i++) {
 		indent(port, indent_level);
 		ex_dump_identifier(port, tree->children[i].name);
-		port_printf(port, " = ");
+		port_put_string(port, " = ");
 		_ex_dump_tree(port, &tree->children[i], indent_level);
-		port_printf(port, ",\n");
+		port_put_string(port, ",\n");
 	}
 	indent_level--;
 
 	indent(port, indent_level);
-	port_printf(port, "}");
+	port_put_string(port, "}");
 }
 
 void ex_dump_tree(struct port *port, struct ex_tree *tree)
@@ -255,12 +257,12 @@ static void ex_dump_block(struct port *port, struct ex_block *block)
 	// type name =
 	port_printf(port, "%s ", ex_strtype(block->val.type));
 	ex_dump_identifier(port, block->name);
-	port_printf(port, " = ");
+	port_put_string(port, " = ");
 
 	// rvalue
 	switch (block->val.type) {
-	case EX_INT:    port_printf(port, "%d", block->val.i); break;
-	case EX_FLOAT:  port_printf(port, "%f", block->val.f); break;
+	case EX_INT:    port_put_int(port, block->val.i); break;
+	case EX_FLOAT:  port_put_float(port, block->val.f); break;
 	case EX_STRING: ex_dump_string(port, block->val.s); break;
 	case EX_TABLE:  ex_dump_table(port, block->val.t); break;
 	case EX_LIST:   ex_dump_list(port, block->val.list); break;
@@ -275,7 +277,7 @@ void ex_dump(struct port *port, struct ex *ex)
 	for (uint32_t i = 0; i < ex->nr_blocks; i++) {
 		ex_dump_block(port, &ex->blocks[i]);
 		if (i+1 < ex->nr_blocks)
-			port_printf(port, "\n\n");
+			port_put_string(port, "\n\n");
 	}
 	port_putc(port, '\n');
 }
@@ -302,7 +304,7 @@ void ex_dump_split(FILE *manifest, struct ex *ex, const char *dir)
 		if (fclose(out))
 			ERROR("Failed to close file '%s': %s", buf, strerror(errno));
 
-		fprintf(manifest, "#include \"%u_%s.x\"\n", i, name);
+		port_printf(&manifest_port, "#include \"%u_%s.x\"\n", i, name);
 		free(name);
 	}
 
@@ -19,7 +19,6 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
-#include <zlib.h>
 #include "system4.h"
 #include "system4/buffer.h"
 #include "system4/ex.h"
@@ -194,13 +193,8 @@ static void write_block(struct buffer *out, struct ex_block *blk)
 
 void ex_compress(struct buffer *out, size_t len, size_t *len_out)
 {
-	unsigned long dst_len = len * 1.001 + 12;
-	uint8_t *dst = xmalloc(dst_len);
-
-	int r = compress2(dst, &dst_len, out->buf+out->index, len, 1);
-	if (r != Z_OK) {
-		ERROR("compress failed");
-	}
+	size_t dst_len;
+	uint8_t *dst = zlib_compress(out->buf+out->index, len, &dst_len);
 
 	buffer_write_bytes(out, dst, dst_len);
 	*len_out = dst_len;
@@ -29,6 +29,7 @@
 #include "alice.h"
 #include "alice/ex.h"
 #include "alice/flat.h"
+#include "alice/output_writer.h"
 
 static void buffer_write_file(struct buffer *buf, const char *path)
 {
@@ -285,21 +286,18 @@ static char *serialize_bytes(const uint8_t *b, size_t size)
 	return out;
 }
 
-static void write_file(const char *path, void *data, size_t size, possibly_unused enum flat_data_type type)
+static void write_file(struct output_writer *w, const char *path, void *data, size_t size,
+		possibly_unused enum flat_data_type type)
 {
-	FILE *f = checked_fopen(path, "wb");
-	if (type == FLAT_CG) {
-		// TODO: convert to PNG
-		checked_fwrite(data, size, f);
-	} else {
-		checked_fwrite(data, size, f);
-	}
-	fclose(f);
+	// TODO: convert CGs to PNG
+	// data points into the .flat file, which outlives the writer
+	output_writer_write(w, path, data, size, true, NULL, NULL);
 }
 
-static void write_section(const char *path, struct flat_archive *flat, struct flat_section *section)
+static void write_section(struct output_writer *w, const char *path, struct flat_archive *flat,
+		struct flat_section *section)
 {
-	write_file(path, flat->data + section->off, section->size + 8, 0);
+	write_file(w, path, flat->data + section->off, section->size + 8, 0);
 }
 
 void flat_extract(struct flat_archive *flat, const char *output_file)
@@ -307,6 +305,7 @@ void flat_extract(struct flat_archive *flat, const char *output_file)
 	FILE *out = checked_fopen(output_file, "wb");
 	char *prefix = escape_string_noconv(output_file);
 	char path_buf[PATH_MAX];
+	struct output_writer *w = output_writer_new(0);
 
 	// ELNA section
 	fprintf(out, "int elna = %d;\n\n", flat->elna.present ? 1 : 0);
@@ -314,19 +313,19 @@ void flat_extract(struct flat_archive *flat, const char *output_file)
 	// FLAT section
 	fprintf(out, "string flat = \"%s.head\";\n\n", prefix);
 	snprintf(path_buf, PATH_MAX-1, "%s.head", output_file);
-	write_section(path_buf, flat, &flat->flat);
+	write_section(w, path_buf, flat, &flat->flat);
 
 	// TMNL section
 	if (flat->tmnl.present) {
 		fprintf(out, "string tmnl = \"%s.tmnl\";\n\n", prefix);
 		snprintf(path_buf, PATH_MAX-1, "%s.tmnl", output_file);
-		write_section(path_buf, flat, &flat->tmnl);
+		write_section(w, path_buf, flat, &flat->tmnl);
 	}
 
 	// MTLC section
 	fprintf(out, "string mtlc = \"%s.mtlc\";\n\n", prefix);
 	snprintf(path_buf, PATH_MAX-1, "%s.mtlc", output_file);
-	write_section(path_buf, flat, &flat->mtlc);
+	write_section(w, path_buf, flat, &flat->mtlc);
 
 	// LIBL section
 	fprintf(out, "table libl = {\n");
@@ -341,7 +340,7 @@ void flat_extract(struct flat_archive *flat, const char *output_file)
 
 		// write file
 		snprintf(path_buf, PATH_MAX-1, "%s.libl.%d.%s", output_file, i, ext);
-		write_file(path_buf, flat->data + e->off, e->size, e->type);
+		write_file(w, path_buf, flat->data + e->off, e->size, e->type);
 	}
 	fprintf(out, "};\n");
 
@@ -364,11 +363,12 @@ void flat_extract(struct flat_archive *flat, const char *output_file)
 
 			// write file
 			snprintf(path_buf, PATH_MAX-1, "%s.talt.%d.%s", output_file, i, ext);
-			write_file(path_buf, flat->data + e->off, e->size, FLAT_CG);
+			write_file(w, path_buf, flat->data + e->off, e->size, FLAT_CG);
 		}
 		fprintf(out, "};\n");
 	}
 
+	output_writer_free(w);
 	free(prefix);
 	fclose(out);
 }
@@ -0,0 +1,446 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+#include "system4.h"
+#include "system4/file.h"
+#include "alice.h"
+#include "alice/output_writer.h"
+#include "alice/thread_pool.h"
+#include "khash.h"
+
+// maximum number of queued writes
+#define MAX_PENDING 256
+
+#ifdef HAVE_LIBURING
+// number of prepared requests before the submission queue is flushed
+#define URING_BATCH 32
+#endif
+
+KHASH_SET_INIT_STR(dir_set);
+
+struct write_req {
+	struct thread_job job;
+	struct output_writer *w;
+	struct write_req *next;
+	char *path;
+	int fd;
+	const uint8_t *data;
+	size_t size;
+	void (*release)(void*);
+	void *arg;
+	// errno value if writing failed
+	int error;
+#ifdef HAVE_LIBURING
+	int nr_cqes;
+#endif
+};
+
+struct output_writer {
+	pthread_mutex_t mutex;
+	khash_t(dir_set) *dirs;
+	unsigned nr_pending;
+	// statistics
+	uint64_t nr_files;
+	uint64_t nr_bytes;
+	struct timespec start;
+#ifdef HAVE_LIBURING
+	bool uring;
+	struct io_uring ring;
+	unsigned nr_prepared;
+#endif
+	// thread pool backend
+	struct thread_pool *pool;
+	struct write_req *head;
+	struct write_req *tail;
+};
+
+#ifdef HAVE_LIBURING
+/*
+ * Check that the kernel supports the operations used by the io_uring backend
+ * (write and close were added in Linux 5.6).
+ */
+static bool uring_supported(struct io_uring *ring)
+{
+	struct io_uring_probe *probe = io_uring_get_probe_ring(ring);
+	if (!probe)
+		return false;
+	bool ok = io_uring_opcode_supported(probe, IORING_OP_WRITE)
+		&& io_uring_opcode_supported(probe, IORING_OP_CLOSE);
+	io_uring_free_probe(probe);
+	return ok;
+}
+#endif
+
+struct output_writer *output_writer_new(int nr_jobs)
+{
+	struct output_writer *w = xcalloc(1, sizeof(struct output_writer));
+	pthread_mutex_init(&w->mutex, NULL);
+	w->dirs = kh_init(dir_set);
+	clock_gettime(CLOCK_MONOTONIC, &w->start);
+#ifdef HAVE_LIBURING
+	// two SQEs (write + close) per request
+	if (!io_uring_queue_init(MAX_PENDING * 2, &w->ring, 0)) {
+		if (uring_supported(&w->ring)) {
+			w->uring = true;
+			return w;
+		}
+		io_uring_queue_exit(&w->ring);
+	}
+#endif
+	w->pool = thread_pool_new(nr_jobs);
+	return w;
+}
+
+static void req_complete(struct write_req *req)
+{
+	struct output_writer *w = req->w;
+	if (req->error)
+		ALICE_ERROR("Error writing %s: %s", req->path, strerror(req->error));
+	w->nr_files++;
+	w->nr_bytes += req->size;
+	if (req->release)
+		req->release(req->arg);
+	w->nr_pending--;
+	free(req->path);
+	free(req);
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t n = write(fd, data, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+#ifdef HAVE_LIBURING
+static bool pwrite_all(int fd, const uint8_t *data, size_t size, off_t offset)
+{
+	while (size > 0) {
+		ssize_t n = pwrite(fd, data, size, offset);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += n;
+		size -= n;
+		offset += n;
+	}
+	return true;
+}
+#endif
+
+/*
+ * Thread pool backend: each request is written by a worker thread. Finished
+ * requests are reaped in submission order while holding the writer's lock.
+ */
+
+static void req_run(struct thread_job *job)
+{
+	struct write_req *req = (struct write_req*)job;
+	if (!write_all(req->fd, req->data, req->size))
+		req->error = errno;
+	if (close(req->fd) && !req->error)
+		req->error = errno;
+}
+
+static void pool_reap(struct output_writer *w, unsigned max_pending)
+{
+	while (w->head) {
+		struct write_req *req = w->head;
+		if (!thread_pool_job_done(w->pool, &req->job)) {
+			if (w->nr_pending <= max_pending)
+				break;
+			thread_pool_wait_job(w->pool, &req->job);
+		}
+		w->head = req->next;
+		if (!w->head)
+			w->tail = NULL;
+		req_complete(req);
+	}
+}
+
+static void pool_submit(struct output_writer *w, struct write_req *req)
+{
+	if (w->tail)
+		w->tail->next = req;
+	else
+		w->head = req;
+	w->tail = req;
+	thread_pool_submit(w->pool, &req->job, req_run);
+	pool_reap(w, MAX_PENDING);
+}
+
+#ifdef HAVE_LIBURING
+
+/*
+ * io_uring backend: each request is a write linked to a close of the file.
+ * A short or failed write breaks the link, in which case the rest of the
+ * write and the close are done synchronously. The write is queued at offset
+ * 0, which doesn't move the file position, so the rest is written with
+ * pwrite.
+ */
+
+#define CQE_CLOSE 1
+
+static void uring_handle_cqe(struct output_writer *w, struct io_uring_cqe *cqe)
+{
+	uintptr_t data = (uintptr_t)io_uring_cqe_get_data(cqe);
+	struct write_req *req = (struct write_req*)(data & ~(uintptr_t)CQE_CLOSE);
+	if (data & CQE_CLOSE) {
+		// cancelled (broken link): close it ourselves
+		if (cqe->res == -ECANCELED) {
+			if (close(req->fd) && !req->error)
+				req->error = errno;
+		} else if (cqe->res < 0 && !req->error) {
+			req->error = -cqe->res;
+		}
+	} else if (cqe->res < 0) {
+		req->error = -cqe->res;
+	} else if ((size_t)cqe->res < req->size) {
+		if (!pwrite_all(req->fd, req->data + cqe->res, req->size - cqe->res, cqe->res))
+			req->error = errno;
+	}
+	if (--req->nr_cqes == 0)
+		req_complete(req);
+}
+
+static void uring_submit_prepared(struct output_writer *w)
+{
+	if (!w->nr_prepared)
+		return;
+	int r = io_uring_submit(&w->ring);
+	if (r < 0)
+		ALICE_ERROR("io_uring_submit: %s", strerror(-r));
+	w->nr_prepared = 0;
+}
+
+static void uring_reap(struct output_writer *w, unsigned max_pending)
+{
+	struct io_uring_cqe *cqe;
+	while (io_uring_peek_cqe(&w->ring, &cqe) == 0) {
+		uring_handle_cqe(w, cqe);
+		io_uring_cqe_seen(&w->ring, cqe);
+	}
+	while (w->nr_pending > max_pending) {
+		uring_submit_prepared(w);
+		int r = io_uring_wait_cqe(&w->ring, &cqe);
+		if (r < 0) {
+			if (r == -EINTR)
+				continue;
+			ALICE_ERROR("io_uring_wait_cqe: %s", strerror(-r));
+		}
+		uring_handle_cqe(w, cqe);
+		io_uring_cqe_seen(&w->ring, cqe);
+	}
+}
+
+static void uring_submit(struct output_writer *w, struct write_req *req)
+{
+	// make room for this request
+	uring_reap(w, MAX_PENDING - 1);
+
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&w->ring);
+	io_uring_prep_write(sqe, req->fd, req->data, req->size, 0);
+	io_uring_sqe_set_data(sqe, req);
+	sqe->flags |= IOSQE_IO_LINK;
+
+	sqe = io_uring_get_sqe(&w->ring);
+	io_uring_prep_close(sqe, req->fd);
+	io_uring_sqe_set_data(sqe, (void*)((uintptr_t)req | CQE_CLOSE));
+
+	req->nr_cqes = 2;
+	if (++w->nr_prepared >= URING_BATCH)
+		uring_submit_prepared(w);
+}
+
+#endif /* HAVE_LIBURING */
+
+static void reap(struct output_writer *w, unsigned max_pending)
+{
+#ifdef HAVE_LIBURING
+	if (w->uring) {
+		uring_reap(w, max_pending);
+		return;
+	}
+#endif
+	pool_reap(w, max_pending);
+}
+
+void output_writer_flush(struct output_writer *w)
+{
+	pthread_mutex_lock(&w->mutex);
+	reap(w, 0);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+void output_writer_free(struct output_writer *w)
+{
+	output_writer_flush(w);
+
+	if (w->nr_files) {
+		struct timespec end;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		double secs = (end.tv_sec - w->start.tv_sec) + (end.tv_nsec - w->start.tv_nsec) / 1e9;
+		double mib = w->nr_bytes / (1024.0 * 1024.0);
+		NOTICE("Wrote %llu files (%.1f MiB) in %.2fs (%.0f files/s, %.1f MiB/s)",
+				(unsigned long long)w->nr_files, mib, secs,
+				secs > 0 ? w->nr_files / secs : 0.0, secs > 0 ? mib / secs : 0.0);
+	}
+
+#ifdef HAVE_LIBURING
+	if (w->uring)
+		io_uring_queue_exit(&w->ring);
+#endif
+	if (w->pool)
+		thread_pool_free(w->pool);
+	for (khiter_t k = kh_begin(w->dirs); k != kh_end(w->dirs); k++) {
+		if (kh_exist(w->dirs, k))
+			free((char*)kh_key(w->dirs, k));
+	}
+	kh_destroy(dir_set, w->dirs);
+	pthread_mutex_destroy(&w->mutex);
+	free(w);
+}
+
+void output_writer_mkdir_for_file(struct output_writer *w, const char *path)
+{
+	const char *sep = strrchr(path, '/');
+#ifdef _WIN32
+	const char *bsep = strrchr(path, '\\');
+	if (bsep && (!sep || bsep > sep))
+		sep = bsep;
+#endif
+	if (!sep || sep == path)
+		return;
+
+	char *dir = xmalloc(sep - path + 1);
+	memcpy(dir, path, sep - path);
+	dir[sep - path] = '\0';
+
+	pthread_mutex_lock(&w->mutex);
+	bool known = kh_get(dir_set, w->dirs, dir) != kh_end(w->dirs);
+	pthread_mutex_unlock(&w->mutex);
+	if (known) {
+		free(dir);
+		return;
+	}
+
+	// mkdir_p tolerates directories created concurrently by another thread
+	mkdir_p(dir);
+
+	int ret;
+	pthread_mutex_lock(&w->mutex);
+	kh_put(dir_set, w->dirs, dir, &ret);
+	pthread_mutex_unlock(&w->mutex);
+	if (!ret)
+		free(dir);
+}
+
+int output_writer_open(possibly_unused struct output_writer *w, const char *path, bool overwrite)
+{
+#ifdef _WIN32
+	// go through stdio for UTF-8 path handling
+	if (!overwrite && file_exists(path))
+		return -1;
+	FILE *f = checked_fopen(path, "wb");
+	int fd = dup(fileno(f));
+	fclose(f);
+	if (fd < 0)
+		ALICE_ERROR("dup: %s", strerror(errno));
+	return fd;
+#else
+	// replace rather than truncate an existing file: it may be hard-linked
+	// to another output by ar dedup
+	if (overwrite && unlink(path) && errno != ENOENT)
+		ALICE_ERROR("unlink(\"%s\"): %s", path, strerror(errno));
+	int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		if (errno == EEXIST)
+			return -1;
+		ALICE_ERROR("open(\"%s\"): %s", path, strerror(errno));
+	}
+	return fd;
+#endif
+}
+
+bool output_writer_write(struct output_writer *w, const char *path, const void *data, size_t size,
+		bool overwrite, void (*release)(void*), void *arg)
+{
+	int fd = output_writer_open(w, path, overwrite);
+	if (fd < 0)
+		return false;
+
+	struct write_req *req = xcalloc(1, sizeof(struct write_req));
+	req->w = w;
+	req->path = xstrdup(path);
+	req->fd = fd;
+	req->data = data;
+	req->size = size;
+	req->release = release;
+	req->arg = arg;
+
+	pthread_mutex_lock(&w->mutex);
+	w->nr_pending++;
+#ifdef HAVE_LIBURING
+	if (w->uring)
+		uring_submit(w, req);
+	else
+#endif
+		pool_submit(w, req);
+	pthread_mutex_unlock(&w->mutex);
+	return true;
+}
+
+bool output_writer_write_sync(struct output_writer *w, const char *path, const void *data,
+		size_t size, bool overwrite)
+{
+	int fd = output_writer_open(w, path, overwrite);
+	if (fd < 0)
+		return false;
+	if (!write_all(fd, data, size) || close(fd))
+		ALICE_ERROR("Error writing %s: %s", path, strerror(errno));
+	output_writer_account(w, size);
+	return true;
+}
+
+void output_writer_account(struct output_writer *w, uint64_t size)
+{
+	pthread_mutex_lock(&w->mutex);
+	w->nr_files++;
+	w->nr_bytes += size;
+	pthread_mutex_unlock(&w->mutex);
+}
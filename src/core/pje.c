@@ -23,6 +23,7 @@
 #include "system4.h"
 #include "system4/afa.h"
 #include "system4/ain.h"
+#include "system4/archive.h"
 #include "system4/ex.h"
 #include "system4/file.h"
 #include "system4/ini.h"
@@ -239,6 +240,8 @@ static void pje_parse(const char *path, struct pje_config *config)
 			config->pact_input = string_path_join(pje_dir, pje_string_ptr(&ini[i])->text);
 		} else if (!strcmp(ini[i].name->text, "PactInputSize")) {
 			config->pact_input_size = pje_integer(&ini[i]);
+		} else if (!strcmp(ini[i].name->text, "CompressionLevel")) {
+			zlib_set_level(pje_integer(&ini[i]));
 		} else if (!strcmp(ini[i].name->text, "PactName")) {
 			config->pact_name = pje_string(&ini[i]);
 		} else if (!strcmp(ini[i].name->text, "Archives")) {
@@ -812,9 +815,6 @@ static void pje_build_pact(struct pje_config *config, struct build_job *job)
 	kv_init(dst_files);
 	ar_to_file_list(&ar->ar, &dst_files);
 
-	// close input pact .afa
-	archive_free(&ar->ar);
-
 	// get list of .txtex source files
 	ar_file_list src_files;
 	kv_init(src_files);
@@ -840,12 +840,16 @@ static void pje_build_pact(struct pje_config *config, struct build_job *job)
 		}
 		// if matching file was found, append .ex data to it
 		if (dst) {
-			assert(dst->type == AR_FILE_SPEC_MEM);
+			assert(dst->type == AR_FILE_SPEC_ARCHIVE);
 			// append src file to dst file
-			struct ex *dst_ex = ex_read(dst->mem.data, dst->mem.size);
+			struct archive_data *data = dst->archive.data;
+			if (!archive_load_file(data))
+				ALICE_ERROR("Error loading archive file: %s", dst->name->text);
+			struct ex *dst_ex = ex_read(data->data, data->size);
 			ex_append(dst_ex, src_ex);
 			// update dst file in file list
-			free(dst->mem.data);
+			archive_free_data(data);
+			dst->type = AR_FILE_SPEC_MEM;
 			dst->mem.data = ex_write_mem(dst_ex, &dst->mem.size);
 			ex_free(dst_ex);
 		}
@@ -869,13 +873,16 @@ static void pje_build_pact(struct pje_config *config, struct build_job *job)
 	// write dst_files to new .afa
 	struct string *out = string_path_join(config->output_dir, config->pact_name->text);
 	NOTICE("AFA    %s", out->text);
-	write_afa(out, dst_files.a, dst_files.n, 2);
+	write_afa(out, dst_files.a, dst_files.n, NULL);
 
 	free_string(out);
 	ar_file_list_free(&dst_files);
 	ar_file_list_free(&src_files);
 	kv_destroy(dst_files);
 	kv_destroy(src_files);
+
+	// close input pact .afa
+	archive_free(&ar->ar);
 }
 
 static struct ar_manifest *pje_make_manifest(struct string *out, struct batchpack_list *list)
@@ -899,7 +906,7 @@ static void pje_build_archive(struct pje_config *config, struct string *out_name
 	struct string *out_path = string_path_join(config->output_dir, out_name->text);
 	struct ar_manifest *ar = pje_make_manifest(out_path, list);
 	NOTICE("AFA    %s", ar->output_path->text);
-	ar_pack_manifest(ar, 2);
+	ar_pack_manifest(ar, NULL);
 	pje_free_manifest(ar);
 }
 
@@ -908,7 +915,7 @@ static void pje_build_archives(struct pje_config *config, struct build_job *job)
 	for (unsigned i = 0; i < config->archives.n; i++) {
 		struct string *path = string_path_join(config->pje_dir, config->archives.items[i]->text);
 		NOTICE("AFA    %s", path->text);
-		ar_pack(path->text, 2);
+		ar_pack(path->text, NULL);
 		free_string(path);
 	}
 
@@ -14,94 +14,465 @@
  * along with this program; if not, see <http://gnu.org/licenses/>.
  */
 
+
+#include <errno.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#endif
 #include "system4.h"
-#include "system4/buffer.h"
 #include "system4/file.h"
 #include "alice.h"
 #include "alice/port.h"
+#include "kvec.h"
+
+// size of the output buffer of file and gzip ports
+#define PORT_BUFFER_SIZE (256 * 1024)
+
+// mmap ports extend the output file by at least this much at a time
+#define PORT_MMAP_STEP (16 * 1024 * 1024)
+
+static void port_set_error(struct port *port, int err)
+{
+	if (!port->error)
+		port->err = err;
+	port->error = true;
+}
 
 void port_buffer_init(struct port *port)
 {
+	memset(port, 0, sizeof(struct port));
 	port->type = PORT_TYPE_BUFFER;
-	buffer_init(&port->buffer, NULL, 0);
+	port->fd = -1;
 }
 
-void port_file_init(struct port *port, FILE *f)
+static void port_init_file(struct port *port, enum port_type type, FILE *f, bool need_close)
 {
-	port->type = PORT_TYPE_FILE;
+	memset(port, 0, sizeof(struct port));
+	port->type = type;
+	port->buf = xmalloc(PORT_BUFFER_SIZE);
+	port->cap = PORT_BUFFER_SIZE;
 	port->file = f;
-	port->need_close = false;
+	port->need_close = need_close;
+	port->fd = -1;
+}
+
+void port_file_init(struct port *port, FILE *f)
+{
+	port_init_file(port, PORT_TYPE_FILE, f, false);
 }
 
 bool port_file_open(struct port *port, const char *path)
 {
-	port->type = PORT_TYPE_FILE;
-	port->file = file_open_utf8(path, "wb");
-	port->need_close = true;
-	return !!port->file;
+	FILE *f = file_open_utf8(path, "wb");
+	if (!f)
+		return false;
+	port_init_file(port, PORT_TYPE_FILE, f, true);
+	return true;
+}
+
+static void gzip_init(struct port *port)
+{
+	z_stream *z = xcalloc(1, sizeof(z_stream));
+	// windowBits + 16 = gzip header
+	if (deflateInit2(z, zlib_get_level(), Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		ALICE_ERROR("deflateInit2 failed");
+	port->zstream = z;
+}
+
+void port_gzip_init(struct port *port, FILE *f)
+{
+	port_init_file(port, PORT_TYPE_GZIP, f, false);
+	gzip_init(port);
+}
+
+bool port_gzip_open(struct port *port, const char *path)
+{
+	FILE *f = file_open_utf8(path, "wb");
+	if (!f)
+		return false;
+	port_init_file(port, PORT_TYPE_GZIP, f, true);
+	gzip_init(port);
+	return true;
+}
+
+#ifndef _WIN32
+/*
+ * The output file of an mmap port is extended ahead of the data. Open mmap
+ * ports are tracked so that the file can be truncated to the data written if
+ * the program exits (e.g. via ALICE_ERROR) before the port is closed.
+ */
+kv_decl(port_list, struct port*);
+static port_list mmap_ports = {0};
+static pthread_mutex_t mmap_ports_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void mmap_ports_truncate(void)
+{
+	pthread_mutex_lock(&mmap_ports_mutex);
+	for (size_t i = 0; i < kv_size(mmap_ports); i++) {
+		struct port *port = kv_A(mmap_ports, i);
+		if (ftruncate(port->fd, port->len)) {
+			// nothing more can be done at exit
+		}
+	}
+	pthread_mutex_unlock(&mmap_ports_mutex);
+}
+
+static void mmap_ports_add(struct port *port)
+{
+	static bool registered = false;
+	pthread_mutex_lock(&mmap_ports_mutex);
+	if (!registered) {
+		atexit(mmap_ports_truncate);
+		registered = true;
+	}
+	kv_push(struct port*, mmap_ports, port);
+	pthread_mutex_unlock(&mmap_ports_mutex);
+}
+
+static void mmap_ports_remove(struct port *port)
+{
+	pthread_mutex_lock(&mmap_ports_mutex);
+	for (size_t i = 0; i < kv_size(mmap_ports); i++) {
+		if (kv_A(mmap_ports, i) == port) {
+			kv_A(mmap_ports, i) = kv_A(mmap_ports, kv_size(mmap_ports) - 1);
+			mmap_ports.n--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mmap_ports_mutex);
+}
+#endif
+
+bool port_mmap_open(struct port *port, const char *path)
+{
+#ifndef _WIN32
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		return false;
+
+	struct stat s;
+	if (fstat(fd, &s) || !S_ISREG(s.st_mode)) {
+		close(fd);
+		return port_file_open(port, path);
+	}
+
+	memset(port, 0, sizeof(struct port));
+	port->type = PORT_TYPE_MMAP;
+	port->fd = fd;
+	mmap_ports_add(port);
+	return true;
+#else
+	return port_file_open(port, path);
+#endif
+}
+
+#ifndef _WIN32
+static bool write_all(int fd, struct iovec *iov, int n)
+{
+	while (n > 0) {
+		ssize_t r = writev(fd, iov, n);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		// skip the vectors that were written completely
+		for (; n > 0 && (size_t)r >= iov->iov_len; iov++, n--) {
+			r -= iov->iov_len;
+		}
+		if (n > 0) {
+			iov->iov_base = (uint8_t*)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+	return true;
+}
+#endif
+
+/*
+ * Write the buffered data followed by `data` to a file port's file.
+ */
+static bool file_port_write(struct port *port, const uint8_t *data, size_t size)
+{
+#ifdef _WIN32
+	if (port->len && fwrite(port->buf, port->len, 1, port->file) != 1)
+		return false;
+	return !size || fwrite(data, size, 1, port->file) == 1;
+#else
+	// anything written to the FILE directly comes first
+	if (fflush(port->file))
+		return false;
+	struct iovec iov[2] = {
+		{ .iov_base = port->buf, .iov_len = port->len },
+		{ .iov_base = (void*)data, .iov_len = size },
+	};
+	return write_all(fileno(port->file), iov, 2);
+#endif
+}
+
+static bool gzip_deflate(struct port *port, const uint8_t *data, size_t size, int flush)
+{
+	z_stream *z = port->zstream;
+	uint8_t out[64 * 1024];
+	do {
+		// avail_in is 32 bits wide
+		uInt n = size > (1u << 30) ? (1u << 30) : size;
+		z->next_in = (Bytef*)data;
+		z->avail_in = n;
+		data += n;
+		size -= n;
+		int f = size ? Z_NO_FLUSH : flush;
+		do {
+			z->next_out = out;
+			z->avail_out = sizeof(out);
+			if (deflate(z, f) == Z_STREAM_ERROR) {
+				errno = EIO;
+				return false;
+			}
+			size_t len = sizeof(out) - z->avail_out;
+			if (len && fwrite(out, len, 1, port->file) != 1)
+				return false;
+		} while (z->avail_out == 0);
+	} while (size);
+	return true;
+}
+
+/*
+ * Write the buffered data followed by `data` to the underlying file, and empty
+ * the buffer.
+ */
+static void port_flush_data(struct port *port, const uint8_t *data, size_t size)
+{
+	bool ok = true;
+	switch (port->type) {
+	case PORT_TYPE_FILE:
+		ok = file_port_write(port, data, size);
+		break;
+	case PORT_TYPE_GZIP:
+		ok = gzip_deflate(port, port->buf, port->len, Z_NO_FLUSH)
+			&& gzip_deflate(port, data, size, Z_NO_FLUSH);
+		break;
+	case PORT_TYPE_BUFFER:
+	case PORT_TYPE_MMAP:
+		return;
+	}
+	if (!ok)
+		port_set_error(port, errno);
+	port->len = 0;
+}
+
+#ifndef _WIN32
+static void mmap_grow(struct port *port, size_t n)
+{
+	size_t size = max(max(port->cap * 2, port->len + n), PORT_MMAP_STEP);
+	if (port->buf)
+		munmap(port->buf, port->cap);
+	// allocate the blocks up front, so that running out of space is an
+	// error here rather than SIGBUS later
+	int r = posix_fallocate(port->fd, 0, size);
+	if (r)
+		ALICE_ERROR("Failed to extend output file: %s", strerror(r));
+	port->buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, port->fd, 0);
+	if (port->buf == MAP_FAILED)
+		ALICE_ERROR("mmap: %s", strerror(errno));
+	port->cap = size;
+}
+#endif
+
+/*
+ * Make room for at least `n` more bytes in the output buffer.
+ */
+static void port_grow(struct port *port, size_t n)
+{
+	switch (port->type) {
+	case PORT_TYPE_BUFFER:
+		port->cap = max(max(port->cap * 2, port->len + n), 256);
+		port->buf = xrealloc(port->buf, port->cap);
+		break;
+	case PORT_TYPE_FILE:
+	case PORT_TYPE_GZIP:
+		port_flush_data(port, NULL, 0);
+		if (n > port->cap) {
+			port->cap = n;
+			port->buf = xrealloc(port->buf, port->cap);
+		}
+		break;
+	case PORT_TYPE_MMAP:
+#ifndef _WIN32
+		mmap_grow(port, n);
+#endif
+		break;
+	}
+}
+
+static inline uint8_t *port_reserve(struct port *port, size_t n)
+{
+	if (port->cap - port->len < n)
+		port_grow(port, n);
+	return port->buf + port->len;
 }
 
 uint8_t *port_buffer_get(struct port *port, size_t *size_out)
 {
 	if (size_out)
-		*size_out = port->buffer.size;
-	buffer_write_int8(&port->buffer, '\0');
-	uint8_t *data = port->buffer.buf;
-	buffer_init(&port->buffer, NULL, 0);
+		*size_out = port->len;
+	*port_reserve(port, 1) = '\0';
+	uint8_t *data = port->buf;
+	port->buf = NULL;
+	port->len = 0;
+	port->cap = 0;
 	return data;
 }
 
-void port_close(struct port *port)
+bool port_flush(struct port *port)
 {
-	if (port->type == PORT_TYPE_BUFFER) {
-		free(port->buffer.buf);
-		buffer_init(&port->buffer, NULL, 0);
-	} else if (port->type == PORT_TYPE_FILE) {
+	port_flush_data(port, NULL, 0);
+	if (port->file && fflush(port->file))
+		port_set_error(port, errno);
+	return !port->error;
+}
+
+bool port_close(struct port *port)
+{
+	switch (port->type) {
+	case PORT_TYPE_BUFFER:
+		break;
+	case PORT_TYPE_GZIP:
+	case PORT_TYPE_FILE:
+		port_flush_data(port, NULL, 0);
+		if (port->zstream) {
+			if (!gzip_deflate(port, NULL, 0, Z_FINISH))
+				port_set_error(port, errno);
+			deflateEnd(port->zstream);
+			free(port->zstream);
+			port->zstream = NULL;
+		}
 		if (port->need_close) {
-			fclose(port->file);
+			if (fclose(port->file))
+				port_set_error(port, errno);
 		} else {
-			fflush(port->file);
+			if (fflush(port->file))
+				port_set_error(port, errno);
 		}
 		port->file = NULL;
 		port->need_close = false;
+		break;
+	case PORT_TYPE_MMAP:
+#ifndef _WIN32
+		mmap_ports_remove(port);
+		if (port->buf)
+			munmap(port->buf, port->cap);
+		port->buf = NULL;
+		if (ftruncate(port->fd, port->len))
+			port_set_error(port, errno);
+		if (close(port->fd))
+			port_set_error(port, errno);
+		port->fd = -1;
+#endif
+		break;
 	}
+	if (port->type != PORT_TYPE_MMAP)
+		free(port->buf);
+	port->buf = NULL;
+	port->len = 0;
+	port->cap = 0;
+	return !port->error;
 }
 
 void port_printf(struct port *port, const char *fmt, ...)
 {
-	va_list ap;
+	va_list ap, ap2;
 	va_start(ap, fmt);
+	va_copy(ap2, ap);
 
-	if (port->type == PORT_TYPE_BUFFER) {
-		char tmp[4096];
-		int n = vsnprintf(tmp, 4096, fmt, ap);
-		buffer_write_bytes(&port->buffer, (uint8_t*)tmp, n);
-	} else if (port->type == PORT_TYPE_FILE) {
-		vfprintf(port->file, fmt, ap);
+	// format directly into the output buffer, growing it if necessary
+	char *dst = (char*)port_reserve(port, 1);
+	int n = vsnprintf(dst, port->cap - port->len, fmt, ap);
+	if (n >= 0 && (size_t)n >= port->cap - port->len) {
+		dst = (char*)port_reserve(port, n + 1);
+		vsnprintf(dst, n + 1, fmt, ap2);
 	}
+	if (n > 0)
+		port->len += n;
 
+	va_end(ap2);
 	va_end(ap);
 }
 
 void port_putc(struct port *port, char c)
 {
-	if (port->type == PORT_TYPE_BUFFER) {
-		buffer_write_int8(&port->buffer, (uint8_t)c);
-	} else if (port->type == PORT_TYPE_FILE) {
-		fputc(c, port->file);
+	*port_reserve(port, 1) = c;
+	port->len++;
+}
+
+void port_put_string(struct port *port, const char *str)
+{
+	size_t len = strlen(str);
+	memcpy(port_reserve(port, len), str, len);
+	port->len += len;
+}
+
+void port_put_int(struct port *port, int64_t v)
+{
+	char tmp[24];
+	int i = sizeof(tmp);
+	uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+	do {
+		tmp[--i] = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if (v < 0)
+		tmp[--i] = '-';
+	memcpy(port_reserve(port, sizeof(tmp) - i), tmp + i, sizeof(tmp) - i);
+	port->len += sizeof(tmp) - i;
+}
+
+void port_put_hex(struct port *port, uint64_t v)
+{
+	char tmp[24];
+	int i = sizeof(tmp);
+	do {
+		tmp[--i] = "0123456789abcdef"[v & 0xf];
+		v >>= 4;
+	} while (v);
+	tmp[--i] = 'x';
+	tmp[--i] = '0';
+	memcpy(port_reserve(port, sizeof(tmp) - i), tmp + i, sizeof(tmp) - i);
+	port->len += sizeof(tmp) - i;
+}
+
+void port_put_float(struct port *port, double v)
+{
+	char *dst = (char*)port_reserve(port, 64);
+	int n = snprintf(dst, 64, "%f", v);
+	if (n >= 64) {
+		dst = (char*)port_reserve(port, n + 1);
+		snprintf(dst, n + 1, "%f", v);
 	}
+	if (n > 0)
+		port->len += n;
 }
 
 bool port_write_bytes(struct port *port, uint8_t *data, size_t size)
 {
-	if (port->type == PORT_TYPE_BUFFER) {
-		buffer_write_bytes(&port->buffer, data, size);
-		return true;
-	} else if (port->type == PORT_TYPE_FILE) {
-		return fwrite(data, size, 1, port->file) == 1;
+	if ((port->type == PORT_TYPE_FILE || port->type == PORT_TYPE_GZIP)
+			&& size > port->cap - port->len) {
+		// write large data directly rather than copying it into the buffer
+		port_flush_data(port, data, size);
+	} else {
+		memcpy(port_reserve(port, size), data, size);
+		port->len += size;
 	}
-	return false;
+	return !port->error;
 }
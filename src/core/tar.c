@@ -0,0 +1,218 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef _WIN32
+#include <io.h>
+#endif
+#include "system4.h"
+#include "alice.h"
+#include "alice/tar.h"
+
+#define TAR_BLOCK_SIZE 512
+
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+_Static_assert(sizeof(struct tar_header) == TAR_BLOCK_SIZE, "bad tar header size");
+
+struct tar_writer {
+	int fd;
+	bool close_fd;
+	time_t mtime;
+	// bytes written since the last header
+	uint64_t written;
+};
+
+static void write_all(struct tar_writer *tar, const void *data, size_t size)
+{
+	const uint8_t *p = data;
+	while (size > 0) {
+		ssize_t n = write(tar->fd, p, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ALICE_ERROR("write: %s", strerror(errno));
+		}
+		p += n;
+		size -= n;
+	}
+}
+
+struct tar_writer *tar_open(const char *path)
+{
+	struct tar_writer *tar = xcalloc(1, sizeof(struct tar_writer));
+	if (!strcmp(path, "-")) {
+		fflush(stdout);
+		tar->fd = fileno(stdout);
+#ifdef _WIN32
+		_setmode(tar->fd, _O_BINARY);
+#endif
+	} else {
+		tar->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC
+#ifdef _WIN32
+				| O_BINARY
+#endif
+				, 0644);
+		if (tar->fd < 0)
+			ALICE_ERROR("open(\"%s\"): %s", path, strerror(errno));
+		tar->close_fd = true;
+	}
+	tar->mtime = time(NULL);
+	return tar;
+}
+
+static void tar_pad(struct tar_writer *tar)
+{
+	static const uint8_t zero[TAR_BLOCK_SIZE] = {0};
+	size_t rem = tar->written % TAR_BLOCK_SIZE;
+	if (rem)
+		write_all(tar, zero, TAR_BLOCK_SIZE - rem);
+	tar->written = 0;
+}
+
+void tar_close(struct tar_writer *tar)
+{
+	static const uint8_t zero[TAR_BLOCK_SIZE * 2] = {0};
+	tar_pad(tar);
+	write_all(tar, zero, sizeof(zero));
+	if (tar->close_fd && close(tar->fd))
+		ALICE_ERROR("close: %s", strerror(errno));
+	free(tar);
+}
+
+int tar_fd(struct tar_writer *tar)
+{
+	return tar->fd;
+}
+
+static void write_octal(char *field, size_t size, uint64_t n)
+{
+	// size-1 digits plus a terminating NUL
+	field[size-1] = '\0';
+	for (size_t i = size - 1; i > 0; i--) {
+		field[i-1] = '0' + (n & 7);
+		n >>= 3;
+	}
+}
+
+static void write_header_block(struct tar_writer *tar, const char *name, const char *prefix,
+		uint64_t size, char typeflag)
+{
+	struct tar_header h;
+	memset(&h, 0, sizeof(h));
+	strncpy(h.name, name, sizeof(h.name));
+	if (prefix)
+		strncpy(h.prefix, prefix, sizeof(h.prefix));
+	write_octal(h.mode, sizeof(h.mode), 0644);
+	write_octal(h.uid, sizeof(h.uid), 0);
+	write_octal(h.gid, sizeof(h.gid), 0);
+	write_octal(h.size, sizeof(h.size), size);
+	write_octal(h.mtime, sizeof(h.mtime), (uint64_t)tar->mtime);
+	h.typeflag = typeflag;
+	memcpy(h.magic, "ustar", 6);
+	memcpy(h.version, "00", 2);
+
+	unsigned sum = 0;
+	memset(h.chksum, ' ', sizeof(h.chksum));
+	for (size_t i = 0; i < sizeof(h); i++) {
+		sum += ((uint8_t*)&h)[i];
+	}
+	write_octal(h.chksum, 7, sum);
+	h.chksum[7] = ' ';
+
+	write_all(tar, &h, sizeof(h));
+}
+
+void tar_write_header(struct tar_writer *tar, const char *name, uint64_t size)
+{
+	tar_pad(tar);
+
+	size_t len = strlen(name);
+	if (len <= 100) {
+		write_header_block(tar, name, NULL, size, '0');
+		return;
+	}
+
+	// try to split the name into a ustar prefix and name at a '/'
+	for (const char *p = strchr(name, '/'); p; p = strchr(p + 1, '/')) {
+		size_t prefix_len = p - name;
+		if (prefix_len > 155)
+			break;
+		if (len - prefix_len - 1 <= 100) {
+			char prefix[156];
+			memcpy(prefix, name, prefix_len);
+			prefix[prefix_len] = '\0';
+			write_header_block(tar, p + 1, prefix, size, '0');
+			return;
+		}
+	}
+
+	// GNU long name record
+	write_header_block(tar, "././@LongLink", NULL, len + 1, 'L');
+	tar->written = 0;
+	tar_write_data(tar, name, len + 1);
+	tar_pad(tar);
+	write_header_block(tar, name, NULL, size, '0');
+}
+
+void tar_write_data(struct tar_writer *tar, const void *data, size_t size)
+{
+	write_all(tar, data, size);
+	tar->written += size;
+}
+
+void tar_write_stream(struct tar_writer *tar, FILE *f, uint64_t size)
+{
+	uint8_t buf[65536];
+	while (size > 0) {
+		size_t n = fread(buf, 1, min(size, sizeof(buf)), f);
+		if (n == 0)
+			ALICE_ERROR("fread: %s", strerror(errno));
+		tar_write_data(tar, buf, n);
+		size -= n;
+	}
+}
+
+void tar_write_range(struct tar_writer *tar, int fd, uint64_t off, uint64_t size)
+{
+	if (!copy_fd_range(fd, off, size, tar->fd))
+		ALICE_ERROR("Failed to copy file data: %s", strerror(errno));
+	tar->written += size;
+}
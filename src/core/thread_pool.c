@@ -0,0 +1,185 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "system4.h"
+#include "alice.h"
+#include "alice/thread_pool.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+struct thread_pool {
+	int nr_threads;
+	pthread_t *threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct thread_job *head;
+	struct thread_job *tail;
+	unsigned nr_pending;
+	bool shutdown;
+};
+
+int thread_pool_nr_cpus(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return max((int)info.dwNumberOfProcessors, 1);
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+#endif
+}
+
+static void *worker_main(void *_pool)
+{
+	struct thread_pool *pool = _pool;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (1) {
+		while (!pool->head && !pool->shutdown)
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+		if (!pool->head)
+			break;
+
+		// dequeue job
+		struct thread_job *job = pool->head;
+		pool->head = job->next;
+		if (!pool->head)
+			pool->tail = NULL;
+		pthread_mutex_unlock(&pool->mutex);
+
+		job->run(job);
+
+		pthread_mutex_lock(&pool->mutex);
+		job->done = true;
+		pool->nr_pending--;
+		pthread_cond_broadcast(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	conv_thread_fini();
+	return NULL;
+}
+
+struct thread_pool *thread_pool_new(int nr_threads)
+{
+	struct thread_pool *pool = xcalloc(1, sizeof(struct thread_pool));
+	pool->nr_threads = nr_threads < 1 ? thread_pool_nr_cpus() : nr_threads;
+	if (pool->nr_threads == 1)
+		return pool;
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	pool->threads = xcalloc(pool->nr_threads, sizeof(pthread_t));
+	for (int i = 0; i < pool->nr_threads; i++) {
+		int r = pthread_create(&pool->threads[i], NULL, worker_main, pool);
+		if (r)
+			ALICE_ERROR("pthread_create: %s", strerror(r));
+	}
+	return pool;
+}
+
+int thread_pool_size(struct thread_pool *pool)
+{
+	return pool->nr_threads;
+}
+
+void thread_pool_submit(struct thread_pool *pool, struct thread_job *job, void (*run)(struct thread_job*))
+{
+	job->run = run;
+	job->next = NULL;
+	job->done = false;
+
+	// synchronous pool
+	if (!pool->threads) {
+		job->run(job);
+		job->done = true;
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->tail)
+		pool->tail->next = job;
+	else
+		pool->head = job;
+	pool->tail = job;
+	pool->nr_pending++;
+	pthread_cond_signal(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+bool thread_pool_job_done(struct thread_pool *pool, struct thread_job *job)
+{
+	if (!pool->threads)
+		return job->done;
+
+	pthread_mutex_lock(&pool->mutex);
+	bool done = job->done;
+	pthread_mutex_unlock(&pool->mutex);
+	return done;
+}
+
+void thread_pool_wait_job(struct thread_pool *pool, struct thread_job *job)
+{
+	if (!pool->threads)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (!job->done)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+void thread_pool_wait(struct thread_pool *pool)
+{
+	if (!pool->threads)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->nr_pending)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+void thread_pool_free(struct thread_pool *pool)
+{
+	if (pool->threads) {
+		pthread_mutex_lock(&pool->mutex);
+		pool->shutdown = true;
+		pthread_cond_broadcast(&pool->work_cond);
+		pthread_mutex_unlock(&pool->mutex);
+
+		for (int i = 0; i < pool->nr_threads; i++) {
+			pthread_join(pool->threads[i], NULL);
+		}
+
+		pthread_mutex_destroy(&pool->mutex);
+		pthread_cond_destroy(&pool->work_cond);
+		pthread_cond_destroy(&pool->done_cond);
+		free(pool->threads);
+	}
+	free(pool);
+}
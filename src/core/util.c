@@ -14,6 +14,8 @@
  * along with this program; if not, see <http://gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE // copy_file_range
+
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -21,6 +23,9 @@
 #include <sys/stat.h>
 #include <libgen.h>
 #include <unistd.h>
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
 #include "system4.h"
 #include "system4/file.h"
 #include "system4/string.h"
@@ -128,6 +133,55 @@ void checked_stat(const char *path, ustat *s)
 		ALICE_ERROR("stat(\"%s\"): %s", path, strerror(errno));
 }
 
+/*
+ * Copy `size` bytes at offset `off` of `in_fd` to the current position of
+ * `out_fd`. The data is moved in-kernel (copy_file_range, then sendfile) when
+ * possible; otherwise it is bounced through a small stack buffer.
+ */
+bool copy_fd_range(int in_fd, off_t off, size_t size, int out_fd)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	while (size > 0) {
+		ssize_t n = copy_file_range(in_fd, &off, out_fd, NULL, size, 0);
+		if (n <= 0)
+			break;
+		size -= n;
+	}
+	if (!size)
+		return true;
+#endif
+#ifdef HAVE_SENDFILE
+	while (size > 0) {
+		ssize_t n = sendfile(out_fd, in_fd, &off, size);
+		if (n <= 0)
+			break;
+		size -= n;
+	}
+	if (!size)
+		return true;
+#endif
+#ifndef _WIN32
+	uint8_t buf[65536];
+	while (size > 0) {
+		ssize_t n = pread(in_fd, buf, min(size, sizeof(buf)), off);
+		if (n <= 0)
+			return false;
+		for (ssize_t written = 0; written < n;) {
+			ssize_t w = write(out_fd, buf + written, n - written);
+			if (w < 0)
+				return false;
+			written += w;
+		}
+		off += n;
+		size -= n;
+	}
+	return true;
+#else
+	errno = ENOSYS;
+	return false;
+#endif
+}
+
 void mkdir_for_file(const char *filename)
 {
 	char *tmp = xstrdup(filename);
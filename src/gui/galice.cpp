@@ -262,7 +262,10 @@ void GAlice::openAinFile(const QString &path)
 	// initialize method-struct mappings
 	ain_init_member_functions(ain, strdup);
 
-	std::shared_ptr<struct ain> ptr(ain, ain_free);
+	std::shared_ptr<struct ain> ptr(ain, [](struct ain *ain) {
+		ain_disassemble_invalidate(ain);
+		ain_free(ain);
+	});
 	emit getInstance().openedAinFile(path, ptr);
 	QGuiApplication::restoreOverrideCursor();
 }
@@ -118,6 +118,7 @@ static bool convertFormat(struct port *port, struct archive_data *dfile, FileFor
 			return false;
 		if (!(cg = cg_load_data(dfile)))
 			return false;
+		port_flush(port);
 		cg_write(cg, cg_type, port->file);
 		cg_free(cg);
 		return true;